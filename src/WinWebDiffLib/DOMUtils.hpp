@@ -4,9 +4,16 @@
 #define  RAPIDJSON_ENDIAN RAPIDJSON_LITTLEENDIAN
 #endif
 #include <rapidjson/document.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/prettywriter.h>
 #include <rapidjson/stringbuffer.h>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include "HTMLTags.hpp"
 
 using WDocument = rapidjson::GenericDocument<rapidjson::UTF16<>>;
 using WValue = rapidjson::GenericValue<rapidjson::UTF16<>>;
@@ -92,26 +99,316 @@ namespace domutils
 		}
 	}
 
-	std::pair<WValue*, WValue*> findNodeId(WValue& nodeTree, int nodeId)
+	class NodeIndex
 	{
-		if (nodeTree[L"nodeId"].GetInt() == nodeId)
+	public:
+		NodeIndex() = default;
+		explicit NodeIndex(WValue& nodeTree) { build(nodeTree); }
+
+		void build(WValue& nodeTree)
 		{
-			return { &nodeTree, nullptr };
+			m_nodes.clear();
+			add(nodeTree, nullptr);
 		}
-		if (nodeTree.HasMember(L"children") && nodeTree[L"children"].IsArray())
+
+		// Returns the node and its parent. Pointers stay valid as long as the
+		// tree is only modified in place; rebuild after inserting or removing nodes.
+		std::pair<WValue*, WValue*> find(int nodeId) const
+		{
+			auto it = m_nodes.find(nodeId);
+			if (it == m_nodes.end())
+				return { nullptr, nullptr };
+			return it->second;
+		}
+
+		size_t size() const { return m_nodes.size(); }
+
+	private:
+		void add(WValue& nodeTree, WValue* parent)
 		{
-			for (auto& child : nodeTree[L"children"].GetArray())
+			m_nodes.emplace(nodeTree[L"nodeId"].GetInt(), std::make_pair(&nodeTree, parent));
+			if (nodeTree.HasMember(L"children") && nodeTree[L"children"].IsArray())
 			{
-				auto [pvalue, pparent] = findNodeId(child, nodeId);
-				if (pvalue)
-					return { pvalue, pparent ? pparent : &nodeTree };
+				for (auto& child : nodeTree[L"children"].GetArray())
+					add(child, &nodeTree);
 			}
+			if (nodeTree.HasMember(L"contentDocument"))
+				add(nodeTree[L"contentDocument"], &nodeTree);
+		}
+
+		std::unordered_map<int, std::pair<WValue*, WValue*>> m_nodes;
+	};
+
+	// Read-only copy of a DOM.getDocument result for traversals that visit the
+	// whole page. Nodes are stored in document order in one array and linked by
+	// index, node names are interned and resolved to an htmltags::Tag once per
+	// distinct name, and node values and attributes are kept in a single string table.
+	class FlatDocument
+	{
+	public:
+		static constexpr uint32_t npos = UINT32_MAX;
+
+		struct Node
+		{
+			int nodeId = 0;
+			int nodeType = 0;
+			uint32_t name = npos;
+			htmltags::Tag tag = htmltags::TAG_OTHER;
+			uint32_t parent = npos;
+			uint32_t firstChild = npos;
+			uint32_t nextSibling = npos;
+			uint32_t contentDocument = npos;
+			uint32_t value = 0;
+			uint32_t firstAttribute = 0;
+			uint32_t attributeCount = 0;
+			bool hasChildren = false;
+		};
+
+		FlatDocument() { clear(); }
+
+		bool parse(const wchar_t* json)
+		{
+			clear();
+			rapidjson::GenericStringStream<rapidjson::UTF16<>> stream(json);
+			rapidjson::GenericReader<rapidjson::UTF16<>, rapidjson::UTF16<>> reader;
+			Handler handler(*this);
+			const bool ok = !reader.Parse<rapidjson::kParseDefaultFlags>(stream, handler).IsError();
+			if (!ok)
+				clear();
+			return ok && !m_nodes.empty();
 		}
-		if (nodeTree.HasMember(L"contentDocument"))
+
+		void clear()
 		{
-			auto [pvalue, pparent] = findNodeId(nodeTree[L"contentDocument"], nodeId);
-			return { pvalue, pparent ? pparent : &nodeTree[L"contentDocument"] };
+			m_nodes.clear();
+			m_attributes.clear();
+			m_strings.assign(1, L'\0');
+			m_names.clear();
+			m_nameTags.clear();
+			m_nameIds.clear();
 		}
-		return { nullptr, nullptr };
-	}
+
+		uint32_t root() const { return m_nodes.empty() ? npos : 0; }
+		size_t size() const { return m_nodes.size(); }
+		const Node& operator[](uint32_t index) const { return m_nodes[index]; }
+
+		const wchar_t* nodeName(uint32_t index) const
+		{
+			return m_nodes[index].name == npos ? L"" : m_names[m_nodes[index].name].c_str();
+		}
+		const wchar_t* nodeValue(uint32_t index) const { return m_strings.c_str() + m_nodes[index].value; }
+
+		// Returns the interned id of name, or npos if no node has that name
+		uint32_t findName(const wchar_t* name) const
+		{
+			auto it = m_nameIds.find(name);
+			return it == m_nameIds.end() ? npos : it->second;
+		}
+
+		const wchar_t* getAttribute(uint32_t index, const wchar_t* name) const
+		{
+			const Node& node = m_nodes[index];
+			for (uint32_t i = 0; i + 1 < node.attributeCount; i += 2)
+			{
+				if (wcscmp(m_strings.c_str() + m_attributes[node.firstAttribute + i], name) == 0)
+					return m_strings.c_str() + m_attributes[node.firstAttribute + i + 1];
+			}
+			return nullptr;
+		}
+
+		bool containsClassName(uint32_t index, const wchar_t* name) const
+		{
+			if (m_nodes[index].nodeType != NodeType::ELEMENT_NODE)
+				return false;
+			const wchar_t* className = getAttribute(index, L"class");
+			return className && wcsstr(className, name) != nullptr;
+		}
+
+	private:
+		enum class Container { None, Top, Node, Children, Attributes, Other };
+		enum class Member { Other, Root, NodeId, NodeType, NodeName, NodeValue, Children, Attributes, ContentDocument };
+
+		class Handler
+		{
+		public:
+			explicit Handler(FlatDocument& document) : m_document(document) {}
+
+			bool Null() { return true; }
+			bool Bool(bool) { return true; }
+			bool Int(int i) { return setNumber(i); }
+			bool Uint(unsigned u) { return setNumber(static_cast<int>(u)); }
+			bool Int64(int64_t) { return true; }
+			bool Uint64(uint64_t) { return true; }
+			bool Double(double) { return true; }
+			bool RawNumber(const wchar_t*, rapidjson::SizeType, bool) { return true; }
+
+			bool String(const wchar_t* str, rapidjson::SizeType length, bool)
+			{
+				if (top() == Container::Attributes)
+				{
+					m_document.m_attributes.push_back(m_document.addString(str, length));
+					++current().attributeCount;
+				}
+				else if (top() == Container::Node && m_member == Member::NodeName)
+				{
+					const uint32_t name = m_document.intern(std::wstring_view(str, length));
+					current().name = name;
+					current().tag = m_document.m_nameTags[name];
+				}
+				else if (top() == Container::Node && m_member == Member::NodeValue)
+					current().value = m_document.addString(str, length);
+				return true;
+			}
+
+			bool Key(const wchar_t* str, rapidjson::SizeType length, bool)
+			{
+				if (top() != Container::Node && top() != Container::Top)
+					return true;
+				const std::wstring_view key(str, length);
+				if (key == L"nodeId")
+					m_member = Member::NodeId;
+				else if (key == L"nodeType")
+					m_member = Member::NodeType;
+				else if (key == L"nodeName")
+					m_member = Member::NodeName;
+				else if (key == L"nodeValue")
+					m_member = Member::NodeValue;
+				else if (key == L"children")
+					m_member = Member::Children;
+				else if (key == L"attributes")
+					m_member = Member::Attributes;
+				else if (key == L"contentDocument")
+					m_member = Member::ContentDocument;
+				else if (key == L"root")
+					m_member = Member::Root;
+				else
+					m_member = Member::Other;
+				return true;
+			}
+
+			bool StartObject()
+			{
+				const Container parent = top();
+				if (parent == Container::None)
+					m_containers.push_back(Container::Top);
+				else if ((parent == Container::Top && m_member == Member::Root) || parent == Container::Children)
+					startNode(false);
+				else if (parent == Container::Node && m_member == Member::ContentDocument)
+					startNode(true);
+				else
+					m_containers.push_back(Container::Other);
+				m_member = Member::Other;
+				return true;
+			}
+
+			bool EndObject(rapidjson::SizeType)
+			{
+				if (top() == Container::Node)
+				{
+					m_nodes.pop_back();
+					m_lastChildren.pop_back();
+				}
+				m_containers.pop_back();
+				m_member = Member::Other;
+				return true;
+			}
+
+			bool StartArray()
+			{
+				if (top() == Container::Node && m_member == Member::Children)
+				{
+					current().hasChildren = true;
+					m_containers.push_back(Container::Children);
+				}
+				else if (top() == Container::Node && m_member == Member::Attributes)
+				{
+					current().firstAttribute = static_cast<uint32_t>(m_document.m_attributes.size());
+					m_containers.push_back(Container::Attributes);
+				}
+				else
+					m_containers.push_back(Container::Other);
+				return true;
+			}
+
+			bool EndArray(rapidjson::SizeType)
+			{
+				m_containers.pop_back();
+				m_member = Member::Other;
+				return true;
+			}
+
+		private:
+			Container top() const { return m_containers.empty() ? Container::None : m_containers.back(); }
+			Node& current() { return m_document.m_nodes[m_nodes.back()]; }
+
+			bool setNumber(int value)
+			{
+				if (top() == Container::Node)
+				{
+					if (m_member == Member::NodeId)
+						current().nodeId = value;
+					else if (m_member == Member::NodeType)
+						current().nodeType = value;
+				}
+				return true;
+			}
+
+			void startNode(bool isContentDocument)
+			{
+				const uint32_t index = static_cast<uint32_t>(m_document.m_nodes.size());
+				m_document.m_nodes.emplace_back();
+				if (!m_nodes.empty())
+				{
+					const uint32_t parent = m_nodes.back();
+					m_document.m_nodes[index].parent = parent;
+					if (isContentDocument)
+						m_document.m_nodes[parent].contentDocument = index;
+					else if (m_lastChildren.back() == npos)
+						m_document.m_nodes[parent].firstChild = index;
+					else
+						m_document.m_nodes[m_lastChildren.back()].nextSibling = index;
+					if (!isContentDocument)
+						m_lastChildren.back() = index;
+				}
+				m_nodes.push_back(index);
+				m_lastChildren.push_back(npos);
+				m_containers.push_back(Container::Node);
+			}
+
+			FlatDocument& m_document;
+			std::vector<Container> m_containers;
+			std::vector<uint32_t> m_nodes;
+			std::vector<uint32_t> m_lastChildren;
+			Member m_member = Member::Other;
+		};
+
+		uint32_t addString(const wchar_t* str, size_t length)
+		{
+			if (length == 0)
+				return 0;
+			const uint32_t offset = static_cast<uint32_t>(m_strings.size());
+			m_strings.append(str, length);
+			m_strings += L'\0';
+			return offset;
+		}
+
+		uint32_t intern(std::wstring_view name)
+		{
+			auto it = m_nameIds.find(name);
+			if (it != m_nameIds.end())
+				return it->second;
+			const uint32_t id = static_cast<uint32_t>(m_names.size());
+			m_names.emplace_back(name);
+			m_nameTags.push_back(htmltags::lookup(name.data(), name.size()));
+			m_nameIds.emplace(m_names.back(), id);
+			return id;
+		}
+
+		std::vector<Node> m_nodes;
+		std::vector<uint32_t> m_attributes;
+		std::wstring m_strings;
+		std::deque<std::wstring> m_names; // stable storage for the keys of m_nameIds
+		std::vector<htmltags::Tag> m_nameTags;
+		std::unordered_map<std::wstring_view, uint32_t> m_nameIds;
+	};
 }
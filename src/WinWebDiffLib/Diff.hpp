@@ -3,7 +3,199 @@
 
 #include <vector>
 #include <cstdlib>
+#include <cstring>
+#include <cstddef>
 #include <cassert>
+#include <atomic>
+#include <chrono>
+
+// Bump arena that Diff::diff() can take its working buffers from. Everything is
+// released at once when the next diff starts and the capacity only ever grows,
+// so a workspace reused across many small diffs stops going to the heap.
+class DiffWorkspace
+{
+public:
+	DiffWorkspace() = default;
+	~DiffWorkspace() { releaseBlocks(); }
+	DiffWorkspace(const DiffWorkspace&) = delete;
+	DiffWorkspace& operator=(const DiffWorkspace&) = delete;
+
+	void* allocate(size_t size)
+	{
+		const size_t total = align(size) + HeaderSize;
+		if ((m_blocks.empty() || m_used + total > m_blocks.back().size) && !addBlock(total))
+			return nullptr;
+		Block& block = m_blocks.back();
+		char* p = block.ptr + m_used;
+		*reinterpret_cast<size_t*>(p) = size;
+		m_used += total;
+		return p + HeaderSize;
+	}
+
+	void* reallocate(void* ptr, size_t size)
+	{
+		if (!ptr)
+			return allocate(size);
+		char* p = static_cast<char*>(ptr);
+		size_t& oldSize = *reinterpret_cast<size_t*>(p - HeaderSize);
+		Block& block = m_blocks.back();
+		if (p + align(oldSize) == block.ptr + m_used && p - block.ptr + align(size) <= block.size)
+		{
+			// last allocation of the current block: grow in place
+			m_used = (p - block.ptr) + align(size);
+			oldSize = size;
+			return ptr;
+		}
+		const size_t copySize = (oldSize < size) ? oldSize : size;
+		void* newPtr = allocate(size);
+		if (newPtr)
+			memcpy(newPtr, ptr, copySize);
+		return newPtr;
+	}
+
+	// Frees everything allocated so far. Blocks from the previous round are
+	// merged into one so the next round fits in a single contiguous block.
+	void reset()
+	{
+		if (m_blocks.size() > 1)
+		{
+			const size_t capacity = this->capacity();
+			releaseBlocks();
+			addBlock(capacity);
+		}
+		m_used = 0;
+	}
+
+	// Returns every block to the heap, e.g. once a diff has been cancelled.
+	void release() { releaseBlocks(); }
+
+	size_t capacity() const
+	{
+		size_t capacity = 0;
+		for (const auto& block : m_blocks)
+			capacity += block.size;
+		return capacity;
+	}
+
+	// Number of malloc() calls made on behalf of diffs, with or without a workspace.
+	static size_t heapAllocationCount() { return heapAllocations(); }
+
+	static DiffWorkspace*& current()
+	{
+		static thread_local DiffWorkspace* workspace = nullptr;
+		return workspace;
+	}
+
+	static void* Malloc(size_t size)
+	{
+		if (DiffWorkspace* workspace = current())
+			return workspace->allocate(size);
+		++heapAllocations();
+		return malloc(size);
+	}
+
+	static void* Realloc(void* ptr, size_t size)
+	{
+		if (DiffWorkspace* workspace = current())
+			return workspace->reallocate(ptr, size);
+		++heapAllocations();
+		return realloc(ptr, size);
+	}
+
+	static void Free(void* ptr)
+	{
+		if (!current())
+			free(ptr);
+	}
+
+	class Scope
+	{
+	public:
+		explicit Scope(DiffWorkspace* workspace) : m_prev(current())
+		{
+			if (workspace)
+				workspace->reset();
+			current() = workspace;
+		}
+		~Scope() { current() = m_prev; }
+	private:
+		DiffWorkspace* m_prev;
+	};
+
+private:
+	struct Block
+	{
+		char* ptr;
+		size_t size;
+	};
+
+	static constexpr size_t HeaderSize = alignof(std::max_align_t);
+	static constexpr size_t MinBlockSize = 64 * 1024;
+
+	static size_t align(size_t size) { return (size + HeaderSize - 1) & ~(HeaderSize - 1); }
+
+	static std::atomic<size_t>& heapAllocations()
+	{
+		static std::atomic<size_t> count{ 0 };
+		return count;
+	}
+
+	bool addBlock(size_t minSize)
+	{
+		size_t size = m_blocks.empty() ? MinBlockSize : m_blocks.back().size * 2;
+		if (size < minSize)
+			size = minSize;
+		char* ptr = static_cast<char*>(malloc(size));
+		if (!ptr)
+			return false;
+		++heapAllocations();
+		m_blocks.push_back({ ptr, size });
+		m_used = 0;
+		return true;
+	}
+
+	void releaseBlocks()
+	{
+		for (auto& block : m_blocks)
+			free(block.ptr);
+		m_blocks.clear();
+		m_used = 0;
+	}
+
+	std::vector<Block> m_blocks;
+	size_t m_used = 0;
+};
+
+// Bounds how much work Diff::diff() may do. Past the deadline the algorithms
+// stop refining and mark whatever is left between matching ends as changed,
+// which still gives a valid but coarser diff. Once the cancellation flag is set
+// they give up and Diff::diff() returns -1. A budget may be shared by threads.
+class DiffBudget
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	DiffBudget() = default;
+	DiffBudget(Clock::duration timeLimit, long maxCost, const std::atomic<bool>* cancelled = nullptr)
+		: m_deadline(Clock::now() + timeLimit)
+		, m_hasDeadline(timeLimit > Clock::duration::zero())
+		, m_maxCost(maxCost)
+		, m_cancelled(cancelled)
+	{
+	}
+
+	bool cancelled() const { return m_cancelled && m_cancelled->load(std::memory_order_relaxed); }
+	bool exhausted() const { return cancelled() || (m_hasDeadline && Clock::now() >= m_deadline); }
+	// Edit cost a Myers split searches before it falls back to its heuristic,
+	// or 0 for the default of about sqrt(N)
+	long maxCost() const { return m_maxCost; }
+
+private:
+	Clock::time_point m_deadline{};
+	bool m_hasDeadline = false;
+	long m_maxCost = 0;
+	const std::atomic<bool>* m_cancelled = nullptr;
+};
 
 template <class Data> class Diff
 {
@@ -97,9 +289,9 @@ typedef struct s_xpparam {
 	size_t anchors_nr;
 } xpparam_t;
 
-#define xdl_malloc(x) malloc(x)
-#define xdl_free(ptr) free(ptr)
-#define xdl_realloc(ptr,x) realloc(ptr,x)
+#define xdl_malloc(x) DiffWorkspace::Malloc(x)
+#define xdl_free(ptr) DiffWorkspace::Free(ptr)
+#define xdl_realloc(ptr,x) DiffWorkspace::Realloc(ptr,x)
 
 
 #endif /* #if !defined(XDIFF_H) */
@@ -217,6 +409,7 @@ typedef struct s_xdalgoenv {
 	long mxcost;
 	long snake_cnt;
 	long heur_min;
+	const DiffBudget *budget;
 } xdalgoenv_t;
 
 #endif /* #if !defined(XDIFFI_H) */
@@ -574,6 +767,17 @@ int patience_diff(mmfile_t *file1, mmfile_t *file2,
 		return 0;
 	}
 
+	if (m_budget && m_budget->exhausted()) {
+		if (m_budget->cancelled())
+			return -1;
+		/* out of budget: the whole range is changed */
+		while(count1--)
+			env->xdf1.rchg[line1++ - 1] = 1;
+		while(count2--)
+			env->xdf2.rchg[line2++ - 1] = 1;
+		return 0;
+	}
+
 	memset(&map, 0, sizeof(map));
 	if (fill_hashmap(file1, file2, xpp, env, &map,
 			line1, count1, line2, count2))
@@ -607,9 +811,12 @@ int xdl_do_patience_diff(mmfile_t *file1, mmfile_t *file2,
 	if (xdl_prepare_env(file1, file2, xpp, env) < 0)
 		return -1;
 
-	/* environment is cleaned up in xdl_diff() */
-	return patience_diff(file1, file2, xpp, env,
-			1, env->xdf1.nrec, 1, env->xdf2.nrec);
+	if (patience_diff(file1, file2, xpp, env,
+			1, env->xdf1.nrec, 1, env->xdf2.nrec) < 0) {
+		xdl_free_env(env);
+		return -1;
+	}
+	return 0;
 }
 
 /** xpatience.c end */
@@ -954,6 +1161,17 @@ redo:
 		return 0;
 	}
 
+	if (m_budget && m_budget->exhausted()) {
+		if (m_budget->cancelled())
+			return -1;
+		/* out of budget: the whole range is changed */
+		while (count1--)
+			env->xdf1.rchg[line1++ - 1] = 1;
+		while (count2--)
+			env->xdf2.rchg[line2++ - 1] = 1;
+		return 0;
+	}
+
 	memset(&lcs, 0, sizeof(lcs));
 	lcs_found = find_lcs(xpp, env, &lcs, line1, count1, line2, count2);
 	if (lcs_found < 0)
@@ -996,9 +1214,13 @@ int xdl_do_histogram_diff(mmfile_t *file1, mmfile_t *file2,
 	if (xdl_prepare_env(file1, file2, xpp, env) < 0)
 		return -1;
 
-	return histogram_diff(xpp, env,
+	if (histogram_diff(xpp, env,
 		env->xdf1.dstart + 1, env->xdf1.dend - env->xdf1.dstart + 1,
-		env->xdf2.dstart + 1, env->xdf2.dend - env->xdf2.dstart + 1);
+		env->xdf2.dstart + 1, env->xdf2.dend - env->xdf2.dstart + 1) < 0) {
+		xdl_free_env(env);
+		return -1;
+	}
+	return 0;
 }
 
 /** xhistogram.c end */
@@ -1262,6 +1484,7 @@ static long xdl_split(unsigned long const *ha1, long off1, long lim1,
 	long fmin = fmid, fmax = fmid;
 	long bmin = bmid, bmax = bmid;
 	long ec, d, i1, i2, prev1, best, dd, v, k;
+	int exhausted;
 
 	/*
 	 * Set initial diagonal values for both forward and backward path.
@@ -1342,7 +1565,14 @@ static long xdl_split(unsigned long const *ha1, long off1, long lim1,
 			}
 		}
 
-		if (need_min)
+		/*
+		 * Out of budget even a minimal diff settles for the heuristics,
+		 * and a cancelled one stops right away.
+		 */
+		exhausted = xenv->budget && xenv->budget->exhausted();
+		if (exhausted && xenv->budget->cancelled())
+			return -1;
+		if (need_min && !exhausted)
 			continue;
 
 		/*
@@ -1409,7 +1639,7 @@ static long xdl_split(unsigned long const *ha1, long off1, long lim1,
 		 * Enough is enough. We spent too much time here and now we collect
 		 * the furthest reaching path using the (i1 + i2) measure.
 		 */
-		if (ec >= xenv->mxcost) {
+		if (ec >= xenv->mxcost || exhausted) {
 			long fbest, fbest1, bbest, bbest1;
 
 			fbest = fbest1 = -1;
@@ -1469,6 +1699,19 @@ int xdl_recs_cmp(diffdata_t *dd1, long off1, long lim1,
 	for (; off1 < lim1 && off2 < lim2 && ha1[off1] == ha2[off2]; off1++, off2++);
 	for (; off1 < lim1 && off2 < lim2 && ha1[lim1 - 1] == ha2[lim2 - 1]; lim1--, lim2--);
 
+	if (xenv->budget && xenv->budget->exhausted()) {
+		if (xenv->budget->cancelled())
+			return -1;
+		/*
+		 * Out of budget: everything left in the box is changed.
+		 */
+		for (; off1 < lim1; off1++)
+			dd1->rchg[dd1->rindex[off1]] = 1;
+		for (; off2 < lim2; off2++)
+			dd2->rchg[dd2->rindex[off2]] = 1;
+		return 0;
+	}
+
 	/*
 	 * If one dimension is empty, then all records on the other one must
 	 * be obviously changed.
@@ -1553,6 +1796,9 @@ int xdl_do_diff(mmfile_t *mf1, mmfile_t *mf2, xpparam_t const *xpp,
 	xenv.mxcost = xdl_bogosqrt(ndiags);
 	if (xenv.mxcost < XDL_MAX_COST_MIN)
 		xenv.mxcost = XDL_MAX_COST_MIN;
+	if (m_budget && m_budget->maxCost() > 0)
+		xenv.mxcost = m_budget->maxCost();
+	xenv.budget = m_budget;
 	xenv.snake_cnt = XDL_SNAKE_CNT;
 	xenv.heur_min = XDL_HEUR_MIN_COST;
 
@@ -2062,8 +2308,10 @@ public:
 	Diff(const Data& data1, const Data& data2)
 		: m_data1(data1), m_data2(data2) { }
 
-	int diff(Algorithm algo, std::vector<char>& edscript)
+	// Returns the length of edscript, or -1 if the diff failed or the budget was cancelled
+	int diff(Algorithm algo, std::vector<char>& edscript, DiffWorkspace* workspace = nullptr, const DiffBudget* budget = nullptr)
 	{
+		DiffWorkspace::Scope scope(workspace);
 		mmfile_t file1{}, file2{};
 		xdfenv_t env;
 		xpparam_t xpp{};
@@ -2091,9 +2339,14 @@ public:
 			xpp.flags = 0;
 		}
 
-		xdl_do_diff(&file1, &file2, &xpp, &env);
-
+		m_budget = budget;
 		edscript.clear();
+		if (xdl_do_diff(&file1, &file2, &xpp, &env) < 0)
+		{
+			if (workspace && budget && budget->cancelled())
+				workspace->release();
+			return -1;
+		}
 
 		char* rchg1 = env.xdf1.rchg, * rchg2 = env.xdf2.rchg;
 		long nrec1 = env.xdf1.nrec, nrec2 = env.xdf2.nrec;
@@ -2141,5 +2394,6 @@ public:
 private:
 	const Data& m_data1;
 	const Data& m_data2;
+	const DiffBudget* m_budget = nullptr;
 };
 
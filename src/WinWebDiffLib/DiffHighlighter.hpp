@@ -3,12 +3,24 @@
 #include "Diff.hpp"
 #include "Utils.hpp"
 #include "DOMUtils.hpp"
+#include "ThreadPool.hpp"
 #include <string>
 #include <vector>
 #include <map>
 #include <list>
+#include <array>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <string_view>
 #include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <tuple>
 #include <rapidjson/document.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/prettywriter.h>
 #include <rapidjson/stringbuffer.h>
 #include "WinWebDiffLib.h"
@@ -58,12 +70,71 @@ struct TextSegment
 	size_t size;
 };
 
+class TextSegmentTable
+{
+public:
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	size_t size() const { return m_begins.size(); }
+	bool empty() const { return m_begins.empty(); }
+	size_t offset(size_t index) const { return m_begins[index]; }
+	size_t length(size_t index) const { return m_sizes[index]; }
+	int nodeId(size_t index) const { return m_nodeIds[index]; }
+	int nodeType(size_t index) const { return m_nodeTypes[index]; }
+
+	TextSegment operator[](size_t index) const
+	{
+		return TextSegment{ m_nodeIds[index], m_nodeTypes[index], m_begins[index], m_sizes[index] };
+	}
+
+	size_t indexOf(size_t offset) const
+	{
+		// segments are appended in increasing offset order
+		auto it = std::upper_bound(m_begins.begin(), m_begins.end(), offset);
+		if (it == m_begins.begin() || *(it - 1) != offset)
+			return npos;
+		return static_cast<size_t>(it - 1 - m_begins.begin());
+	}
+
+	void push_back(const TextSegment& seg)
+	{
+		if (!m_begins.empty() && m_begins.back() == seg.begin)
+		{
+			// an empty segment is superseded by the next segment starting at the same offset
+			m_sizes.back() = seg.size;
+			m_nodeIds.back() = seg.nodeId;
+			m_nodeTypes.back() = seg.nodeType;
+		}
+		else
+		{
+			m_begins.push_back(seg.begin);
+			m_sizes.push_back(seg.size);
+			m_nodeIds.push_back(seg.nodeId);
+			m_nodeTypes.push_back(seg.nodeType);
+		}
+	}
+
+	void clear()
+	{
+		m_begins.clear();
+		m_sizes.clear();
+		m_nodeIds.clear();
+		m_nodeTypes.clear();
+	}
+
+private:
+	std::vector<size_t> m_begins;
+	std::vector<size_t> m_sizes;
+	std::vector<int> m_nodeIds;
+	std::vector<int> m_nodeTypes;
+};
+
 struct TextSegments
 {
 	void Make(const WValue& nodeTree)
 	{
 		const int nodeType = nodeTree[L"nodeType"].GetInt();
-		const auto* nodeName = nodeTree[L"nodeName"].GetString();
+		const htmltags::Tag tag = htmltags::lookup(nodeTree[L"nodeName"].GetString(), nodeTree[L"nodeName"].GetStringLength());
 
 		if (nodeType == NodeType::TEXT_NODE)
 		{
@@ -74,11 +145,10 @@ struct TextSegments
 			seg.begin = allText.size();
 			seg.size = text.size();
 			allText += text;
-			segments.insert_or_assign(seg.begin, seg);
+			segments.push_back(seg);
 
 		}
-		else if (nodeType == NodeType::ELEMENT_NODE && 
-			 wcscmp(nodeName, L"INPUT") == 0)
+		else if (nodeType == NodeType::ELEMENT_NODE && tag == htmltags::TAG_INPUT)
 		{
 			const wchar_t* type = domutils::getAttribute(nodeTree, L"type");
 			if (!type || wcscmp(type, L"hidden") != 0)
@@ -91,16 +161,12 @@ struct TextSegments
 				seg.begin = allText.size();
 				seg.size = text.size();
 				allText += text;
-				segments.insert_or_assign(seg.begin, seg);
+				segments.push_back(seg);
 			}
 		}
 		if (nodeTree.HasMember(L"children") && nodeTree[L"children"].IsArray())
 		{
-			if (wcscmp(nodeName, L"SCRIPT") != 0 &&
-			    wcscmp(nodeName, L"NOSCRIPT") != 0 &&
-			    wcscmp(nodeName, L"NOFRAMES") != 0 &&
-			    wcscmp(nodeName, L"STYLE") != 0 &&
-			    wcscmp(nodeName, L"TITLE") != 0)
+			if (!htmltags::hasProperty(tag, htmltags::SKIP_TEXT))
 			{
 				for (const auto& child : nodeTree[L"children"].GetArray())
 				{
@@ -114,219 +180,927 @@ struct TextSegments
 		}
 	}
 
-	bool isWordBreak(wchar_t ch)
+	void Make(const std::wstring& text, bool ignoreNumbers)
 	{
-		if ((ch & 0xff00) == 0)
+		allText = text;
+		size_t begin = 0;
+		for (;;)
 		{
-			static const wchar_t* BreakChars = L".,:;?[](){}<=>`'!\"#$%&^~\\|@+-*/";
-			return wcschr(BreakChars, ch) != nullptr;
+			const size_t end = utils::FindTokenStart(text.c_str(), begin + 1, text.size(), ignoreNumbers);
+			TextSegment seg{};
+			seg.nodeId = -1;
+			seg.begin = begin;
+			seg.size = end - begin;
+			segments.push_back(seg);
+			if (end >= text.size())
+				break;
+			begin = end;
 		}
-		else
+	}
+
+	std::wstring allText;
+	TextSegmentTable segments;
+};
+
+// Extracts the same text segments as Highlighter::unhighlightNodes() followed by
+// TextSegments::Make() in a single SAX pass over a DOM.getDocument result, without
+// building the DOM. The JSON range of every node that may be highlighted or has to
+// be unhighlighted is recorded so that only those nodes are parsed later, along
+// with the path that locates the node in the page.
+class TextSegmentsReader
+{
+public:
+	struct NodeRange
+	{
+		int nodeId;
+		size_t begin;
+		size_t end;
+		size_t pathOffset;
+		size_t pathLength;
+		size_t nodeNameIndex;
+		size_t documentIndex;
+		bool diffNode;
+	};
+
+	bool read(const wchar_t* json, TextSegments& textSegments)
+	{
+		m_containers.clear();
+		m_nodes.clear();
+		m_segments.clear();
+		m_text.clear();
+		m_nodeRanges.clear();
+		m_paths.clear();
+		m_rangeIndexes.clear();
+		m_documentNodeIds.clear();
+		m_member = Member::Other;
+		rapidjson::GenericStringStream<rapidjson::UTF16<>> stream(json);
+		m_stream = &stream;
+		rapidjson::GenericReader<rapidjson::UTF16<>, rapidjson::UTF16<>> reader;
+		const bool ok = !reader.Parse<rapidjson::kParseDefaultFlags>(stream, *this).IsError();
+		m_stream = nullptr;
+		if (!ok)
+			return false;
+		textSegments.allText = std::move(m_text);
+		textSegments.segments.clear();
+		size_t begin = 0;
+		for (const auto& seg : m_segments)
 		{
-			WORD wCharType = 0;
-			GetStringTypeW(CT_CTYPE1, &ch, 1, &wCharType);
-			if ((wCharType & (C1_UPPER | C1_LOWER | C1_DIGIT)) != 0)
-				return false;
+			textSegments.segments.push_back({ seg.nodeId, seg.nodeType, begin, seg.size });
+			begin += seg.size;
+		}
+		m_text.clear();
+		m_segments.clear();
+		std::sort(m_nodeRanges.begin(), m_nodeRanges.end(),
+			[](const NodeRange& a, const NodeRange& b) { return a.begin < b.begin; });
+		for (size_t i = 0; i < m_nodeRanges.size(); ++i)
+			m_rangeIndexes.emplace(m_nodeRanges[i].nodeId, i);
+		return true;
+	}
+
+	// Returns the indexes leading from the document to the node through the
+	// children that DOM.getDocument reports, -1 standing for the contentDocument
+	// of a frame, and the node name the page had when it was read.
+	bool getNodePath(int nodeId, std::vector<int>& path, std::wstring& nodeName) const
+	{
+		auto it = m_rangeIndexes.find(nodeId);
+		if (it == m_rangeIndexes.end())
+			return false;
+		const NodeRange& range = m_nodeRanges[it->second];
+		path.assign(m_paths.begin() + range.pathOffset, m_paths.begin() + range.pathOffset + range.pathLength);
+		nodeName = m_nodeNames[range.nodeNameIndex];
+		return true;
+	}
+
+	// Returns the index into getDocumentNodeIds() of the document or frame
+	// document that contains the node.
+	bool getDocumentIndex(int nodeId, size_t& documentIndex) const
+	{
+		auto it = m_rangeIndexes.find(nodeId);
+		if (it == m_rangeIndexes.end())
+			return false;
+		documentIndex = m_nodeRanges[it->second].documentIndex;
+		return true;
+	}
+
+	// Node ids of the document and of the contentDocument of every frame, in document order
+	const std::vector<int>& getDocumentNodeIds() const { return m_documentNodeIds; }
+
+	// Parses a document whose root holds the nodes in nodeIds and every node that
+	// unhighlightNodes() has to restore. Node ids are kept, so a Highlighter and
+	// modifiedNodesToHTMLs() work on it as on the full document.
+	void materialize(const std::wstring& json, const std::unordered_set<int>& nodeIds, WDocument& document) const
+	{
+		std::wstring sparse = L"{\"root\":{\"nodeId\":0,\"nodeType\":9,\"nodeName\":\"#document\",\"children\":[";
+		size_t last = 0;
+		for (const auto& range : m_nodeRanges)
+		{
+			if (range.begin < last || (!range.diffNode && nodeIds.find(range.nodeId) == nodeIds.end()))
+				continue;
+			if (last > 0)
+				sparse += L',';
+			sparse.append(json, range.begin, range.end - range.begin);
+			last = range.end;
+		}
+		sparse += L"]}}";
+		document.Parse(sparse.c_str());
+	}
+
+	bool Null() { return true; }
+	bool Bool(bool) { return true; }
+	bool Int(int i) { return setNumber(i); }
+	bool Uint(unsigned u) { return setNumber(static_cast<int>(u)); }
+	bool Int64(int64_t) { return true; }
+	bool Uint64(uint64_t) { return true; }
+	bool Double(double) { return true; }
+	bool RawNumber(const wchar_t*, rapidjson::SizeType, bool) { return true; }
+
+	bool String(const wchar_t* str, rapidjson::SizeType length, bool)
+	{
+		if (top() == Container::Attributes)
+			m_nodes.back().attributes.emplace_back(str, length);
+		else if (top() == Container::Node && m_member == Member::NodeName)
+		{
+			m_nodes.back().nodeName.assign(str, length);
+			m_nodes.back().tag = htmltags::lookup(str, length);
+		}
+		else if (top() == Container::Node && m_member == Member::NodeValue)
+			m_nodes.back().nodeValue.assign(str, length);
+		return true;
+	}
+
+	bool Key(const wchar_t* str, rapidjson::SizeType length, bool)
+	{
+		if (top() != Container::Node && top() != Container::Top)
 			return true;
+		const std::wstring_view key(str, length);
+		if (key == L"nodeId")
+			m_member = Member::NodeId;
+		else if (key == L"nodeType")
+			m_member = Member::NodeType;
+		else if (key == L"nodeName")
+			m_member = Member::NodeName;
+		else if (key == L"nodeValue")
+			m_member = Member::NodeValue;
+		else if (key == L"children")
+			m_member = Member::Children;
+		else if (key == L"attributes")
+			m_member = Member::Attributes;
+		else if (key == L"contentDocument")
+			m_member = Member::ContentDocument;
+		else if (key == L"root")
+			m_member = Member::Root;
+		else
+			m_member = Member::Other;
+		return true;
+	}
+
+	bool StartObject()
+	{
+		const Container parent = top();
+		if (parent == Container::None)
+			m_containers.push_back(Container::Top);
+		else if (parent == Container::Top && m_member == Member::Root)
+			startNode(false);
+		else if (parent == Container::Children)
+			startNode(false);
+		else if (parent == Container::Node && m_member == Member::ContentDocument)
+		{
+			m_nodes.back().contentDocument.begin = mark();
+			startNode(true);
 		}
+		else
+			m_containers.push_back(Container::Other);
+		m_member = Member::Other;
+		return true;
 	}
-	void Make(const std::wstring& text, bool ignoreNumbers)
+
+	bool EndObject(rapidjson::SizeType)
 	{
-		allText = text;
-		int charTypePrev = -1;
+		if (top() == Container::Node)
+			endNode();
+		m_containers.pop_back();
+		m_member = Member::Other;
+		return true;
+	}
+
+	bool StartArray()
+	{
+		if (top() == Container::Node && m_member == Member::Children)
+		{
+			m_nodes.back().children.begin = mark();
+			m_containers.push_back(Container::Children);
+		}
+		else if (top() == Container::Node && m_member == Member::Attributes)
+			m_containers.push_back(Container::Attributes);
+		else
+			m_containers.push_back(Container::Other);
+		return true;
+	}
+
+	bool EndArray(rapidjson::SizeType)
+	{
+		if (top() == Container::Children)
+			m_nodes.back().children.end = mark();
+		m_containers.pop_back();
+		m_member = Member::Other;
+		return true;
+	}
+
+private:
+	enum class Container { None, Top, Node, Children, Attributes, Other };
+	enum class Member { Other, Root, NodeId, NodeType, NodeName, NodeValue, Children, Attributes, ContentDocument };
+
+	struct Segment
+	{
+		int nodeId;
+		int nodeType;
+		size_t size;
+	};
+
+	struct Mark
+	{
+		size_t segments = 0;
+		size_t text = 0;
+		size_t ranges = 0;
+	};
+
+	struct Region
+	{
+		Mark begin;
+		Mark end;
+		bool empty() const { return begin.segments == end.segments; }
+	};
+
+	struct Node
+	{
+		int nodeId = 0;
+		int nodeType = 0;
+		std::wstring nodeName;
+		htmltags::Tag tag = htmltags::TAG_OTHER;
+		std::wstring nodeValue;
+		std::vector<std::wstring> attributes;
 		size_t begin = 0;
-		for (size_t i = 0; i < text.size(); ++i)
-		{
-			int charType = 0;
-			wchar_t ch = text[i];
-			if (iswspace(ch))
-				charType = 1;
-			else if (isWordBreak(ch))
-				charType = 2;
-			else if (ignoreNumbers && iswdigit(ch))
-				charType = 3;
-			if (charType == 2 || charType != charTypePrev)
+		size_t documentIndex = 0;
+		int index = 0;
+		int childCount = 0;
+		Mark start;
+		Region children;
+		Region contentDocument;
+		bool isContentDocument = false;
+
+		const wchar_t* getAttribute(const wchar_t* name) const
+		{
+			for (size_t i = 0; i + 1 < attributes.size(); i += 2)
 			{
-				if (i > 0)
+				if (wcscmp(attributes[i].c_str(), name) == 0)
+					return attributes[i + 1].c_str();
+			}
+			return nullptr;
+		}
+
+		bool containsClassName(const wchar_t* name) const
+		{
+			if (nodeType != NodeType::ELEMENT_NODE)
+				return false;
+			for (size_t i = 0; i + 1 < attributes.size(); i += 2)
+			{
+				if (wcscmp(attributes[i].c_str(), L"class") == 0 &&
+				    wcsstr(attributes[i + 1].c_str(), name) != nullptr)
+					return true;
+			}
+			return false;
+		}
+	};
+
+	Container top() const { return m_containers.empty() ? Container::None : m_containers.back(); }
+
+	Mark mark() const { return { m_segments.size(), m_text.size(), m_nodeRanges.size() }; }
+
+	bool setNumber(int value)
+	{
+		if (top() == Container::Node)
+		{
+			if (m_member == Member::NodeId)
+				m_nodes.back().nodeId = value;
+			else if (m_member == Member::NodeType)
+				m_nodes.back().nodeType = value;
+		}
+		return true;
+	}
+
+	void startNode(bool isContentDocument)
+	{
+		Node node;
+		node.begin = m_stream->Tell() - 1;
+		node.start = mark();
+		node.isContentDocument = isContentDocument;
+		if (isContentDocument)
+			node.index = -1;
+		else if (!m_nodes.empty())
+			node.index = m_nodes.back().childCount++;
+		if (isContentDocument || m_nodes.empty())
+		{
+			node.documentIndex = m_documentNodeIds.size();
+			m_documentNodeIds.push_back(0);
+		}
+		else
+		{
+			node.documentIndex = m_nodes.back().documentIndex;
+		}
+		m_nodes.push_back(std::move(node));
+		m_containers.push_back(Container::Node);
+	}
+
+	// DOM.getDocument sorts the members of a node by name, so the segments of the
+	// children have already been emitted when the node name and attributes that
+	// decide what to do with them are read.
+	void endNode()
+	{
+		Node& node = m_nodes.back();
+		const size_t end = m_stream->Tell();
+		const bool diffNode = node.containsClassName(L"wwd-diff");
+		int nodeType = node.nodeType;
+		const wchar_t* text = nullptr;
+		bool skipChildren = false;
+		if (diffNode && node.tag != htmltags::TAG_INPUT)
+		{
+			// unhighlightNodes() turns the SPAN back into the text node it replaced
+			nodeType = NodeType::TEXT_NODE;
+			text = node.getAttribute(L"data-wwdtext");
+			if (!text)
+				text = L"";
+			skipChildren = true;
+			m_nodeRanges.erase(m_nodeRanges.begin() + node.children.begin.ranges,
+				m_nodeRanges.begin() + node.children.end.ranges);
+		}
+		else
+		{
+			if (nodeType == NodeType::TEXT_NODE)
+				text = node.nodeValue.c_str();
+			else if (nodeType == NodeType::ELEMENT_NODE && node.tag == htmltags::TAG_INPUT)
+			{
+				const wchar_t* type = node.getAttribute(L"type");
+				if (!type || wcscmp(type, L"hidden") != 0)
 				{
-					TextSegment seg{};
-					seg.nodeId = -1;
-					seg.begin = begin;
-					seg.size = i - begin;
-					segments.insert_or_assign(seg.begin, seg);
-					begin = i;
+					text = node.getAttribute(L"value");
+					if (!text)
+						text = L"";
 				}
-				charTypePrev = charType;
 			}
+			skipChildren = htmltags::hasProperty(node.tag, htmltags::SKIP_TEXT);
+			if (skipChildren)
+			{
+				// Highlighted SPANs below are still restored by unhighlightNodes()
+				m_nodeRanges.erase(std::remove_if(m_nodeRanges.begin() + node.children.begin.ranges,
+					m_nodeRanges.begin() + node.children.end.ranges,
+					[](const NodeRange& range) { return !range.diffNode; }),
+					m_nodeRanges.begin() + node.children.end.ranges);
+			}
+		}
+		if (m_segments.size() == node.start.segments)
+		{
+			if (text)
+				appendSegment(node.nodeId, nodeType, text);
+		}
+		else if (text || skipChildren ||
+			(!node.contentDocument.empty() && node.contentDocument.begin.segments < node.children.begin.segments))
+		{
+			reorderSegments(node, nodeType, text, skipChildren);
 		}
-		TextSegment seg{};
-		seg.nodeId = -1;
-		seg.begin = begin;
-		seg.size = text.size() - begin;
-		segments.insert_or_assign(seg.begin, seg);
+		if (text || diffNode)
+			addNodeRange(node, end, diffNode);
+		if (node.isContentDocument || m_nodes.size() == 1)
+			m_documentNodeIds[node.documentIndex] = node.nodeId;
+		if (node.isContentDocument && m_nodes.size() > 1)
+			m_nodes[m_nodes.size() - 2].contentDocument.end = mark();
+		m_nodes.pop_back();
 	}
 
-	std::wstring allText;
-	std::map<size_t, TextSegment> segments;
+	void addNodeRange(const Node& node, size_t end, bool diffNode)
+	{
+		// Only a few distinct names occur: #text, INPUT and the highlighted SPANs
+		size_t nodeNameIndex = std::find(m_nodeNames.begin(), m_nodeNames.end(), node.nodeName) - m_nodeNames.begin();
+		if (nodeNameIndex == m_nodeNames.size())
+			m_nodeNames.push_back(node.nodeName);
+		m_nodeRanges.push_back({ node.nodeId, node.begin, end, m_paths.size(), m_nodes.size() - 1, nodeNameIndex, node.documentIndex, diffNode });
+		for (size_t i = 1; i < m_nodes.size(); ++i)
+			m_paths.push_back(m_nodes[i].index);
+	}
+
+	// Restores the order of TextSegments::Make(): the node itself, its children
+	// unless they are skipped, then its contentDocument.
+	void reorderSegments(const Node& node, int nodeType, const wchar_t* text, bool skipChildren)
+	{
+		const Mark& start = node.start;
+		std::vector<Segment> segments(m_segments.begin() + start.segments, m_segments.end());
+		std::wstring allText = m_text.substr(start.text);
+		m_segments.resize(start.segments);
+		m_text.resize(start.text);
+		if (text)
+			appendSegment(node.nodeId, nodeType, text);
+		auto appendRegion = [&](const Region& region)
+		{
+			m_segments.insert(m_segments.end(),
+				segments.begin() + (region.begin.segments - start.segments),
+				segments.begin() + (region.end.segments - start.segments));
+			m_text.append(allText, region.begin.text - start.text, region.end.text - region.begin.text);
+		};
+		if (!skipChildren && !node.children.empty())
+			appendRegion(node.children);
+		if (!node.contentDocument.empty())
+			appendRegion(node.contentDocument);
+	}
+
+	void appendSegment(int nodeId, int nodeType, const wchar_t* text)
+	{
+		const size_t size = wcslen(text);
+		m_segments.push_back({ nodeId, nodeType, size });
+		m_text.append(text, size);
+	}
+
+	rapidjson::GenericStringStream<rapidjson::UTF16<>>* m_stream = nullptr;
+	std::vector<Container> m_containers;
+	std::vector<Node> m_nodes;
+	std::vector<Segment> m_segments;
+	std::wstring m_text;
+	std::vector<NodeRange> m_nodeRanges;
+	std::vector<int> m_paths;
+	std::vector<std::wstring> m_nodeNames;
+	std::unordered_map<int, size_t> m_rangeIndexes;
+	std::vector<int> m_documentNodeIds;
+	Member m_member = Member::Other;
+};
+
+// Hashes tokens over full UTF-16 code units with 64-bit FNV-1a and a final
+// avalanche step, folded to an unsigned long
+struct FastTokenHash
+{
+	static unsigned long hash(const wchar_t* begin, const wchar_t* end)
+	{
+		uint64_t ha = 0xcbf29ce484222325ULL;
+		for (const wchar_t* ptr = begin; ptr < end; ptr++)
+			ha = (ha ^ static_cast<uint16_t>(*ptr)) * 0x100000001b3ULL;
+		ha ^= ha >> 33;
+		ha *= 0xff51afd7ed558ccdULL;
+		ha ^= ha >> 33;
+		return static_cast<unsigned long>(ha ^ (ha >> 32));
+	}
+};
+
+// Reduces tokens to the form they are compared in under the ignore options
+struct NormalizedTokenHash
+{
+	// Calls emit for every code unit of the normalized form of [begin, end)
+	template <class Emit>
+	static void normalize(const wchar_t* begin, const wchar_t* end, const IWebDiffWindow::DiffOptions& diffOptions, Emit&& emit)
+	{
+		for (const wchar_t* ptr = begin; ptr < end; ptr++)
+		{
+			if (diffOptions.ignoreWhitespace != 0 && utils::IsSpace(*ptr))
+			{
+				while (ptr + 1 < end && utils::IsSpace(ptr[1]))
+					ptr++;
+				if (diffOptions.ignoreWhitespace == 2)
+					; /* already handled */
+				else if (diffOptions.ignoreWhitespace == 1)
+					emit(L' ');
+				continue;
+			}
+			if (diffOptions.ignoreNumbers && utils::IsDigit(*ptr))
+				continue;
+			wint_t ch = *ptr;
+			if (diffOptions.ignoreCase)
+			{
+				if (ch >= 'A' && ch <= 'Z')
+					ch += 'a' - 'A';
+				else if (ch >= 0x80 && iswupper(ch))
+					ch = towlower(ch);
+			}
+			emit(static_cast<wchar_t>(ch));
+		}
+	}
+};
+
+// The tokens of a pane interned into a dictionary of their own, in the form
+// they are compared in
+struct PaneTokens
+{
+	std::vector<unsigned> localIds;
+	std::wstring symbolText;
+	std::vector<size_t> symbolOffsets{ 0 };
+
+	std::wstring_view symbol(unsigned id) const
+	{
+		return std::wstring_view(symbolText).substr(symbolOffsets[id], symbolOffsets[id + 1] - symbolOffsets[id]);
+	}
+	size_t symbolCount() const { return symbolOffsets.size() - 1; }
 };
 
-class DataForDiff
+// Keeps the canonical tokens of the panes and the edit scripts of the pairs of
+// panes of recent compares, keyed by a hash of the tokens and of the options they
+// depend on. A recompare after one pane has changed then only redoes the work
+// that involves that pane. Compares running at the same time may share it.
+class CompareCache
 {
 public:
-	DataForDiff(const TextSegments& textSegments, const IWebDiffWindow::DiffOptions& diffOptions) :
-		m_textSegments(textSegments), m_diffOptions(diffOptions)
+	static constexpr size_t MaxTokens = 6;
+	static constexpr size_t MaxEdscripts = 4;
+
+	static uint64_t hash(const TextSegments& textSegments, const IWebDiffWindow::DiffOptions& diffOptions)
 	{
+		// FNV-1a over the options, the text and the segment boundaries
+		uint64_t h = 14695981039346656037ULL;
+		auto add = [&h](uint64_t value) { h = (h ^ value) * 1099511628211ULL; };
+		add(diffOptions.ignoreCase);
+		add(static_cast<uint64_t>(diffOptions.ignoreWhitespace));
+		add(diffOptions.ignoreNumbers);
+		for (wchar_t ch : textSegments.allText)
+			add(static_cast<uint64_t>(ch));
+		const TextSegmentTable& segments = textSegments.segments;
+		for (size_t i = 0; i < segments.size(); ++i)
+			add((static_cast<uint64_t>(segments.offset(i)) << 32) ^ segments.length(i));
+		return h;
 	}
-	~DataForDiff()
+
+	std::shared_ptr<const PaneTokens> findTokens(uint64_t key)
 	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return find(m_tokens, key, std::shared_ptr<const PaneTokens>());
 	}
-	unsigned size() const { return static_cast<unsigned>(m_textSegments.allText.size() * sizeof(wchar_t)); }
-	const char* data() const { return reinterpret_cast<const char*>(m_textSegments.allText.data()); }
-	const char* next(const char* scanline) const
+
+	void addTokens(uint64_t key, std::shared_ptr<const PaneTokens> tokens)
 	{
-		auto it = m_textSegments.segments.find(reinterpret_cast<const wchar_t*>(scanline) - m_textSegments.allText.data());
-		if (it != m_textSegments.segments.end())
-			return scanline + it->second.size * sizeof(wchar_t);
-		return nullptr;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		add(m_tokens, key, std::move(tokens), MaxTokens);
 	}
-	bool match_a_wchar(wchar_t ch1, wchar_t ch2) const
+
+	bool findEdscript(uint64_t key1, uint64_t key2, int algorithm, int costLimit, std::vector<char>& edscript)
 	{
-		if (ch1 == ch2)
-			return true;
-		if (iswupper(ch1))
-			ch1 = towlower(ch1);
-		if (iswupper(ch2))
-			ch2 = towlower(ch2);
-		return (ch1 == ch2);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto found = find(m_edscripts, std::make_tuple(key1, key2, algorithm, costLimit), std::shared_ptr<const std::vector<char>>());
+		if (!found)
+			return false;
+		edscript = *found;
+		return true;
 	}
-	bool equals(const char* scanline1, unsigned size1,
-		const char* scanline2, unsigned size2) const
+
+	void addEdscript(uint64_t key1, uint64_t key2, int algorithm, int costLimit, const std::vector<char>& edscript)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		add(m_edscripts, std::make_tuple(key1, key2, algorithm, costLimit), std::make_shared<const std::vector<char>>(edscript), MaxEdscripts);
+	}
+
+	// Number of panes and pairs of panes whose work was reused
+	size_t hitCount() const { return m_hitCount; }
+
+private:
+	template <class Value>
+	struct Entry
+	{
+		Value value;
+		uint64_t lastUse;
+	};
+
+	template <class Map, class Key, class Value>
+	Value find(Map& map, const Key& key, Value notFound)
 	{
-		if (!m_diffOptions.ignoreCase && m_diffOptions.ignoreWhitespace == 0 && !m_diffOptions.ignoreNumbers)
+		auto it = map.find(key);
+		if (it == map.end())
+			return notFound;
+		it->second.lastUse = ++m_clock;
+		++m_hitCount;
+		return it->second.value;
+	}
+
+	// Adds an entry and evicts the least recently used one beyond capacity
+	template <class Map, class Key, class Value>
+	void add(Map& map, const Key& key, Value value, size_t capacity)
+	{
+		map[key] = { std::move(value), ++m_clock };
+		if (map.size() > capacity)
 		{
-			if (size1 != size2)
-				return false;
-			return memcmp(scanline1, scanline2, size1) == 0;
+			map.erase(std::min_element(map.begin(), map.end(),
+				[](const auto& a, const auto& b) { return a.second.lastUse < b.second.lastUse; }));
 		}
-		const wchar_t* l1 = reinterpret_cast<const wchar_t*>(scanline1);
-		const wchar_t* l2 = reinterpret_cast<const wchar_t*>(scanline2);
-		const int s1 = size1 / sizeof(wchar_t);
-		const int s2 = size2 / sizeof(wchar_t);
-		int i1 = 0, i2 = 0;
-		if (m_diffOptions.ignoreWhitespace == 2)
+	}
+
+	std::mutex m_mutex;
+	std::map<uint64_t, Entry<std::shared_ptr<const PaneTokens>>> m_tokens;
+	std::map<std::tuple<uint64_t, uint64_t, int, int>, Entry<std::shared_ptr<const std::vector<char>>>> m_edscripts;
+	uint64_t m_clock = 0;
+	std::atomic<size_t> m_hitCount{ 0 };
+};
+
+// Interns the normalized form of every token of every pane into one symbol
+// table, so that the diff only compares integer ids. Token ids are indexed
+// like TextSegments::segments. Each pane is first interned into a dictionary
+// of its own (PaneTokens), normalized once under the ignore options so that
+// symbols are compared and hashed as plain code units, and the dictionaries
+// are then merged into the shared ids.
+class TokenTable
+{
+public:
+	TokenTable(const std::vector<TextSegments>& textSegments, const IWebDiffWindow::DiffOptions& diffOptions,
+		ThreadPool* pool = nullptr, CompareCache* cache = nullptr)
+		: m_ids(textSegments.size()), m_recordCounts(textSegments.size())
+		, m_tokens(textSegments.size()), m_keys(textSegments.size())
+	{
+		const bool normalized = diffOptions.ignoreCase || diffOptions.ignoreWhitespace != 0 || diffOptions.ignoreNumbers;
+		// Each pane is interned on its own so that panes can be interned in parallel
+		// and cached; only the small per-pane dictionaries are merged below.
+		auto preparePane = [&](size_t pane)
 		{
-			goto skip_ws;
-			while (i1 < s1 && i2 < s2)
+			if (cache)
 			{
-				if (!match_a_wchar(l1[i1++], l2[i2++]))
-					return false;
-			skip_ws:
-				while (i1 < s1 && iswspace(l1[i1]))
-					i1++;
-				while (i2 < s2 && iswspace(l2[i2]))
-					i2++;
-				if (m_diffOptions.ignoreNumbers)
-				{
-					while (i1 < s1 && iswdigit(l1[i1]))
-						i1++;
-					while (i2 < s2 && iswdigit(l2[i2]))
-						i2++;
-				}
+				m_keys[pane] = CompareCache::hash(textSegments[pane], diffOptions);
+				if ((m_tokens[pane] = cache->findTokens(m_keys[pane])))
+					return;
 			}
-		}
-		else if (m_diffOptions.ignoreWhitespace == 1)
-		{
-			while (i1 < s1 && i2 < s2)
+			const TextSegmentTable& segments = textSegments[pane].segments;
+			const std::wstring& allText = textSegments[pane].allText;
+			std::wstring canonicalText;
+			std::vector<size_t> canonicalOffsets;
+			if (normalized)
 			{
-				if (iswspace(l1[i1]) && iswspace(l2[i2]))
-				{
-					/* Skip matching spaces and try again */
-					while (i1 < s1 && iswspace(l1[i1]))
-						i1++;
-					while (i2 < s2 && iswspace(l2[i2]))
-						i2++;
-					continue;
-				}
-				if (m_diffOptions.ignoreNumbers)
+				// normalization never lengthens a token
+				canonicalText.reserve(allText.size());
+				canonicalOffsets.resize(segments.size() + 1);
+				for (size_t i = 0; i < segments.size(); ++i)
 				{
-					while (i1 < s1 && iswdigit(l1[i1]))
-						i1++;
-					while (i2 < s2 && iswdigit(l2[i2]))
-						i2++;
-					if (i1 >= s1 || i2 >= s2)
-						continue;
+					const wchar_t* begin = allText.data() + segments.offset(i);
+					NormalizedTokenHash::normalize(begin, begin + segments.length(i), diffOptions,
+						[&canonicalText](wchar_t ch) { canonicalText.push_back(ch); });
+					canonicalOffsets[i + 1] = canonicalText.size();
 				}
-				if (!match_a_wchar(l1[i1++], l2[i2++]))
-					return false;
 			}
-		}
-		else
-		{
-			while (i1 < s1 && i2 < s2)
+			auto tokens = std::make_shared<PaneTokens>();
+			std::unordered_map<std::wstring_view, unsigned, ViewHash> symbols;
+			tokens->localIds.resize(segments.size());
+			for (size_t i = 0; i < segments.size(); ++i)
 			{
-				if (m_diffOptions.ignoreNumbers)
+				std::wstring_view token = normalized ?
+					std::wstring_view(canonicalText).substr(canonicalOffsets[i], canonicalOffsets[i + 1] - canonicalOffsets[i]) :
+					std::wstring_view(allText).substr(segments.offset(i), segments.length(i));
+				auto it = symbols.emplace(token, static_cast<unsigned>(symbols.size()));
+				if (it.second)
 				{
-					while (i1 < s1 && iswdigit(l1[i1]))
-						i1++;
-					while (i2 < s2 && iswdigit(l2[i2]))
-						i2++;
-					if (i1 >= s1 || i2 >= s2)
-						continue;
+					tokens->symbolText.append(token);
+					tokens->symbolOffsets.push_back(tokens->symbolText.size());
 				}
-				if (!match_a_wchar(l1[i1++], l2[i2++]))
-					return false;
+				tokens->localIds[i] = it.first->second;
 			}
+			m_tokens[pane] = tokens;
+			if (cache)
+				cache->addTokens(m_keys[pane], tokens);
+		};
+		if (pool)
+			pool->parallelFor(textSegments.size(), preparePane);
+		else
+		{
+			for (size_t pane = 0; pane < textSegments.size(); ++pane)
+				preparePane(pane);
 		}
-		return true;
+		for (size_t pane = 0; pane < textSegments.size(); ++pane)
+		{
+			const PaneTokens& tokens = *m_tokens[pane];
+			std::vector<unsigned> globalIds(tokens.symbolCount());
+			for (unsigned id = 0; id < globalIds.size(); ++id)
+				globalIds[id] = m_symbols.emplace(tokens.symbol(id), static_cast<unsigned>(m_symbols.size())).first->second;
+			std::vector<unsigned>& ids = m_ids[pane];
+			ids.resize(tokens.localIds.size());
+			for (size_t i = 0; i < ids.size(); ++i)
+				ids[i] = globalIds[tokens.localIds[i]];
+			// only a trailing segment can be empty and xdiff never sees it as a record
+			const TextSegmentTable& segments = textSegments[pane].segments;
+			size_t count = segments.size();
+			while (count > 0 && segments.length(count - 1) == 0)
+				--count;
+			m_recordCounts[pane] = count;
+		}
+	}
+
+	const std::vector<unsigned>& ids(size_t pane) const { return m_ids[pane]; }
+	size_t recordCount(size_t pane) const { return m_recordCounts[pane]; }
+	size_t symbolCount() const { return m_symbols.size(); }
+	// CompareCache::hash() of the pane, if the table was made with a cache
+	uint64_t key(size_t pane) const { return m_keys[pane]; }
+
+	// The form of a token that is compared: the canonical one under the ignore
+	// options, the original text otherwise
+	std::wstring_view token(size_t pane, size_t index) const
+	{
+		return m_tokens[pane]->symbol(m_tokens[pane]->localIds[index]);
+	}
+
+private:
+	struct ViewHash
+	{
+		size_t operator()(std::wstring_view token) const
+		{
+			return FastTokenHash::hash(token.data(), token.data() + token.size());
+		}
+	};
+
+	std::vector<std::vector<unsigned>> m_ids;
+	std::vector<size_t> m_recordCounts;
+	std::vector<std::shared_ptr<const PaneTokens>> m_tokens;
+	std::vector<uint64_t> m_keys;
+	std::unordered_map<std::wstring_view, unsigned, ViewHash> m_symbols;
+};
+
+// Diff input over the interned token ids of one pane
+class InternedDataForDiff
+{
+public:
+	InternedDataForDiff(const TokenTable& tokenTable, size_t pane)
+		: m_ids(tokenTable.ids(pane).data()), m_recordCount(tokenTable.recordCount(pane))
+	{
 	}
-	unsigned long hash_a_wchar(wchar_t ch_) const
+	InternedDataForDiff(const unsigned* ids, size_t recordCount)
+		: m_ids(ids), m_recordCount(recordCount)
+	{
+	}
+	unsigned size() const { return static_cast<unsigned>(m_recordCount * sizeof(unsigned)); }
+	const char* data() const { return reinterpret_cast<const char*>(m_ids); }
+	const unsigned* ids() const { return m_ids; }
+	size_t recordCount() const { return m_recordCount; }
+	const char* next(const char* scanline) const { return scanline + sizeof(unsigned); }
+	unsigned long hash(const char* scanline) const { return *reinterpret_cast<const unsigned*>(scanline); }
+	bool equals(const char* scanline1, unsigned size1,
+		const char* scanline2, unsigned size2) const
 	{
-		wint_t ch = ch_;
-		if (m_diffOptions.ignoreCase && iswupper(ch))
-			ch = towlower(ch);
-		return ch;
+		return size1 == size2 && memcmp(scanline1, scanline2, size1) == 0;
 	}
-	unsigned long hash(const char* scanline) const
+
+private:
+	const unsigned* m_ids;
+	size_t m_recordCount;
+};
+
+// Edit script of two short token id sequences in the format of Diff::diff(),
+// from a bit-parallel LCS (Allison-Dix, Hyyro): every token of the second
+// sequence updates one bit vector over the first sequence, so the cost is
+// O(n * ceil(m / 64)) word operations without xdiff's classifier and hash
+// tables, which dominate the few dozen tokens of a word diff. The result is
+// a minimal diff.
+class BitParallelDiff
+{
+public:
+	// Still ahead of xdiff's Myers here (see BenchmarkBitParallelDiff) while
+	// the rows stay within 128 KB
+	static constexpr size_t MaxTokens = 1024;
+
+	BitParallelDiff(const InternedDataForDiff& data1, const InternedDataForDiff& data2)
+		: m_data1(data1), m_data2(data2)
 	{
-		unsigned long ha = 5381;
-		const wchar_t* begin = reinterpret_cast<const wchar_t*>(scanline);
-		const wchar_t* end = reinterpret_cast<const wchar_t*>(this->next(scanline));
+	}
 
-		if (!m_diffOptions.ignoreCase && m_diffOptions.ignoreWhitespace == 0 && !m_diffOptions.ignoreNumbers)
+	static bool isSuitable(const InternedDataForDiff& data1, const InternedDataForDiff& data2)
+	{
+		return data1.recordCount() <= MaxTokens && data2.recordCount() <= MaxTokens;
+	}
+
+	int diff(std::vector<char>& edscript, DiffWorkspace* workspace = nullptr)
+	{
+		DiffWorkspace::Scope scope(workspace);
+		const unsigned* a = m_data1.ids();
+		const unsigned* b = m_data2.ids();
+		const size_t m = m_data1.recordCount();
+		const size_t n = m_data2.recordCount();
+		char* rchg1 = static_cast<char*>(DiffWorkspace::Malloc(m + n + 1));
+		char* rchg2 = rchg1 + m;
+		memset(rchg1, 0, m + n);
+
+		// Common ends are never changed
+		size_t prefix = 0, suffix = 0;
+		while (prefix < m && prefix < n && a[prefix] == b[prefix])
+			++prefix;
+		while (suffix < m - prefix && suffix < n - prefix && a[m - 1 - suffix] == b[n - 1 - suffix])
+			++suffix;
+		markChanges(a + prefix, m - prefix - suffix, b + prefix, n - prefix - suffix, rchg1 + prefix, rchg2 + prefix);
+
+		edscript.clear();
+		int D = 0;
+		size_t i1 = 0, i2 = 0;
+		while (i1 < m || i2 < n)
 		{
-			for (const auto* ptr = begin; ptr < end; ptr++)
+			const bool changed1 = i1 < m && rchg1[i1];
+			const bool changed2 = i2 < n && rchg2[i2];
+			if (changed1 && changed2)
+			{
+				edscript.push_back('!');
+				i1++;
+				i2++;
+			}
+			else if (changed2)
+			{
+				edscript.push_back('+');
+				i2++;
+			}
+			else if (changed1)
 			{
-				ha += (ha << 5);
-				ha ^= *ptr & 0xFF;
+				edscript.push_back('-');
+				i1++;
 			}
-			return ha;
+			else
+			{
+				edscript.push_back('=');
+				i1++;
+				i2++;
+			}
+			D++;
 		}
-		for (const wchar_t* ptr = begin; ptr < end; ptr++)
+
+		DiffWorkspace::Free(rchg1);
+		return D;
+	}
+
+private:
+	void markChanges(const unsigned* a, size_t m, const unsigned* b, size_t n, char* rchg1, char* rchg2)
+	{
+		if (m == 0 || n == 0)
+		{
+			memset(rchg1, 1, m);
+			memset(rchg2, 1, n);
+			return;
+		}
+		const size_t words = (m + 63) / 64;
+
+		// The symbols of a, sorted, number the match vectors, so that the table
+		// grows with m rather than with the symbols of the whole token table.
+		// A symbol not in a gets the empty vector after them.
+		unsigned* symbols = static_cast<unsigned*>(DiffWorkspace::Malloc(m * sizeof(unsigned)));
+		std::copy(a, a + m, symbols);
+		std::sort(symbols, symbols + m);
+		const size_t symbolCount = std::unique(symbols, symbols + m) - symbols;
+		auto localId = [&](unsigned symbol)
 		{
-			if (m_diffOptions.ignoreWhitespace != 0 && iswspace(*ptr))
+			const unsigned* it = std::lower_bound(symbols, symbols + symbolCount, symbol);
+			return (it != symbols + symbolCount && *it == symbol) ? static_cast<size_t>(it - symbols) : symbolCount;
+		};
+
+		// Bit i of the match vector of a symbol is set where a[i] is that symbol
+		uint64_t* matches = static_cast<uint64_t*>(DiffWorkspace::Malloc((symbolCount + 1) * words * sizeof(uint64_t)));
+		// Row j holds the vector after b[0, j): bit i is clear where the LCS length grows at a[i]
+		uint64_t* rows = static_cast<uint64_t*>(DiffWorkspace::Malloc((n + 1) * words * sizeof(uint64_t)));
+		memset(matches, 0, (symbolCount + 1) * words * sizeof(uint64_t));
+		for (size_t i = 0; i < m; ++i)
+			matches[localId(a[i]) * words + i / 64] |= 1ULL << (i % 64);
+		for (size_t w = 0; w < words; ++w)
+			rows[w] = ~0ULL;
+		for (size_t j = 0; j < n; ++j)
+		{
+			const uint64_t* match = matches + localId(b[j]) * words;
+			const uint64_t* prev = rows + j * words;
+			uint64_t* row = rows + (j + 1) * words;
+			uint64_t carry = 0;
+			for (size_t w = 0; w < words; ++w)
 			{
-				while (ptr + 1 < end && iswspace(ptr[1]))
-					ptr++;
-				if (m_diffOptions.ignoreWhitespace == 2)
-					; /* already handled */
-				else if (m_diffOptions.ignoreWhitespace == 1)
-				{
-					ha += (ha << 5);
-					ha ^= hash_a_wchar(' ');
-				}
-				continue;
+				const uint64_t v = prev[w];
+				const uint64_t u = v & match[w];
+				const uint64_t sum = v + u;
+				const uint64_t total = sum + carry;
+				carry = (sum < v) | (total < sum);
+				row[w] = total | (v & ~u);
 			}
-			if (m_diffOptions.ignoreNumbers && iswdigit(*ptr))
-				continue;
-			ha += (ha << 5);
-			ha ^= hash_a_wchar(*ptr);
 		}
-		return ha;
+
+		// LCS length of a[0, i) and b[0, j)
+		auto lcs = [&](size_t j, size_t i)
+		{
+			const uint64_t* row = rows + j * words;
+			size_t ones = 0;
+			for (size_t w = 0; w < i / 64; ++w)
+				ones += utils::detail::PopCount64(row[w]);
+			if (i % 64)
+				ones += utils::detail::PopCount64(row[i / 64] & ((1ULL << (i % 64)) - 1));
+			return i - ones;
+		};
+		size_t i = m, j = n;
+		while (i > 0 && j > 0)
+		{
+			if (a[i - 1] == b[j - 1])
+			{
+				--i;
+				--j;
+			}
+			else if (lcs(j - 1, i) >= lcs(j, i - 1))
+				rchg2[--j] = 1;
+			else
+				rchg1[--i] = 1;
+		}
+		while (i > 0)
+			rchg1[--i] = 1;
+		while (j > 0)
+			rchg2[--j] = 1;
+
+		DiffWorkspace::Free(rows);
+		DiffWorkspace::Free(matches);
+		DiffWorkspace::Free(symbols);
 	}
 
-private:
-	const TextSegments& m_textSegments;
-	const IWebDiffWindow::DiffOptions& m_diffOptions;
+	const InternedDataForDiff& m_data1;
+	const InternedDataForDiff& m_data2;
 };
 
 struct ModifiedNode
@@ -335,6 +1109,33 @@ struct ModifiedNode
 	std::wstring outerHTML;
 };
 
+struct PatchBatch
+{
+	std::wstring script;
+	std::vector<ModifiedNode> nodes;
+};
+
+// What a patch has left in the page in place of a node read from it: the HTML,
+// and the number and the name of the first of the nodes it was parsed into
+struct AppliedNode
+{
+	size_t count;
+	std::wstring nodeName;
+	std::wstring outerHTML;
+};
+
+// Bounds a compare: the time in milliseconds, 0 for no limit, and the edit cost
+// searched per Myers split, 0 for the default
+struct DiffLimits
+{
+	int timeLimit = 0;
+	int costLimit = 0;
+	// Both panes need this many tokens before a pool splits a diff into regions.
+	// The speedup has not been measured on more than one core, so diffs are not
+	// split unless a caller lowers it.
+	size_t partitionMinTokens = SIZE_MAX;
+};
+
 namespace Comparer
 {
 	template<typename Element, typename Comp02Func>
@@ -548,40 +1349,32 @@ namespace Comparer
 	{
 		std::vector<DiffInfo> m_diffInfoList;
 		int i0 = 0, i1 = 0;
-		auto it0 = textSegments0.segments.begin();
-		auto it1 = textSegments1.segments.begin();
 		for (auto ed : edscript)
 		{
 			switch (ed)
 			{
 			case '-':
 			{
-				const wchar_t* start0 = textSegments0.allText.c_str() + it0->second.begin;
-				if (!ignoreAllSpaces || !isAllSpaces(start0, start0 + it0->second.size))
+				const wchar_t* start0 = textSegments0.allText.c_str() + textSegments0.segments.offset(i0);
+				if (!ignoreAllSpaces || !isAllSpaces(start0, start0 + textSegments0.segments.length(i0)))
 					m_diffInfoList.emplace_back(i0, i0, i1, i1 - 1);
-				++it0;
 				++i0;
 				break;
 			}
 			case '+':
 			{
-				const wchar_t* start1 = textSegments1.allText.c_str() + it1->second.begin;
-				if (!ignoreAllSpaces || !isAllSpaces(start1, start1 + it1->second.size))
+				const wchar_t* start1 = textSegments1.allText.c_str() + textSegments1.segments.offset(i1);
+				if (!ignoreAllSpaces || !isAllSpaces(start1, start1 + textSegments1.segments.length(i1)))
 					m_diffInfoList.emplace_back(i0, i0 - 1, i1, i1);
-				++it1;
 				++i1;
 				break;
 			}
 			case '!':
 				m_diffInfoList.emplace_back(i0, i0, i1, i1);
-				++it0;
-				++it1;
 				++i0;
 				++i1;
 				break;
 			default:
-				++it0;
-				++it1;
 				++i0;
 				++i1;
 				break;
@@ -593,81 +1386,227 @@ namespace Comparer
 	void setNodeIdInDiffInfoList(std::vector<DiffInfo>& m_diffInfoList,
 		const std::vector<TextSegments>& textSegments)
 	{
-		for (size_t i = 0; i < m_diffInfoList.size(); ++i)
+		// Diff offsets are token indexes, so each diff finds its segment with one
+		// lookup and the whole pass is O(panes * diffs).
+		for (size_t pane = 0; pane < textSegments.size(); ++pane)
 		{
-			for (size_t pane = 0; pane < textSegments.size(); ++pane)
+			const TextSegmentTable& segments = textSegments[pane].segments;
+			const size_t segmentCount = segments.size();
+			for (auto& diffInfo : m_diffInfoList)
+			{
+				size_t index = (std::min)(static_cast<size_t>(diffInfo.begin[pane]), segmentCount);
+				if (diffInfo.end[pane] < diffInfo.begin[pane])
+				{
+					if (index > 0)
+					{
+						--index;
+						diffInfo.nodePos[pane] = 1;
+					}
+					else
+					{
+						diffInfo.nodePos[pane] = -1;
+					}
+				}
+				else
+				{
+					diffInfo.nodePos[pane] = 0;
+				}
+				if (index >= segmentCount)
+				{
+					diffInfo.nodeIds[pane] = -1;
+					diffInfo.nodeTypes[pane] = -1;
+				}
+				else
+				{
+					diffInfo.nodeIds[pane] = segments.nodeId(index);
+					diffInfo.nodeTypes[pane] = segments.nodeType(index);
+				}
+			}
+		}
+	}
+
+	int partitionedDiff(Diff<InternedDataForDiff>::Algorithm algorithm, const InternedDataForDiff& data1, const InternedDataForDiff& data2,
+		size_t symbolCount, std::vector<char>& edscript, ThreadPool& pool, const DiffBudget* budget = nullptr);
+
+	// Short inputs skip xdiff when the algorithm asks for a minimal diff anyway,
+	// and ones of at least partitionMinTokens are partitioned when a pool is given.
+	// Returns -1 if the budget was cancelled.
+	int diff(Diff<InternedDataForDiff>::Algorithm algorithm, const InternedDataForDiff& data1, const InternedDataForDiff& data2,
+		size_t symbolCount, std::vector<char>& edscript, DiffWorkspace* workspace, ThreadPool* pool = nullptr, const DiffBudget* budget = nullptr,
+		size_t partitionMinTokens = SIZE_MAX)
+	{
+		using InternedDiff = Diff<InternedDataForDiff>;
+		if (budget && budget->cancelled())
+		{
+			edscript.clear();
+			return -1;
+		}
+		if (pool && pool->size() > 0 && algorithm != InternedDiff::NONE &&
+		    data1.recordCount() >= partitionMinTokens && data2.recordCount() >= partitionMinTokens)
+			return partitionedDiff(algorithm, data1, data2, symbolCount, edscript, *pool, budget);
+		if ((algorithm == InternedDiff::MYERS || algorithm == InternedDiff::MINIMAL) && BitParallelDiff::isSuitable(data1, data2))
+			return BitParallelDiff(data1, data2).diff(edscript, workspace);
+		return InternedDiff(data1, data2).diff(algorithm, edscript, workspace, budget);
+	}
+
+	// Pairs of positions of the tokens that occur exactly once in each sequence,
+	// reduced to the longest chain that is in the same order in both, as the
+	// patience diff does
+	std::vector<std::pair<size_t, size_t>> findAnchors(const InternedDataForDiff& data1, const InternedDataForDiff& data2, size_t symbolCount)
+	{
+		constexpr size_t npos = SIZE_MAX;
+		constexpr size_t repeated = SIZE_MAX - 1;
+		const unsigned* a = data1.ids();
+		const unsigned* b = data2.ids();
+		std::vector<size_t> positions1(symbolCount, npos), positions2(symbolCount, npos);
+		for (size_t i = 0; i < data1.recordCount(); ++i)
+			positions1[a[i]] = (positions1[a[i]] == npos) ? i : repeated;
+		for (size_t j = 0; j < data2.recordCount(); ++j)
+			positions2[b[j]] = (positions2[b[j]] == npos) ? j : repeated;
+		std::vector<std::pair<size_t, size_t>> candidates;
+		for (size_t i = 0; i < data1.recordCount(); ++i)
+		{
+			if (positions1[a[i]] == i && positions2[a[i]] < repeated)
+				candidates.emplace_back(i, positions2[a[i]]);
+		}
+
+		// Longest increasing subsequence of the second positions by patience sorting
+		std::vector<size_t> tails, predecessors(candidates.size());
+		for (size_t k = 0; k < candidates.size(); ++k)
+		{
+			auto it = std::lower_bound(tails.begin(), tails.end(), candidates[k].second,
+				[&candidates](size_t tail, size_t j) { return candidates[tail].second < j; });
+			predecessors[k] = (it == tails.begin()) ? npos : *(it - 1);
+			if (it == tails.end())
+				tails.push_back(k);
+			else
+				*it = k;
+		}
+		std::vector<std::pair<size_t, size_t>> anchors(tails.size());
+		size_t length = tails.size();
+		for (size_t k = tails.empty() ? npos : tails.back(); k != npos; k = predecessors[k])
+			anchors[--length] = candidates[k];
+		return anchors;
+	}
+
+	// Splits both sequences at anchors into regions of similar size, diffs the
+	// regions in parallel and joins their edit scripts. The anchors always match,
+	// so the result can differ from a serial diff where an anchor is a poor match.
+	int partitionedDiff(Diff<InternedDataForDiff>::Algorithm algorithm, const InternedDataForDiff& data1, const InternedDataForDiff& data2,
+		size_t symbolCount, std::vector<char>& edscript, ThreadPool& pool, const DiffBudget* budget)
+	{
+		struct Region
+		{
+			size_t begin1, end1, begin2, end2;
+		};
+		const size_t m = data1.recordCount();
+		const size_t n = data2.recordCount();
+		// several regions per thread even out their different costs
+		const size_t target = (m + n) / ((pool.size() + 1) * 4) + 1;
+		std::vector<Region> regions;
+		size_t begin1 = 0, begin2 = 0;
+		for (const auto& anchor : findAnchors(data1, data2, symbolCount))
+		{
+			if ((anchor.first - begin1) + (anchor.second - begin2) < target)
+				continue;
+			regions.push_back({ begin1, anchor.first, begin2, anchor.second });
+			begin1 = anchor.first + 1;
+			begin2 = anchor.second + 1;
+		}
+		regions.push_back({ begin1, m, begin2, n });
+
+		std::vector<std::vector<char>> edscripts(regions.size());
+		std::atomic<bool> failed{ false };
+		pool.parallelFor(regions.size(), [&](size_t index)
 			{
-				auto it = textSegments[pane].segments.begin();
-				std::advance(it, m_diffInfoList[i].begin[pane]);
-				if (m_diffInfoList[i].end[pane] < m_diffInfoList[i].begin[pane])
-				{
-					if (it != textSegments[pane].segments.begin())
-					{
-						--it;
-						m_diffInfoList[i].nodePos[pane] = 1;
-					}
-					else
-					{
-						m_diffInfoList[i].nodePos[pane] = -1;
-					}
-				}
-				else
-				{
-					m_diffInfoList[i].nodePos[pane] = 0;
-				}
-				if (it == textSegments[pane].segments.end())
-				{
-					m_diffInfoList[i].nodeIds[pane] = -1;
-					m_diffInfoList[i].nodeTypes[pane] = -1;
-				}
-				else
-				{
-					m_diffInfoList[i].nodeIds[pane] = it->second.nodeId;
-					m_diffInfoList[i].nodeTypes[pane] = it->second.nodeType;
-				}
-			}
+				const Region& region = regions[index];
+				InternedDataForDiff regionData1(data1.ids() + region.begin1, region.end1 - region.begin1);
+				InternedDataForDiff regionData2(data2.ids() + region.begin2, region.end2 - region.begin2);
+				// regions are large, and pool threads live as long as the process,
+				// so each region returns its buffers to the heap as soon as it is done
+				DiffWorkspace workspace;
+				if (failed || diff(algorithm, regionData1, regionData2, symbolCount, edscripts[index], &workspace, nullptr, budget) < 0)
+					failed = true;
+			});
+
+		edscript.clear();
+		if (failed)
+			return -1;
+		for (size_t index = 0; index < edscripts.size(); ++index)
+		{
+			if (index > 0)
+				edscript.push_back('=');
+			edscript.insert(edscript.end(), edscripts[index].begin(), edscripts[index].end());
 		}
+		return static_cast<int>(edscript.size());
 	}
 
+	// The diff is bounded by limits. Once *cancelled is set it stops and returns
+	// an empty list. A cache lets the panes and pairs of panes that did not change
+	// since the last compare be reused.
 	std::vector<DiffInfo> compare(const IWebDiffWindow::DiffOptions& diffOptions,
-		std::vector<TextSegments>& textSegments)
+		const std::vector<TextSegments>& textSegments, ThreadPool* pool = nullptr, DiffWorkspace* workspace = nullptr,
+		const std::atomic<bool>* cancelled = nullptr, CompareCache* cache = nullptr, const DiffLimits& limits = {})
 	{
-		DataForDiff data0(textSegments[0], diffOptions);
-		DataForDiff data1(textSegments[1], diffOptions);
+		using InternedDiff = Diff<InternedDataForDiff>;
+		const auto algorithm = static_cast<InternedDiff::Algorithm>(diffOptions.diffAlgorithm);
+		const DiffBudget budget(std::chrono::milliseconds(limits.timeLimit), limits.costLimit, cancelled);
+		TokenTable tokenTable(textSegments, diffOptions, pool, cache);
+		if (budget.cancelled())
+			return {};
+		auto diffPanes = [&](size_t pane1, size_t pane2, std::vector<char>& edscript, DiffWorkspace* workspace)
+		{
+			if (cache && cache->findEdscript(tokenTable.key(pane1), tokenTable.key(pane2), algorithm, limits.costLimit, edscript))
+				return static_cast<int>(edscript.size());
+			const int result = diff(algorithm, InternedDataForDiff(tokenTable, pane1), InternedDataForDiff(tokenTable, pane2),
+				tokenTable.symbolCount(), edscript, workspace, pool, &budget, limits.partitionMinTokens);
+			// a diff cut short by the deadline is not worth keeping
+			if (cache && result >= 0 && !budget.exhausted())
+				cache->addEdscript(tokenTable.key(pane1), tokenTable.key(pane2), algorithm, limits.costLimit, edscript);
+			return result;
+		};
 		if (textSegments.size() < 3)
 		{
-			Diff<DataForDiff> diff(data0, data1);
 			std::vector<char> edscript;
 
-			diff.diff(static_cast<Diff<DataForDiff>::Algorithm>(diffOptions.diffAlgorithm), edscript);
+			if (diffPanes(0, 1, edscript, workspace) < 0)
+				return {};
 			return edscriptToDiffInfo(edscript, textSegments[0], textSegments[1], diffOptions.ignoreWhitespace == 2);
 		}
 
-		DataForDiff data2(textSegments[2], diffOptions);
-		Diff<DataForDiff> diff10(data1, data0);
-		Diff<DataForDiff> diff12(data1, data2);
-		Diff<DataForDiff> diff20(data2, data0);
-		std::vector<char> edscript10, edscript12;
-		diff10.diff(static_cast<Diff<DataForDiff>::Algorithm>(diffOptions.diffAlgorithm), edscript10);
-		diff12.diff(static_cast<Diff<DataForDiff>::Algorithm>(diffOptions.diffAlgorithm), edscript12);
-		std::vector<DiffInfo> diffInfoList10 = edscriptToDiffInfo(edscript10, textSegments[1], textSegments[0], diffOptions.ignoreWhitespace == 2);
-		std::vector<DiffInfo> diffInfoList12 = edscriptToDiffInfo(edscript12, textSegments[1], textSegments[2], diffOptions.ignoreWhitespace == 2);
+		std::vector<DiffInfo> diffInfoList10, diffInfoList12;
+		std::atomic<bool> failed{ false };
+		auto diffPair = [&](size_t index)
+		{
+			const size_t otherPane = (index == 0) ? 0 : 2;
+			std::vector<char> edscript;
+			// a workspace must not be shared between threads
+			if (diffPanes(1, otherPane, edscript, (index == 0 || !pool) ? workspace : nullptr) < 0)
+			{
+				failed = true;
+				return;
+			}
+			((index == 0) ? diffInfoList10 : diffInfoList12) =
+				edscriptToDiffInfo(edscript, textSegments[1], textSegments[otherPane], diffOptions.ignoreWhitespace == 2);
+		};
+		if (pool)
+			pool->parallelFor(2, diffPair);
+		else
+		{
+			diffPair(0);
+			diffPair(1);
+		}
+		if (failed)
+			return {};
 
 		auto compfunc02 = [&](const DiffInfo & wd3) {
-			auto it0 = textSegments[0].segments.begin();
-			auto it2 = textSegments[2].segments.begin();
-			std::advance(it0, wd3.begin[0]);
-			if (it0 == textSegments[0].segments.end())
+			const std::vector<unsigned>& ids0 = tokenTable.ids(0);
+			const std::vector<unsigned>& ids2 = tokenTable.ids(2);
+			if (wd3.begin[0] < 0 || static_cast<size_t>(wd3.begin[0]) >= ids0.size())
 				return false;
-			std::advance(it2, wd3.begin[2]);
-			if (it2 == textSegments[2].segments.end())
+			if (wd3.begin[2] < 0 || static_cast<size_t>(wd3.begin[2]) >= ids2.size())
 				return false;
-			unsigned s0 = static_cast<unsigned>(textSegments[0].segments[it0->second.begin].size) * sizeof(wchar_t);
-			unsigned s2 = static_cast<unsigned>(textSegments[2].segments[it2->second.begin].size) * sizeof(wchar_t);
-			return data2.equals(
-				reinterpret_cast<const char *>(textSegments[0].allText.data() + it0->second.begin), s0,
-				reinterpret_cast<const char *>(textSegments[2].allText.data() + it2->second.begin), s2
-				);
+			return ids0[wd3.begin[0]] == ids2[wd3.begin[2]];
 		};
 
 		return Make3WayLineDiff(diffInfoList10, diffInfoList12, compfunc02);
@@ -682,35 +1621,75 @@ public:
 		const IWebDiffWindow::ColorSettings& colorSettings,
 		const IWebDiffWindow::DiffOptions& diffOptions,
 		bool showWordDifferences,
-		int diffIndex)
+		int diffIndex,
+		ThreadPool* pool = nullptr)
 		: m_documents(documents)
 		, m_diffInfoList(diffInfoList)
 		, m_colorSettings(colorSettings)
 		, m_diffOptions(diffOptions)
 		, m_showWordDifferences(showWordDifferences)
 		, m_diffIndex(diffIndex)
+		, m_pool(pool)
 	{
+		m_nodeIndexes.reserve(documents.size());
+		for (auto& document : documents)
+			m_nodeIndexes.emplace_back(document[L"root"]);
 	}
 
 	void highlightNodes()
 	{
-		for (size_t i = 0; i < m_diffInfoList.size(); ++i)
+		const size_t nPanes = m_documents.size();
+		const size_t nDiffs = m_diffInfoList.size();
+		std::vector<std::array<WValue*, 3>> pvaluesList(nDiffs);
+		std::vector<std::wstring> texts(nDiffs * nPanes);
+		std::vector<std::unordered_set<const WValue*>> wrappedNodes(nPanes);
+		for (size_t i = 0; i < nDiffs; ++i)
 		{
 			const auto& diffInfo = m_diffInfoList[i];
-			WValue* pvalues[3]{};
-			std::vector<TextSegments> textSegments(m_documents.size());
-			std::vector<DiffInfo> wordDiffInfoList;
-			for (size_t pane = 0; pane < m_documents.size(); ++pane)
+			for (size_t pane = 0; pane < nPanes; ++pane)
 			{
-				std::pair<WValue*, WValue*> pair = domutils::findNodeId(m_documents[pane][L"root"], diffInfo.nodeIds[pane]);
-				pvalues[pane] = pair.first;
-				if (diffInfo.nodePos[pane] == 0 && pvalues[pane])
-					textSegments[pane].Make((*pvalues[pane])[L"nodeValue"].GetString(), m_diffOptions.ignoreNumbers);
-				else
-					textSegments[pane].Make(L"", m_diffOptions.ignoreNumbers);
+				WValue* pvalue = m_nodeIndexes[pane].find(diffInfo.nodeIds[pane]).first;
+				pvaluesList[i][pane] = pvalue;
+				if (diffInfo.nodePos[pane] != 0 || !pvalue)
+					continue;
+				// A text node already wrapped by an earlier diff reads back as an empty SPAN
+				if (wrappedNodes[pane].find(pvalue) == wrappedNodes[pane].end())
+					texts[i * nPanes + pane] = (*pvalue)[L"nodeValue"].GetString();
+				if (diffInfo.nodeTypes[pane] == NodeType::TEXT_NODE)
+					wrappedNodes[pane].insert(pvalue);
+			}
+		}
+
+		// Each block is independent, so the word diffs are computed up front in parallel,
+		// in chunks that each reuse a workspace of their own and free it when done.
+		const bool parallel = m_pool && m_showWordDifferences;
+		const size_t chunkCount = parallel ? (std::min)(nDiffs, static_cast<size_t>(m_pool->size() + 1) * 4) : 1;
+		std::vector<std::vector<TextSegments>> textSegmentsList(nDiffs);
+		std::vector<std::vector<DiffInfo>> wordDiffInfoLists(nDiffs);
+		auto makeWordDiffInfoLists = [&](size_t chunk)
+		{
+			DiffWorkspace workspace;
+			for (size_t i = nDiffs * chunk / chunkCount; i < nDiffs * (chunk + 1) / chunkCount; ++i)
+			{
+				textSegmentsList[i].resize(nPanes);
+				for (size_t pane = 0; pane < nPanes; ++pane)
+					textSegmentsList[i][pane].Make(texts[i * nPanes + pane], m_diffOptions.ignoreNumbers);
+				if (m_showWordDifferences)
+					wordDiffInfoLists[i] = Comparer::compare(m_diffOptions, textSegmentsList[i], nullptr, &workspace);
 			}
-			if (m_showWordDifferences)
-				wordDiffInfoList = Comparer::compare(m_diffOptions, textSegments);
+		};
+		if (parallel)
+			m_pool->parallelFor(chunkCount, makeWordDiffInfoLists);
+		else
+			makeWordDiffInfoLists(0);
+
+		// RapidJSON allocators are not thread-safe, so the documents are modified serially.
+		for (size_t i = 0; i < nDiffs; ++i)
+		{
+			const auto& diffInfo = m_diffInfoList[i];
+			WValue** pvalues = pvaluesList[i].data();
+			std::vector<TextSegments>& textSegments = textSegmentsList[i];
+			const std::vector<DiffInfo>& wordDiffInfoList = wordDiffInfoLists[i];
 			for (size_t pane = 0; pane < m_documents.size(); ++pane)
 			{
 				if (!pvalues[pane])
@@ -861,30 +1840,361 @@ public:
 		}
 	}
 
+	// Serializes the tree and returns the outer HTML of the outermost modified
+	// nodes in the order their serialization ends. Frame documents are written to
+	// buffers of their own since they are not part of the outer HTML of the frame.
 	static std::wstring modifiedNodesToHTMLs(const WValue& tree, std::list<ModifiedNode>& nodes)
 	{
-		std::wstring html;
+		HTMLWriter writer;
+		writer.buffers.emplace_back();
+		writer.spans.emplace_back();
+		writeHTML(tree, 0, writer);
+		std::vector<const HTMLSpan*> outermost;
+		for (const auto& spans : writer.spans)
+		{
+			for (const auto& span : spans)
+				outermost.push_back(&span);
+		}
+		std::sort(outermost.begin(), outermost.end(),
+			[](const HTMLSpan* a, const HTMLSpan* b) { return a->sequence < b->sequence; });
+		for (const HTMLSpan* span : outermost)
+			nodes.push_back({ span->nodeId, writer.buffers[span->buffer].substr(span->begin, span->end - span->begin) });
+		return std::move(writer.buffers[0]);
+	}
+
+	// Encodes the modified nodes as scripts that replace up to batchSize nodes each,
+	// so that a pane is patched in one round trip instead of one DOM.setOuterHTML
+	// call per node. A script locates all of its nodes before replacing any of them
+	// and returns the indexes of the nodes it could not locate or replace. Nodes
+	// without a known path are left in nodes.
+	//
+	// Paths are those of the page before any script has run, so the scripts are
+	// returned last to first: a node replaced by other than one node then only
+	// moves siblings that have already been patched.
+	//
+	// Paths only hold while the page is the one the reader was read from, so a
+	// script returns null without patching anything if the wwdModified flag of one
+	// of its documents tells that the page has been modified otherwise since.
+	//
+	// With appliedNodes, the page is the one the reader was read from with those
+	// nodes patched since: paths and node names are those of the patched page, and
+	// a script is made even if there is nothing to patch, to check the page.
+	static std::vector<PatchBatch> makePatchBatches(std::list<ModifiedNode>& nodes, const TextSegmentsReader& reader, size_t batchSize,
+		const std::unordered_map<int, AppliedNode>* appliedNodes = nullptr)
+	{
+		static const wchar_t* script =
+LR"((function(patches) {
+  const children = new Map();
+  const isWhitespace = (node) => node.nodeType === 3 && /^[\t\n\v\f\r \u1680\u2000-\u200a\u2028\u205f\u3000]*$/.test(node.data);
+  const childList = (node) => {
+    if (!children.has(node))
+      children.set(node, Array.from(node.childNodes).filter((child) => !isWhitespace(child)));
+    return children.get(node);
+  };
+  const childAt = (node, index) => index < 0 ? node.contentDocument : childList(node)[index];
+  // Cross-origin and unloaded frames are skipped: no path leads into them
+  const documents = (doc) => [doc, ...Array.from(doc.querySelectorAll('iframe,frame'))
+    .filter((frame) => frame.contentDocument).flatMap((frame) => documents(frame.contentDocument))];
+  if (documents(document).some((doc) => doc.wwdModified !== false))
+    return null;
+  const locate = (patch) => {
+    const path = patch[0];
+    let parent = document;
+    for (const index of path.slice(0, -1)) {
+      parent = childAt(parent, index);
+      if (!parent)
+        return null;
+    }
+    const index = path[path.length - 1];
+    const count = patch.length > 3 ? patch[3] : 1;
+    if (count === 0)
+      return index <= childList(parent).length ? { parent, before: childList(parent)[index] || null, nodes: [] } : null;
+    const nodes = [];
+    for (let i = 0; i < count; i++) {
+      const node = childAt(parent, index + i);
+      if (!node)
+        return null;
+      nodes.push(node);
+    }
+    return nodes[0].nodeName === patch[1] ? { parent, nodes } : null;
+  };
+  const targets = patches.map((patch) => {
+    try {
+      return locate(patch);
+    } catch (e) {
+      return null;
+    }
+  });
+  const failed = [];
+  targets.forEach((target, i) => {
+    try {
+      if (target) {
+        const template = (target.parent.ownerDocument || target.parent).createElement('template');
+        template.innerHTML = patches[i][2];
+        if (target.nodes.length === 0)
+          target.parent.insertBefore(template.content, target.before);
+        else {
+          target.nodes[0].replaceWith(template.content);
+          target.nodes.slice(1).forEach((node) => node.remove());
+        }
+        return;
+      }
+    } catch (e) {
+    }
+    failed.push(i);
+  });
+  // The page is again the one the next script was made for
+  documents(document).forEach((doc) => {
+    if (doc.wwdObserver) {
+      doc.wwdObserver.takeRecords();
+      doc.wwdModified = false;
+    }
+  });
+  return failed;
+})([)";
+		// Nodes patched into other than one node move their later siblings
+		std::map<std::vector<int>, std::vector<std::pair<int, int>>> shifts;
+		std::vector<int> path;
+		std::wstring nodeName;
+		if (appliedNodes)
+		{
+			for (const auto& applied : *appliedNodes)
+			{
+				if (applied.second.count != 1 && reader.getNodePath(applied.first, path, nodeName) && !path.empty())
+				{
+					const int index = path.back();
+					path.pop_back();
+					shifts[path].emplace_back(index, static_cast<int>(applied.second.count) - 1);
+				}
+			}
+		}
+		std::vector<PatchBatch> batches;
+		std::vector<int> pagePath;
+		for (auto it = nodes.begin(); it != nodes.end(); )
+		{
+			if (!reader.getNodePath(it->nodeId, path, nodeName))
+			{
+				++it;
+				continue;
+			}
+			size_t count = 1;
+			pagePath = path;
+			if (appliedNodes)
+			{
+				for (size_t level = 0; level < path.size(); ++level)
+				{
+					auto shift = shifts.find(std::vector<int>(path.begin(), path.begin() + level));
+					if (shift == shifts.end())
+						continue;
+					for (const auto& sibling : shift->second)
+					{
+						if (sibling.first < path[level])
+							pagePath[level] += sibling.second;
+					}
+				}
+				auto applied = appliedNodes->find(it->nodeId);
+				if (applied != appliedNodes->end())
+				{
+					count = applied->second.count;
+					nodeName = applied->second.nodeName;
+				}
+			}
+			if (batches.empty() || batches.back().nodes.size() >= batchSize)
+			{
+				if (!batches.empty())
+					batches.back().script += L"]);";
+				batches.emplace_back();
+				batches.back().script = script;
+			}
+			std::wstring& text = batches.back().script;
+			if (!batches.back().nodes.empty())
+				text += L',';
+			text += L"[[";
+			for (size_t i = 0; i < pagePath.size(); ++i)
+			{
+				if (i > 0)
+					text += L',';
+				text += std::to_wstring(pagePath[i]);
+			}
+			text += L"],";
+			utils::AppendQuoted(text, nodeName.c_str(), nodeName.size());
+			text += L',';
+			utils::AppendQuoted(text, it->outerHTML.c_str(), it->outerHTML.size());
+			if (count != 1)
+				text += L',' + std::to_wstring(count);
+			text += L']';
+			batches.back().nodes.push_back(std::move(*it));
+			it = nodes.erase(it);
+		}
+		if (!batches.empty())
+			batches.back().script += L"]);";
+		std::reverse(batches.begin(), batches.end());
+		// Even with nothing to patch, the page is checked for other modifications
+		if (appliedNodes && batches.empty())
+		{
+			batches.emplace_back();
+			batches.back().script = std::wstring(script) + L"]);";
+		}
+		return batches;
+	}
+
+	// Returns how many nodes of the page the outer HTML written for a node is
+	// parsed into, the inserted and appended SPANs included, and the name of the first.
+	static size_t getPageNodes(const WValue& node, std::wstring& firstNodeName)
+	{
+		size_t count = 0;
+		auto add = [&](const WValue& value)
+			{
+				if (count++ == 0)
+					firstNodeName = value[L"nodeType"].GetInt() == NodeType::TEXT_NODE ? L"#text" : value[L"nodeName"].GetString();
+			};
+		if (node.HasMember(L"insertedNodes"))
+		{
+			for (const auto& child : node[L"insertedNodes"].GetArray())
+				add(child);
+		}
+		if (node[L"nodeType"].GetInt() != NodeType::TEXT_NODE || node[L"nodeValue"].GetStringLength() > 0)
+			add(node);
+		if (node.HasMember(L"appendedNodes"))
+		{
+			for (const auto& child : node[L"appendedNodes"].GetArray())
+				add(child);
+		}
+		return count;
+	}
+
+	static void getDiffNodes(const domutils::FlatDocument& document, uint32_t index, std::map<int, int>& nodes)
+	{
+		using FlatDocument = domutils::FlatDocument;
+		const FlatDocument::Node& node = document[index];
+		if (node.nodeType != NodeType::DOCUMENT_NODE && node.nodeType != NodeType::ELEMENT_NODE)
+			return;
+		if (document.containsClassName(index, L"wwd-diff"))
+		{
+			const wchar_t* data = document.getAttribute(index, L"data-wwdid");
+			const int diffIndex = data ? _wtoi(data) : -1;
+			nodes.insert_or_assign(diffIndex, node.nodeId);
+		}
+		for (uint32_t child = node.firstChild; child != FlatDocument::npos; child = document[child].nextSibling)
+			getDiffNodes(document, child, nodes);
+		if (node.contentDocument != FlatDocument::npos)
+		{
+			const FlatDocument::Node& contentDocument = document[node.contentDocument];
+			for (uint32_t child = contentDocument.firstChild; child != FlatDocument::npos; child = document[child].nextSibling)
+				getDiffNodes(document, child, nodes);
+		}
+	}
+
+	// Returns, for every document of the reader, the data-wwdid values of the
+	// highlighted elements in the order DOM.querySelectorAll('[data-wwdid]')
+	// finds them once the modified nodes have been applied to the page.
+	static std::vector<std::vector<int>> getDiffIndexesByDocument(const WValue& root, const TextSegmentsReader& reader)
+	{
+		std::vector<std::vector<int>> diffIndexes(reader.getDocumentNodeIds().size());
+		if (root.HasMember(L"children"))
+		{
+			for (const auto& child : root[L"children"].GetArray())
+			{
+				size_t documentIndex;
+				if (reader.getDocumentIndex(child[L"nodeId"].GetInt(), documentIndex))
+					getDiffIndexes(child, diffIndexes[documentIndex]);
+			}
+		}
+		return diffIndexes;
+	}
+
+	// Reads a DOM.querySelectorAll result that lists the highlighted elements in
+	// the order of diffIndexes. Returns false, leaving nodes as they were, if the
+	// call failed or the page does not list them as expected.
+	static bool getQueriedDiffNodes(HRESULT errorCode, const wchar_t* json, const std::vector<int>& diffIndexes, std::map<int, int>& nodes)
+	{
+		if (FAILED(errorCode) || !json)
+			return false;
+		WDocument doc;
+		doc.Parse(json);
+		if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember(L"nodeIds") || !doc[L"nodeIds"].IsArray())
+			return false;
+		const auto& nodeIds = doc[L"nodeIds"].GetArray();
+		if (nodeIds.Size() != diffIndexes.size())
+			return false;
+		for (const auto& nodeId : nodeIds)
+		{
+			if (!nodeId.IsInt())
+				return false;
+		}
+		for (unsigned i = 0; i < nodeIds.Size(); ++i)
+			nodes.insert_or_assign(diffIndexes[i], nodeIds[i].GetInt());
+		return true;
+	}
+
+	static std::wstring getStyleSheetText(int diffIndex, const IWebDiffWindow::ColorSettings& colorSettings)
+	{
+		std::wstring styles;
+		styles += L" .wwd-changed { " + getDiffStyleValue(colorSettings.clrDiffText, colorSettings.clrDiff) + L" }\n";
+		styles += L" .wwd-deleted { " + getDiffStyleValue(colorSettings.clrDiffText, colorSettings.clrDiffDeleted) + L" }\n";
+		styles += L" .wwd-snpchanged { " + getDiffStyleValue(colorSettings.clrSNPText, colorSettings.clrSNP) + L" }\n";
+		styles += L" .wwd-snpdeleted { " + getDiffStyleValue(colorSettings.clrSNPText, colorSettings.clrSNPDeleted) + L" }\n";
+		styles += L" .wwd-wordchanged { " + getDiffStyleValue(colorSettings.clrWordDiffText, colorSettings.clrWordDiff) + L" }\n";
+		styles += L" .wwd-worddeleted { " + getDiffStyleValue(colorSettings.clrWordDiffText, colorSettings.clrWordDiffDeleted) + L" }\n";
+
+		std::wstring datawwdid = L"[data-wwdid=\"" + std::to_wstring(diffIndex) + L"\"]";
+		styles += L" .wwd-changed" + datawwdid + L" { " + getDiffStyleValue(colorSettings.clrSelDiffText, colorSettings.clrSelDiff) + L" }\n";
+		styles += L" .wwd-deleted" + datawwdid + L" { " + getDiffStyleValue(colorSettings.clrSelDiffText, colorSettings.clrSelDiffDeleted) + L" }\n";
+		styles += L" .wwd-snpchanged" + datawwdid + L" { " + getDiffStyleValue(colorSettings.clrSelSNPText, colorSettings.clrSelSNP) + L" }\n";
+		styles += L" .wwd-snpdeleted" + datawwdid + L" { " + getDiffStyleValue(colorSettings.clrSelSNPText, colorSettings.clrSelSNPDeleted) + L" }\n";
+		styles += L" .wwd-diff" + datawwdid + L" .wwd-wordchanged { " + getDiffStyleValue(colorSettings.clrSelWordDiffText, colorSettings.clrSelWordDiff) + L" }\n";
+		styles += L" .wwd-diff" + datawwdid + L" .wwd-worddeleted { " + getDiffStyleValue(colorSettings.clrSelWordDiffText, colorSettings.clrSelWordDiffDeleted) + L" }\n";
+		return styles;
+	}
+
+private:
+	struct HTMLSpan
+	{
+		int nodeId;
+		size_t buffer;
+		size_t begin;
+		size_t end;
+		size_t sequence;
+	};
+
+	struct HTMLWriter
+	{
+		std::vector<std::wstring> buffers;
+		// Outermost modified nodes so far, per buffer, in document order
+		std::vector<std::vector<HTMLSpan>> spans;
+		size_t sequence = 0;
+	};
+
+	static void writeHTMLChildren(const WValue& tree, const wchar_t* name, size_t buffer, HTMLWriter& writer)
+	{
+		if (tree.HasMember(name))
+		{
+			for (const auto& child : tree[name].GetArray())
+				writeHTML(child, buffer, writer);
+		}
+	}
+
+	static void writeHTML(const WValue& tree, size_t buffer, HTMLWriter& writer)
+	{
+		const size_t begin = writer.buffers[buffer].size();
+		const size_t sequence = writer.sequence;
 		NodeType nodeType = static_cast<NodeType>(tree[L"nodeType"].GetInt());
 		switch (nodeType)
 		{
 		case NodeType::DOCUMENT_TYPE_NODE:
 		{
+			std::wstring& html = writer.buffers[buffer];
 			html += L"<!DOCTYPE ";
 			html += tree[L"nodeName"].GetString();
 			html += L">";
 			break;
 		}
 		case NodeType::DOCUMENT_NODE:
-		{
-			if (tree.HasMember(L"children"))
-			{
-				for (const auto& child : tree[L"children"].GetArray())
-					html += modifiedNodesToHTMLs(child, nodes);
-			}
+			writeHTMLChildren(tree, L"children", buffer, writer);
 			break;
-		}
 		case NodeType::COMMENT_NODE:
 		{
+			std::wstring& html = writer.buffers[buffer];
 			html += L"<!-- ";
 			html += tree[L"nodeValue"].GetString();
 			html += L" -->";
@@ -892,148 +2202,95 @@ public:
 		}
 		case NodeType::TEXT_NODE:
 		{
-			if (tree.HasMember(L"insertedNodes"))
-			{
-				for (const auto& child : tree[L"insertedNodes"].GetArray())
-					html += modifiedNodesToHTMLs(child, nodes);
-			}
-			std::wstring h = utils::EncodeHTMLEntities(tree[L"nodeValue"].GetString());
-			if (!h.empty() && std::all_of(h.begin(), h.end(), [](wchar_t ch) { return iswspace(ch); }))
-			{
-				h.pop_back();
-				h += L"&nbsp;";
-			}
-			html += h;
-			if (tree.HasMember(L"appendedNodes"))
-			{
-				for (const auto& child : tree[L"appendedNodes"].GetArray())
-					html += modifiedNodesToHTMLs(child, nodes);
-			}
-			if (tree.HasMember(L"modified"))
+			writeHTMLChildren(tree, L"insertedNodes", buffer, writer);
+			std::wstring& html = writer.buffers[buffer];
+			const WValue& text = tree[L"nodeValue"];
+			const size_t textBegin = html.size();
+			utils::AppendEncodedHTMLEntities(html, text.GetString(), text.GetStringLength());
+			if (html.size() > textBegin && std::all_of(html.begin() + textBegin, html.end(), [](wchar_t ch) { return iswspace(ch); }))
 			{
-				ModifiedNode node;
-				node.nodeId = tree[L"nodeId"].GetInt();
-				node.outerHTML = html;
-				nodes.emplace_back(std::move(node));
+				html.pop_back();
+				html += L"&nbsp;";
 			}
+			writeHTMLChildren(tree, L"appendedNodes", buffer, writer);
 			break;
 		}
 		case NodeType::ELEMENT_NODE:
 		{
-			if (tree.HasMember(L"insertedNodes"))
-			{
-				for (const auto& child : tree[L"insertedNodes"].GetArray())
-					html += modifiedNodesToHTMLs(child, nodes);
-			}
-			html += L'<';
-			html += tree[L"nodeName"].GetString();
-			if (tree.HasMember(L"attributes"))
+			writeHTMLChildren(tree, L"insertedNodes", buffer, writer);
 			{
-				const auto& attributes = tree[L"attributes"].GetArray();
-				for (unsigned i = 0; i < attributes.Size(); i += 2)
+				std::wstring& html = writer.buffers[buffer];
+				html += L'<';
+				html += tree[L"nodeName"].GetString();
+				if (tree.HasMember(L"attributes"))
 				{
-					html += L" ";
-					html += attributes[i].GetString();
-					html += L"=\"";
-					if (i + 1 < attributes.Size())
-						html += utils::EncodeHTMLEntities(attributes[i + 1].GetString());
-					html += L"\"";
+					const auto& attributes = tree[L"attributes"].GetArray();
+					for (unsigned i = 0; i < attributes.Size(); i += 2)
+					{
+						html += L" ";
+						html += attributes[i].GetString();
+						html += L"=\"";
+						if (i + 1 < attributes.Size())
+							utils::AppendEncodedHTMLEntities(html, attributes[i + 1].GetString(), attributes[i + 1].GetStringLength());
+						html += L"\"";
+					}
 				}
+				html += L'>';
 			}
-			html += L'>';
-			if (tree.HasMember(L"children"))
-			{
-				for (const auto& child : tree[L"children"].GetArray())
-					html += modifiedNodesToHTMLs(child, nodes);
-			}
-			if (tree.HasMember(L"appendedNodes"))
-			{
-				for (const auto& child : tree[L"appendedNodes"].GetArray())
-					html += modifiedNodesToHTMLs(child, nodes);
-			}
+			writeHTMLChildren(tree, L"children", buffer, writer);
+			writeHTMLChildren(tree, L"appendedNodes", buffer, writer);
 			if (tree.HasMember(L"contentDocument"))
 			{
-				for (const auto& child : tree[L"contentDocument"][L"children"].GetArray())
-					modifiedNodesToHTMLs(child, nodes);
+				const size_t frameBuffer = writer.buffers.size();
+				writer.buffers.emplace_back();
+				writer.spans.emplace_back();
+				writeHTMLChildren(tree[L"contentDocument"], L"children", frameBuffer, writer);
 			}
 			if (!utils::IsVoidElement(tree[L"nodeName"].GetString()))
 			{
+				std::wstring& html = writer.buffers[buffer];
 				html += L"</";
 				html += tree[L"nodeName"].GetString();
 				html += L'>';
 			}
-			if (tree.HasMember(L"modified"))
-			{
-				ModifiedNode node;
-				node.nodeId = tree[L"nodeId"].GetInt();
-				node.outerHTML = html;
-				nodes.emplace_back(std::move(node));
-			}
 			break;
 		}
 		}
-		return html;
+		if (tree.HasMember(L"modified"))
+		{
+			// The spans of modified descendants are inside this one and are dropped
+			auto& spans = writer.spans[buffer];
+			while (!spans.empty() && spans.back().sequence >= sequence)
+				spans.pop_back();
+			spans.push_back({ tree[L"nodeId"].GetInt(), buffer, begin, writer.buffers[buffer].size(), writer.sequence++ });
+		}
 	}
 
-	static void getDiffNodes(WValue& tree, std::map<int, int>& nodes)
+	static void getDiffIndexes(const WValue& tree, std::vector<int>& diffIndexes)
 	{
-		NodeType nodeType = static_cast<NodeType>(tree[L"nodeType"].GetInt());
-		switch (nodeType)
-		{
-		case NodeType::DOCUMENT_NODE:
+		if (tree.HasMember(L"insertedNodes"))
 		{
-			if (tree.HasMember(L"children"))
-			{
-				for (auto& child : tree[L"children"].GetArray())
-					getDiffNodes(child, nodes);
-			}
-			break;
+			for (const auto& child : tree[L"insertedNodes"].GetArray())
+				getDiffIndexes(child, diffIndexes);
 		}
-		case NodeType::ELEMENT_NODE:
+		if (tree[L"nodeType"].GetInt() == NodeType::ELEMENT_NODE)
 		{
-			if (isDiffNode(tree))
-			{
-				const int nodeId = tree[L"nodeId"].GetInt();
-				const wchar_t* data = domutils::getAttribute(tree, L"data-wwdid");
-				const int diffIndex = data ? _wtoi(data) : -1;
-				nodes.insert_or_assign(diffIndex, nodeId);
-			}
+			const wchar_t* data = domutils::getAttribute(tree, L"data-wwdid");
+			if (data)
+				diffIndexes.push_back(_wtoi(data));
 			if (tree.HasMember(L"children"))
 			{
-				for (auto& child : tree[L"children"].GetArray())
-					getDiffNodes(child, nodes);
-			}
-			if (tree.HasMember(L"contentDocument") && tree[L"contentDocument"].HasMember(L"children"))
-			{
-				for (auto& child : tree[L"contentDocument"][L"children"].GetArray())
-					getDiffNodes(child, nodes);
+				for (const auto& child : tree[L"children"].GetArray())
+					getDiffIndexes(child, diffIndexes);
 			}
-			break;
 		}
+		if (tree.HasMember(L"appendedNodes"))
+		{
+			for (const auto& child : tree[L"appendedNodes"].GetArray())
+				getDiffIndexes(child, diffIndexes);
 		}
 	}
 
-	static std::wstring getStyleSheetText(int diffIndex, const IWebDiffWindow::ColorSettings& colorSettings)
-	{
-		std::wstring styles;
-		styles += L" .wwd-changed { " + getDiffStyleValue(colorSettings.clrDiffText, colorSettings.clrDiff) + L" }\n";
-		styles += L" .wwd-deleted { " + getDiffStyleValue(colorSettings.clrDiffText, colorSettings.clrDiffDeleted) + L" }\n";
-		styles += L" .wwd-snpchanged { " + getDiffStyleValue(colorSettings.clrSNPText, colorSettings.clrSNP) + L" }\n";
-		styles += L" .wwd-snpdeleted { " + getDiffStyleValue(colorSettings.clrSNPText, colorSettings.clrSNPDeleted) + L" }\n";
-		styles += L" .wwd-wordchanged { " + getDiffStyleValue(colorSettings.clrWordDiffText, colorSettings.clrWordDiff) + L" }\n";
-		styles += L" .wwd-worddeleted { " + getDiffStyleValue(colorSettings.clrWordDiffText, colorSettings.clrWordDiffDeleted) + L" }\n";
-
-		std::wstring datawwdid = L"[data-wwdid=\"" + std::to_wstring(diffIndex) + L"\"]";
-		styles += L" .wwd-changed" + datawwdid + L" { " + getDiffStyleValue(colorSettings.clrSelDiffText, colorSettings.clrSelDiff) + L" }\n";
-		styles += L" .wwd-deleted" + datawwdid + L" { " + getDiffStyleValue(colorSettings.clrSelDiffText, colorSettings.clrSelDiffDeleted) + L" }\n";
-		styles += L" .wwd-snpchanged" + datawwdid + L" { " + getDiffStyleValue(colorSettings.clrSelSNPText, colorSettings.clrSelSNP) + L" }\n";
-		styles += L" .wwd-snpdeleted" + datawwdid + L" { " + getDiffStyleValue(colorSettings.clrSelSNPText, colorSettings.clrSelSNPDeleted) + L" }\n";
-		styles += L" .wwd-diff" + datawwdid + L" .wwd-wordchanged { " + getDiffStyleValue(colorSettings.clrSelWordDiffText, colorSettings.clrSelWordDiff) + L" }\n";
-		styles += L" .wwd-diff" + datawwdid + L" .wwd-worddeleted { " + getDiffStyleValue(colorSettings.clrSelWordDiffText, colorSettings.clrSelWordDiffDeleted) + L" }\n";
-		return styles;
-	}
-
-private:
 	static void appendAttributes(WValue& attributes, const std::wstring& className, size_t diffIndex, WDocument::AllocatorType& allocator)
 	{
 		std::wstring className2 = className;
@@ -1172,17 +2429,16 @@ private:
 			for (size_t pane = 0; pane < m_documents.size(); ++pane)
 				if (diffInfo.end[pane] < diffInfo.begin[pane])
 					deleted = true;
-			auto it = textSegments.segments.begin();
-			std::advance(it, diffInfo.begin[pane]);
-			if (it != textSegments.segments.end())
+			if (static_cast<size_t>(diffInfo.begin[pane]) < textSegments.segments.size())
 			{
-				size_t begin2 = it->second.begin;
+				size_t begin2 = textSegments.segments.offset(diffInfo.begin[pane]);
 				size_t end2 = 0;
 				if (diffInfo.end[pane] != -1)
 				{
-					it = textSegments.segments.begin();
-					std::advance(it, diffInfo.end[pane]);
-					end2 = it->second.begin + it->second.size;
+					if (static_cast<size_t>(diffInfo.end[pane]) < textSegments.segments.size())
+						end2 = textSegments.segments.offset(diffInfo.end[pane]) + textSegments.segments.length(diffInfo.end[pane]);
+					else
+						end2 = textSegments.allText.size();
 				}
 				std::wstring text = textSegments.allText.substr(begin, begin2 - begin);
 				std::wstring textDiff = textSegments.allText.substr(begin2, end2 - begin2);
@@ -1229,9 +2485,196 @@ private:
 
 	std::vector<DiffInfo>& m_diffInfoList;
 	std::vector<WDocument>& m_documents;
+	std::vector<domutils::NodeIndex> m_nodeIndexes;
 	const IWebDiffWindow::ColorSettings& m_colorSettings;
 	const IWebDiffWindow::DiffOptions& m_diffOptions;
 	bool m_showWordDifferences = true;
 	int m_diffIndex = -1;
+	ThreadPool* m_pool = nullptr;
+};
+
+
+// What a pane needs once a compare has finished: the scripts and remaining
+// modified nodes that patch the page, and what makeDiffNodeIdArrayLoop() needs
+// to read the node ids of the highlighted elements back.
+struct PanePatch
+{
+	std::vector<PatchBatch> batches;
+	std::list<ModifiedNode> nodes;
+	std::vector<int> documentNodeIds;
+	std::vector<std::vector<int>> diffIndexes;
 };
 
+// The documents of the panes as they were read, kept so that a compare with
+// other options can be redone without reading them again
+struct DocumentSnapshot
+{
+	std::vector<std::wstring> jsons;
+	std::vector<TextSegments> textSegments;
+	std::vector<TextSegmentsReader> readers;
+};
+
+// A compare of the fetched documents that runs off the UI thread. It owns its
+// inputs and a copy of the settings, so nothing it touches changes while it runs,
+// and leaves only the patches to be applied on the UI thread.
+//
+// Given a snapshot and the nodes patched since it was taken instead of jsons, it
+// compares the snapshot again and only patches the nodes whose HTML changes. It
+// fails with E_CHANGED_STATE if the patches cannot be located from the snapshot.
+struct CompareTask
+{
+	std::vector<std::wstring> jsons;
+	std::shared_ptr<const DocumentSnapshot> snapshot;
+	std::vector<std::unordered_map<int, AppliedNode>> appliedNodes;
+	IWebDiffWindow::DiffOptions diffOptions{};
+	DiffLimits diffLimits;
+	IWebDiffWindow::ColorSettings colorSettings{};
+	bool showDifferences = true;
+	bool showWordDifferences = true;
+	int currentDiffIndex = -1;
+	size_t patchBatchSize = 1000;
+	std::shared_ptr<CompareCache> cache;
+	std::atomic<bool> cancelled{ false };
+
+	HRESULT hr = S_OK;
+	bool fromSnapshot = false;
+	std::vector<DiffInfo> diffInfos;
+	std::vector<PanePatch> panes;
+
+	void run(ThreadPool& pool)
+	{
+		fromSnapshot = snapshot != nullptr;
+		try
+		{
+			hr = runSteps(pool);
+		}
+		catch (const std::bad_alloc&)
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		catch (...)
+		{
+			hr = E_FAIL;
+		}
+		if (FAILED(hr))
+		{
+			diffInfos.clear();
+			panes.clear();
+			snapshot.reset();
+			appliedNodes.clear();
+		}
+	}
+
+private:
+	HRESULT runSteps(ThreadPool& pool)
+	{
+		if (!fromSnapshot)
+		{
+			const size_t nPanes = jsons.size();
+			auto documents = std::make_shared<DocumentSnapshot>();
+			documents->textSegments.resize(nPanes);
+			documents->readers.resize(nPanes);
+			std::atomic<bool> parsed{ true };
+			pool.parallelFor(nPanes, [&](size_t pane)
+				{
+					if (!documents->readers[pane].read(jsons[pane].c_str(), documents->textSegments[pane]))
+						parsed = false;
+				});
+			if (!parsed)
+				return E_FAIL;
+			documents->jsons = std::move(jsons);
+			snapshot = std::move(documents);
+			appliedNodes.assign(nPanes, {});
+		}
+		if (cancelled)
+			return E_ABORT;
+		const size_t nPanes = snapshot->jsons.size();
+		const std::vector<TextSegments>& textSegments = snapshot->textSegments;
+		const std::vector<TextSegmentsReader>& readers = snapshot->readers;
+
+		diffInfos = Comparer::compare(diffOptions, textSegments, &pool, nullptr, &cancelled, cache.get(), diffLimits);
+		if (cancelled)
+			return E_ABORT;
+		Comparer::setNodeIdInDiffInfoList(diffInfos, textSegments);
+		if (currentDiffIndex != -1 && currentDiffIndex >= static_cast<int>(diffInfos.size()))
+			currentDiffIndex = static_cast<int>(diffInfos.size() - 1);
+
+		// Only the nodes to be highlighted or unhighlighted are parsed into a DOM
+		std::vector<WDocument> documents(nPanes);
+		pool.parallelFor(nPanes, [&](size_t pane)
+			{
+				std::unordered_set<int> nodeIds;
+				if (showDifferences)
+				{
+					for (const auto& diffInfo : diffInfos)
+						nodeIds.insert(diffInfo.nodeIds[pane]);
+				}
+				for (const auto& applied : appliedNodes[pane])
+					nodeIds.insert(applied.first);
+				readers[pane].materialize(snapshot->jsons[pane], nodeIds, documents[pane]);
+				Highlighter::unhighlightNodes(documents[pane][L"root"], documents[pane].GetAllocator());
+			});
+		if (showDifferences)
+		{
+			Highlighter highlighter(documents, diffInfos, colorSettings, diffOptions, showWordDifferences, currentDiffIndex, &pool);
+			highlighter.highlightNodes();
+		}
+		if (cancelled)
+			return E_ABORT;
+
+		panes.resize(nPanes);
+		std::atomic<bool> located{ true };
+		pool.parallelFor(nPanes, [&](size_t pane)
+			{
+				PanePatch& patch = panes[pane];
+				WValue& root = documents[pane][L"root"];
+				// The nodes patched before are written again, highlighted or restored
+				std::unordered_map<int, const WValue*> children;
+				if (root.HasMember(L"children"))
+				{
+					for (auto& child : root[L"children"].GetArray())
+					{
+						const int nodeId = child[L"nodeId"].GetInt();
+						if (!child.HasMember(L"modified") && appliedNodes[pane].find(nodeId) != appliedNodes[pane].end())
+							child.AddMember(L"modified", true, documents[pane].GetAllocator());
+						children.emplace(nodeId, &child);
+					}
+				}
+				Highlighter::modifiedNodesToHTMLs(root, patch.nodes);
+				std::unordered_map<int, AppliedNode> applied;
+				for (auto it = patch.nodes.begin(); it != patch.nodes.end(); )
+				{
+					auto child = children.find(it->nodeId);
+					if (child == children.end())
+					{
+						located = false;
+						++it;
+						continue;
+					}
+					AppliedNode node{};
+					node.count = Highlighter::getPageNodes(*child->second, node.nodeName);
+					node.outerHTML = it->outerHTML;
+					auto previous = appliedNodes[pane].find(it->nodeId);
+					const bool unchanged = previous != appliedNodes[pane].end() && previous->second.outerHTML == it->outerHTML;
+					applied.emplace(it->nodeId, std::move(node));
+					it = unchanged ? patch.nodes.erase(it) : std::next(it);
+				}
+				patch.batches = Highlighter::makePatchBatches(patch.nodes, readers[pane], patchBatchSize,
+					fromSnapshot ? &appliedNodes[pane] : nullptr);
+				if (!patch.nodes.empty())
+					located = false;
+				appliedNodes[pane] = std::move(applied);
+				patch.documentNodeIds = readers[pane].getDocumentNodeIds();
+				patch.diffIndexes = Highlighter::getDiffIndexesByDocument(root, readers[pane]);
+			});
+		if (!located)
+		{
+			// The page cannot be patched from the snapshot next time
+			if (fromSnapshot)
+				return E_CHANGED_STATE;
+			snapshot.reset();
+			appliedNodes.clear();
+		}
+		return S_OK;
+	}
+};
@@ -0,0 +1,70 @@
+# Generates CharClassTable.hpp, the two-level table behind utils::GetCharClass().
+# Usage: python GenCharClassTable.py > CharClassTable.hpp
+import unicodedata
+
+SPACE, DIGIT, WORD = 1, 2, 4
+BLOCK_BITS = 5
+
+# PropList.txt White_Space
+WHITE_SPACE = set([0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x20, 0x85, 0xA0, 0x1680, 0x2028, 0x2029, 0x202F, 0x205F, 0x3000]
+                  + list(range(0x2000, 0x200B)))
+# Latin-1 characters that break words; other Latin-1 characters belong to words
+BREAK_CHARS = ".,:;?[](){}<=>`'!\"#$%&^~\\|@+-*/"
+
+def char_class(cp):
+    ch = chr(cp)
+    category = unicodedata.category(ch)
+    value = 0
+    if cp in WHITE_SPACE:
+        value |= SPACE
+    if category == 'Nd':
+        value |= DIGIT
+    if cp < 0x100:
+        if ch not in BREAK_CHARS:
+            value |= WORD
+    elif ch.isupper() or ch.islower() or category in ('Lt', 'Nd'):
+        value |= WORD
+    return value
+
+def main():
+    block_size = 1 << BLOCK_BITS
+    blocks = []
+    block_ids = {}
+    stage1 = []
+    for base in range(0, 0x10000, block_size):
+        block = tuple(char_class(cp) for cp in range(base, base + block_size))
+        if block not in block_ids:
+            block_ids[block] = len(blocks)
+            blocks.append(block)
+        stage1.append(block_ids[block])
+    assert len(blocks) <= 256
+
+    out = []
+    out.append('#pragma once')
+    out.append('')
+    out.append('#include <cstdint>')
+    out.append('')
+    out.append('// Generated by GenCharClassTable.py from Unicode %s data. Do not edit.' % unicodedata.unidata_version)
+    out.append('namespace utils')
+    out.append('{')
+    out.append('\tnamespace detail')
+    out.append('\t{')
+    out.append('\t\tconstexpr unsigned CharClassBlockBits = %d;' % BLOCK_BITS)
+    out.append('')
+    out.append('\t\tconstexpr uint8_t CharClassStage1[%d] =' % len(stage1))
+    out.append('\t\t{')
+    for i in range(0, len(stage1), 16):
+        out.append('\t\t\t' + ' '.join('%d,' % v for v in stage1[i:i + 16]))
+    out.append('\t\t};')
+    out.append('')
+    out.append('\t\tconstexpr uint8_t CharClassStage2[%d][%d] =' % (len(blocks), block_size))
+    out.append('\t\t{')
+    for block in blocks:
+        out.append('\t\t\t{ ' + ','.join('%d' % v for v in block) + ' },')
+    out.append('\t\t};')
+    out.append('\t}')
+    out.append('}')
+    print('\n'.join(out))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Element names that the traversals classify, resolved to a small enum through
+// a perfect hash table that is built at compile time.
+namespace htmltags
+{
+	enum Tag : uint8_t
+	{
+		TAG_OTHER,
+		TAG_A, TAG_ABBR, TAG_ACRONYM, TAG_AREA, TAG_AUDIO, TAG_B, TAG_BASE, TAG_BDI,
+		TAG_BDO, TAG_BIG, TAG_BR, TAG_BUTTON, TAG_CANVAS, TAG_CITE, TAG_CODE, TAG_COL,
+		TAG_DATA, TAG_DATALIST, TAG_DEL, TAG_DFN, TAG_EM, TAG_EMBED, TAG_HR, TAG_I,
+		TAG_IFRAME, TAG_IMG, TAG_INPUT, TAG_INS, TAG_KBD, TAG_LABEL, TAG_LINK, TAG_MAP,
+		TAG_MARK, TAG_META, TAG_METER, TAG_NOFRAMES, TAG_NOSCRIPT, TAG_OBJECT, TAG_OUTPUT, TAG_PICTURE,
+		TAG_PROGRESS, TAG_Q, TAG_RUBY, TAG_S, TAG_SAMP, TAG_SCRIPT, TAG_SELECT, TAG_SLOT,
+		TAG_SMALL, TAG_SOURCE, TAG_SPAN, TAG_STRONG, TAG_STYLE, TAG_SUB, TAG_SUP, TAG_SVG,
+		TAG_TEMPLATE, TAG_TEXTAREA, TAG_TIME, TAG_TITLE, TAG_TRACK, TAG_TT, TAG_U, TAG_VAR,
+		TAG_VIDEO, TAG_WBR,
+		TAG_COUNT
+	};
+
+	enum Property : uint8_t
+	{
+		VOID_ELEMENT = 1,
+		INLINE_ELEMENT = 2,
+		SKIP_TEXT = 4, // text that is not compared: SCRIPT, NOSCRIPT, NOFRAMES, STYLE and TITLE
+	};
+
+	struct TagInfo
+	{
+		const wchar_t* name;
+		unsigned properties;
+	};
+
+	// Indexed by Tag. Names are case-sensitive, as DOM.getDocument reports them.
+	constexpr TagInfo tagInfos[] =
+	{
+		{ L"", 0 },
+		{ L"A", INLINE_ELEMENT },
+		{ L"ABBR", INLINE_ELEMENT },
+		{ L"ACRONYM", INLINE_ELEMENT },
+		{ L"AREA", VOID_ELEMENT },
+		{ L"AUDIO", INLINE_ELEMENT },
+		{ L"B", INLINE_ELEMENT },
+		{ L"BASE", VOID_ELEMENT },
+		{ L"BDI", INLINE_ELEMENT },
+		{ L"BDO", INLINE_ELEMENT },
+		{ L"BIG", INLINE_ELEMENT },
+		{ L"BR", VOID_ELEMENT | INLINE_ELEMENT },
+		{ L"BUTTON", INLINE_ELEMENT },
+		{ L"CANVAS", INLINE_ELEMENT },
+		{ L"CITE", INLINE_ELEMENT },
+		{ L"CODE", INLINE_ELEMENT },
+		{ L"COL", VOID_ELEMENT },
+		{ L"DATA", INLINE_ELEMENT },
+		{ L"DATALIST", INLINE_ELEMENT },
+		{ L"DEL", INLINE_ELEMENT },
+		{ L"DFN", INLINE_ELEMENT },
+		{ L"EM", INLINE_ELEMENT },
+		{ L"EMBED", VOID_ELEMENT | INLINE_ELEMENT },
+		{ L"HR", VOID_ELEMENT },
+		{ L"I", INLINE_ELEMENT },
+		{ L"IFRAME", INLINE_ELEMENT },
+		{ L"IMG", VOID_ELEMENT | INLINE_ELEMENT },
+		{ L"INPUT", VOID_ELEMENT | INLINE_ELEMENT },
+		{ L"INS", INLINE_ELEMENT },
+		{ L"KBD", INLINE_ELEMENT },
+		{ L"LABEL", INLINE_ELEMENT },
+		{ L"LINK", VOID_ELEMENT },
+		{ L"MAP", INLINE_ELEMENT },
+		{ L"MARK", INLINE_ELEMENT },
+		{ L"META", VOID_ELEMENT },
+		{ L"METER", INLINE_ELEMENT },
+		{ L"NOFRAMES", SKIP_TEXT },
+		{ L"NOSCRIPT", INLINE_ELEMENT | SKIP_TEXT },
+		{ L"OBJECT", INLINE_ELEMENT },
+		{ L"OUTPUT", INLINE_ELEMENT },
+		{ L"PICTURE", INLINE_ELEMENT },
+		{ L"PROGRESS", INLINE_ELEMENT },
+		{ L"Q", INLINE_ELEMENT },
+		{ L"RUBY", INLINE_ELEMENT },
+		{ L"S", INLINE_ELEMENT },
+		{ L"SAMP", INLINE_ELEMENT },
+		{ L"SCRIPT", INLINE_ELEMENT | SKIP_TEXT },
+		{ L"SELECT", INLINE_ELEMENT },
+		{ L"SLOT", INLINE_ELEMENT },
+		{ L"SMALL", INLINE_ELEMENT },
+		{ L"SOURCE", VOID_ELEMENT },
+		{ L"SPAN", INLINE_ELEMENT },
+		{ L"STRONG", INLINE_ELEMENT },
+		{ L"STYLE", SKIP_TEXT },
+		{ L"SUB", INLINE_ELEMENT },
+		{ L"SUP", INLINE_ELEMENT },
+		{ L"SVG", INLINE_ELEMENT },
+		{ L"TEMPLATE", INLINE_ELEMENT },
+		{ L"TEXTAREA", INLINE_ELEMENT },
+		{ L"TIME", INLINE_ELEMENT },
+		{ L"TITLE", SKIP_TEXT },
+		{ L"TRACK", VOID_ELEMENT },
+		{ L"TT", INLINE_ELEMENT },
+		{ L"U", INLINE_ELEMENT },
+		{ L"VAR", INLINE_ELEMENT },
+		{ L"VIDEO", INLINE_ELEMENT },
+		{ L"WBR", VOID_ELEMENT | INLINE_ELEMENT },
+	};
+	static_assert(sizeof(tagInfos) / sizeof(tagInfos[0]) == TAG_COUNT, "tagInfos must list every Tag");
+
+	namespace detail
+	{
+		constexpr unsigned SLOT_BITS = 11;
+		constexpr size_t SLOT_COUNT = size_t(1) << SLOT_BITS;
+
+		constexpr uint32_t hash(const wchar_t* name, size_t length, uint32_t seed)
+		{
+			uint32_t h = seed;
+			for (size_t i = 0; i < length; ++i)
+				h = (h ^ static_cast<uint16_t>(name[i])) * 16777619u;
+			h ^= h >> 15;
+			h *= 0x2c1b3c6du;
+			h ^= h >> 12;
+			return h >> (32 - SLOT_BITS);
+		}
+
+		constexpr size_t length(const wchar_t* name)
+		{
+			size_t i = 0;
+			while (name[i])
+				++i;
+			return i;
+		}
+
+		// Returns the first seed for which no two names share a slot
+		constexpr uint32_t findSeed()
+		{
+			for (uint32_t seed = 1; seed < 1000; ++seed)
+			{
+				bool used[SLOT_COUNT] = {};
+				bool perfect = true;
+				for (size_t tag = 1; tag < TAG_COUNT && perfect; ++tag)
+				{
+					const uint32_t slot = hash(tagInfos[tag].name, length(tagInfos[tag].name), seed);
+					perfect = !used[slot];
+					used[slot] = true;
+				}
+				if (perfect)
+					return seed;
+			}
+			return 0;
+		}
+
+		constexpr uint32_t seed = findSeed();
+		static_assert(seed != 0, "no perfect hash seed for tagInfos");
+
+		struct SlotTable
+		{
+			uint8_t tags[SLOT_COUNT];
+		};
+
+		constexpr SlotTable makeSlotTable()
+		{
+			SlotTable table{};
+			for (size_t tag = 1; tag < TAG_COUNT; ++tag)
+				table.tags[hash(tagInfos[tag].name, length(tagInfos[tag].name), seed)] = static_cast<uint8_t>(tag);
+			return table;
+		}
+
+		constexpr SlotTable slotTable = makeSlotTable();
+	}
+
+	inline Tag lookup(const wchar_t* name, size_t length)
+	{
+		const Tag tag = static_cast<Tag>(detail::slotTable.tags[detail::hash(name, length, detail::seed)]);
+		const wchar_t* candidate = tagInfos[tag].name;
+		for (size_t i = 0; i < length; ++i)
+		{
+			if (candidate[i] != name[i])
+				return TAG_OTHER;
+		}
+		return candidate[length] == 0 ? tag : TAG_OTHER;
+	}
+
+	inline Tag lookup(const wchar_t* name)
+	{
+		return lookup(name, detail::length(name));
+	}
+
+	inline bool hasProperty(Tag tag, Property property)
+	{
+		return (tagInfos[tag].properties & property) != 0;
+	}
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned threadCount = (std::max)(std::thread::hardware_concurrency(), 2u) - 1)
+	{
+		for (unsigned i = 0; i < threadCount; ++i)
+			m_threads.emplace_back([this] { worker(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		for (auto& thread : m_threads)
+			thread.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	static ThreadPool& instance()
+	{
+		// Never destroyed: joining threads from a DLL's static destructors
+		// would deadlock on the loader lock.
+		static ThreadPool* pool = new ThreadPool();
+		return *pool;
+	}
+
+	unsigned size() const { return static_cast<unsigned>(m_threads.size()); }
+
+	// Calls func(i) for every i in [0, count) and returns when all calls have finished.
+	// Indexes are claimed one at a time by the calling thread and by the workers, so
+	// uneven items balance out and a nested call cannot deadlock waiting for a busy
+	// worker. The first exception thrown by func is rethrown on the calling thread.
+	template <class Func>
+	void parallelFor(size_t count, Func&& func)
+	{
+		if (count == 0)
+			return;
+		if (count == 1 || m_threads.empty())
+		{
+			for (size_t i = 0; i < count; ++i)
+				func(i);
+			return;
+		}
+
+		struct State
+		{
+			std::atomic<size_t> next{ 0 };
+			std::atomic<size_t> completed{ 0 };
+			size_t count = 0;
+			std::function<void(size_t)> func;
+			std::exception_ptr exception;
+			std::mutex mutex;
+			std::condition_variable cv;
+
+			void run()
+			{
+				for (size_t i = next++; i < count; i = next++)
+				{
+					try
+					{
+						func(i);
+					}
+					catch (...)
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						if (!exception)
+							exception = std::current_exception();
+					}
+					if (++completed == count)
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						cv.notify_all();
+					}
+				}
+			}
+		};
+
+		auto state = std::make_shared<State>();
+		state->count = count;
+		state->func = std::ref(func);
+		const size_t helpers = (std::min)(count - 1, m_threads.size());
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (size_t i = 0; i < helpers; ++i)
+				m_tasks.emplace_back([state] { state->run(); });
+		}
+		m_cv.notify_all();
+		state->run();
+		{
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->cv.wait(lock, [&] { return state->completed == count; });
+		}
+		if (state->exception)
+			std::rethrow_exception(state->exception);
+	}
+
+	// Runs task on a worker without waiting for it, or right away if there are no workers.
+	// Nobody is there to rethrow to, so task has to report its own errors: an
+	// exception it lets escape is discarded.
+	void submit(std::function<void()> task)
+	{
+		if (m_threads.empty())
+		{
+			runTask(task);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.emplace_back(std::move(task));
+		}
+		m_cv.notify_one();
+	}
+
+private:
+	void worker()
+	{
+		for (;;)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cv.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+				if (m_stop && m_tasks.empty())
+					return;
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+			runTask(task);
+		}
+	}
+
+	static void runTask(const std::function<void()>& task)
+	{
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()>> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_stop = false;
+};
@@ -2,104 +2,30 @@
 
 #include <vector>
 #include <cstdlib>
+#include <algorithm>
 #include <string>
 #include <windows.h>
+#include "HTMLTags.hpp"
+#include "CharClassTable.hpp"
+#if defined(_M_X64) || defined(_M_IX86) || (defined(__SSE2__) && __SIZEOF_WCHAR_T__ == 2)
+#include <emmintrin.h>
+#define WWD_SSE2
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WWD_AVX2
+#endif
+#endif
 
 namespace utils
 {
-	int cmp(const void* a, const void* b)
-	{
-		const wchar_t* const* pa = reinterpret_cast<const wchar_t* const*>(a);
-		const wchar_t* const* pb = reinterpret_cast<const wchar_t* const*>(b);
-		return wcscmp(*pa, *pb);
-	}
-
 	bool IsVoidElement(const wchar_t* name)
 	{
-		static const wchar_t* voidElements[] =
-		{
-			L"AREA",
-			L"BASE",
-			L"BR",
-			L"COL",
-			L"EMBED",
-			L"HR",
-			L"IMG",
-			L"INPUT",
-			L"LINK",
-			L"META",
-			L"SOURCE",
-			L"TRACK",
-			L"WBR",
-		};
-		return bsearch(&name, voidElements,
-			sizeof(voidElements) / sizeof(voidElements[0]),
-			sizeof(voidElements[0]), cmp);
+		return htmltags::hasProperty(htmltags::lookup(name), htmltags::VOID_ELEMENT);
 	}
 
 	bool IsInlineElement(const wchar_t* name)
 	{
-		static const wchar_t* inlineElements[] =
-		{
-			L"A",
-			L"ABBR",
-			L"ACRONYM",
-			L"AUDIO",
-			L"B",
-			L"BDI",
-			L"BDO",
-			L"BIG",
-			L"BR",
-			L"BUTTON",
-			L"CANVAS",
-			L"CITE",
-			L"CODE",
-			L"DATA",
-			L"DATALIST",
-			L"DEL",
-			L"DFN",
-			L"EM",
-			L"EMBED",
-			L"I",
-			L"IFRAME",
-			L"IMG",
-			L"INPUT",
-			L"INS",
-			L"KBD",
-			L"LABEL",
-			L"MAP",
-			L"MARK",
-			L"METER",
-			L"NOSCRIPT",
-			L"OBJECT",
-			L"OUTPUT",
-			L"PICTURE",
-			L"PROGRESS",
-			L"Q",
-			L"RUBY",
-			L"S",
-			L"SAMP",
-			L"SCRIPT",
-			L"SELECT",
-			L"SLOT",
-			L"SMALL",
-			L"SPAN",
-			L"STRONG",
-			L"SUB",
-			L"SUP",
-			L"SVG",
-			L"TEMPLATE",
-			L"TEXTAREA",
-			L"TIME",
-			L"TT",
-			L"U",
-			L"VAR",
-			L"VIDEO",
-			L"WBR",
-		};
-		return bsearch(&name, inlineElements,
-			sizeof(inlineElements) / sizeof(inlineElements[0]),
-			sizeof(inlineElements[0]), cmp);
+		return htmltags::hasProperty(htmltags::lookup(name), htmltags::INLINE_ELEMENT);
 	}
 
 	std::wstring trim_ws(const std::wstring& str)
@@ -127,19 +53,138 @@ namespace utils
 		return result;
 	}
 
-	std::wstring EncodeHTMLEntities(const std::wstring& text)
+	namespace detail
 	{
-		std::wstring result;
-		for (auto c : text)
+		unsigned CountTrailingZeros(unsigned mask)
 		{
-			switch (c)
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return index;
+#else
+			return __builtin_ctz(mask);
+#endif
+		}
+
+		unsigned PopCount64(uint64_t bits)
+		{
+#ifdef _MSC_VER
+			// __popcnt64 would require the POPCNT instruction
+			bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+			bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+			bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+			return static_cast<unsigned>((bits * 0x0101010101010101ULL) >> 56);
+#else
+			return static_cast<unsigned>(__builtin_popcountll(bits));
+#endif
+		}
+
+		// Returns the index of the first character in [pos, length) for which
+		// Traits::needsEscape() is true, or length. Blocks of 16 or 8 code units
+		// are tested at once where AVX2 or SSE2 is available.
+		template <class Traits>
+		size_t FindEscape(const wchar_t* text, size_t pos, size_t length)
+		{
+#ifdef WWD_AVX2
+			for (; pos + 16 <= length; pos += 16)
+			{
+				const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + pos));
+				const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(Traits::needsEscape(chars)));
+				if (mask)
+					return pos + CountTrailingZeros(mask) / 2;
+			}
+#endif
+#ifdef WWD_SSE2
+			for (; pos + 8 <= length; pos += 8)
+			{
+				const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos));
+				const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(Traits::needsEscape(chars)));
+				if (mask)
+					return pos + CountTrailingZeros(mask) / 2;
+			}
+#endif
+			for (; pos < length; ++pos)
+			{
+				if (Traits::needsEscape(text[pos]))
+					return pos;
+			}
+			return length;
+		}
+
+		struct HTMLEntityTraits
+		{
+			static bool needsEscape(wchar_t c) { return c == '<' || c == '>' || c == '"'; }
+#ifdef WWD_AVX2
+			static __m256i needsEscape(__m256i chars)
+			{
+				return _mm256_or_si256(_mm256_or_si256(
+					_mm256_cmpeq_epi16(chars, _mm256_set1_epi16('<')),
+					_mm256_cmpeq_epi16(chars, _mm256_set1_epi16('>'))),
+					_mm256_cmpeq_epi16(chars, _mm256_set1_epi16('"')));
+			}
+#endif
+#ifdef WWD_SSE2
+			static __m128i needsEscape(__m128i chars)
+			{
+				return _mm_or_si128(_mm_or_si128(
+					_mm_cmpeq_epi16(chars, _mm_set1_epi16('<')),
+					_mm_cmpeq_epi16(chars, _mm_set1_epi16('>'))),
+					_mm_cmpeq_epi16(chars, _mm_set1_epi16('"')));
+			}
+#endif
+		};
+
+		struct JSONStringTraits
+		{
+			static bool needsEscape(wchar_t c) { return c < 0x20 || c == '"' || c == '\\'; }
+#ifdef WWD_AVX2
+			static __m256i needsEscape(__m256i chars)
+			{
+				// Unsigned chars <= 0x1F saturate to zero
+				const __m256i control = _mm256_cmpeq_epi16(
+					_mm256_subs_epu16(chars, _mm256_set1_epi16(0x1F)), _mm256_setzero_si256());
+				return _mm256_or_si256(_mm256_or_si256(control,
+					_mm256_cmpeq_epi16(chars, _mm256_set1_epi16('"'))),
+					_mm256_cmpeq_epi16(chars, _mm256_set1_epi16('\\')));
+			}
+#endif
+#ifdef WWD_SSE2
+			static __m128i needsEscape(__m128i chars)
+			{
+				const __m128i control = _mm_cmpeq_epi16(
+					_mm_subs_epu16(chars, _mm_set1_epi16(0x1F)), _mm_setzero_si128());
+				return _mm_or_si128(_mm_or_si128(control,
+					_mm_cmpeq_epi16(chars, _mm_set1_epi16('"'))),
+					_mm_cmpeq_epi16(chars, _mm_set1_epi16('\\')));
+			}
+#endif
+		};
+	}
+
+	void AppendEncodedHTMLEntities(std::wstring& result, const wchar_t* text, size_t length)
+	{
+		result.reserve(result.size() + length);
+		size_t pos = 0;
+		while (pos < length)
+		{
+			const size_t next = detail::FindEscape<detail::HTMLEntityTraits>(text, pos, length);
+			result.append(text + pos, next - pos);
+			if (next == length)
+				break;
+			switch (text[next])
 			{
 			case '<':  result += L"&lt;"; break;
 			case '>':  result += L"&gt;"; break;
 			case '"':  result += L"&quot;"; break;
-			default:   result += c; break;
 			}
+			pos = next + 1;
 		}
+	}
+
+	std::wstring EncodeHTMLEntities(const std::wstring& text)
+	{
+		std::wstring result;
+		AppendEncodedHTMLEntities(result, text.c_str(), text.size());
 		return result;
 	}
 
@@ -162,23 +207,171 @@ namespace utils
 		return result;
 	}
 
-	std::wstring Quote(const std::wstring& text)
+	// Appends text as a JSON string literal, which is also a valid JavaScript one
+	void AppendQuoted(std::wstring& result, const wchar_t* text, size_t length)
 	{
-		std::wstring ret;
-		ret += L"\"";
-		for (auto c : text)
+		static const wchar_t hex[] = L"0123456789abcdef";
+		result.reserve(result.size() + length + 2);
+		result += L'"';
+		size_t pos = 0;
+		while (pos < length)
 		{
+			const size_t next = detail::FindEscape<detail::JSONStringTraits>(text, pos, length);
+			result.append(text + pos, next - pos);
+			if (next == length)
+				break;
+			const wchar_t c = text[next];
 			switch (c)
 			{
-			case '\r': break;
-			case '\n': ret += L"\\n"; break;
-			case '\"': ret += L"\\\""; break;
-			case '\\': ret += L"\\\\"; break;
-			default:   ret += c;
+			case '"':  result += L"\\\""; break;
+			case '\\': result += L"\\\\"; break;
+			case '\b': result += L"\\b"; break;
+			case '\f': result += L"\\f"; break;
+			case '\n': result += L"\\n"; break;
+			case '\r': result += L"\\r"; break;
+			case '\t': result += L"\\t"; break;
+			default:
+			{
+				const wchar_t escaped[] = { L'\\', L'u', L'0', L'0', hex[c >> 4], hex[c & 0xF] };
+				result.append(escaped, 6);
+				break;
+			}
+			}
+			pos = next + 1;
+		}
+		result += L'"';
+	}
+
+	std::wstring Quote(const std::wstring& text)
+	{
+		std::wstring result;
+		AppendQuoted(result, text.c_str(), text.size());
+		return result;
+	}
+
+	enum CharClass : uint8_t
+	{
+		CHARCLASS_SPACE = 1, // Unicode White_Space
+		CHARCLASS_DIGIT = 2, // Unicode Nd
+		CHARCLASS_WORD = 4,  // part of a word: Latin-1 except punctuation, cased letters and digits
+	};
+
+	unsigned GetCharClass(wchar_t ch)
+	{
+#if WCHAR_MAX > 0xFFFF
+		if (static_cast<uint32_t>(ch) > 0xFFFF)
+			return 0;
+#endif
+		const unsigned cp = static_cast<unsigned>(ch);
+		return detail::CharClassStage2[detail::CharClassStage1[cp >> detail::CharClassBlockBits]]
+			[cp & ((1u << detail::CharClassBlockBits) - 1)];
+	}
+
+	bool IsSpace(wchar_t ch) { return (GetCharClass(ch) & CHARCLASS_SPACE) != 0; }
+	bool IsDigit(wchar_t ch) { return (GetCharClass(ch) & CHARCLASS_DIGIT) != 0; }
+	bool IsWordBreak(wchar_t ch) { return (GetCharClass(ch) & CHARCLASS_WORD) == 0; }
+
+	// Token type of a character: 0 word, 1 whitespace, 2 word break (a token on its
+	// own), 3 digit when numbers are ignored
+	int GetCharType(wchar_t ch, bool ignoreNumbers)
+	{
+		const unsigned charClass = GetCharClass(ch);
+		if (charClass & CHARCLASS_SPACE)
+			return 1;
+		if (!(charClass & CHARCLASS_WORD))
+			return 2;
+		if (ignoreNumbers && (charClass & CHARCLASS_DIGIT))
+			return 3;
+		return 0;
+	}
+
+	namespace detail
+	{
+		// GetCharType() of 16 or 8 ASCII code units
+#ifdef WWD_AVX2
+		__m256i GetCharTypes(__m256i chars, __m256i digitType)
+		{
+			auto inRange = [chars](short lo, short hi)
+			{
+				return _mm256_and_si256(_mm256_cmpgt_epi16(chars, _mm256_set1_epi16(lo - 1)),
+					_mm256_cmpgt_epi16(_mm256_set1_epi16(hi + 1), chars));
+			};
+			const __m256i space = _mm256_or_si256(inRange(0x09, 0x0D), _mm256_cmpeq_epi16(chars, _mm256_set1_epi16(' ')));
+			const __m256i punct = _mm256_or_si256(_mm256_or_si256(inRange(0x21, 0x2F), inRange(0x3A, 0x40)),
+				_mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi16(chars, _mm256_set1_epi16('_')), inRange(0x5B, 0x60)), inRange(0x7B, 0x7E)));
+			return _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(space, _mm256_set1_epi16(1)), _mm256_and_si256(punct, _mm256_set1_epi16(2))),
+				_mm256_and_si256(inRange('0', '9'), digitType));
+		}
+#endif
+#ifdef WWD_SSE2
+		__m128i GetCharTypes(__m128i chars, __m128i digitType)
+		{
+			auto inRange = [chars](short lo, short hi)
+			{
+				return _mm_and_si128(_mm_cmpgt_epi16(chars, _mm_set1_epi16(lo - 1)), _mm_cmplt_epi16(chars, _mm_set1_epi16(hi + 1)));
+			};
+			const __m128i space = _mm_or_si128(inRange(0x09, 0x0D), _mm_cmpeq_epi16(chars, _mm_set1_epi16(' ')));
+			const __m128i punct = _mm_or_si128(_mm_or_si128(inRange(0x21, 0x2F), inRange(0x3A, 0x40)),
+				_mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi16(chars, _mm_set1_epi16('_')), inRange(0x5B, 0x60)), inRange(0x7B, 0x7E)));
+			return _mm_or_si128(_mm_or_si128(_mm_and_si128(space, _mm_set1_epi16(1)), _mm_and_si128(punct, _mm_set1_epi16(2))),
+				_mm_and_si128(inRange('0', '9'), digitType));
+		}
+#endif
+	}
+
+	// Returns the first index in [pos, length) where a new token starts: the character
+	// type differs from that of the previous character or is a word break. pos must be
+	// greater than 0. Runs of ASCII are classified 16 or 8 code units at a time where
+	// AVX2 or SSE2 is available.
+	size_t FindTokenStart(const wchar_t* text, size_t pos, size_t length, bool ignoreNumbers)
+	{
+		while (pos < length)
+		{
+#ifdef WWD_AVX2
+			const __m256i digitType256 = _mm256_set1_epi16(ignoreNumbers ? 3 : 0);
+			for (; pos + 16 <= length; pos += 16)
+			{
+				const __m256i prev = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + pos - 1));
+				const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + pos));
+				if (!_mm256_testz_si256(_mm256_or_si256(prev, chars), _mm256_set1_epi16(static_cast<short>(0xFF80))))
+					break;
+				const __m256i types = detail::GetCharTypes(chars, digitType256);
+				const __m256i same = _mm256_andnot_si256(_mm256_cmpeq_epi16(types, _mm256_set1_epi16(2)),
+					_mm256_cmpeq_epi16(types, detail::GetCharTypes(prev, digitType256)));
+				const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(same));
+				if (mask)
+					return pos + detail::CountTrailingZeros(mask) / 2;
+			}
+#endif
+#ifdef WWD_SSE2
+			const __m128i digitType = _mm_set1_epi16(ignoreNumbers ? 3 : 0);
+			for (; pos + 8 <= length; pos += 8)
+			{
+				const __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos - 1));
+				const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos));
+				const __m128i nonASCII = _mm_and_si128(_mm_or_si128(prev, chars), _mm_set1_epi16(static_cast<short>(0xFF80)));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonASCII, _mm_setzero_si128())) != 0xFFFF)
+					break;
+				const __m128i types = detail::GetCharTypes(chars, digitType);
+				const __m128i same = _mm_andnot_si128(_mm_cmpeq_epi16(types, _mm_set1_epi16(2)),
+					_mm_cmpeq_epi16(types, detail::GetCharTypes(prev, digitType)));
+				const unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(same)) & 0xFFFF;
+				if (mask)
+					return pos + detail::CountTrailingZeros(mask) / 2;
+			}
+#endif
+			// Non-ASCII characters and the tail
+			const size_t end = (std::min)(pos + 16, length);
+			int prevType = GetCharType(text[pos - 1], ignoreNumbers);
+			for (; pos < end; ++pos)
+			{
+				const int type = GetCharType(text[pos], ignoreNumbers);
+				if (type == 2 || type != prevType)
+					return pos;
+				prevType = type;
 			}
 		}
-		ret += L"\"";
-		return ret;
+		return length;
 	}
 
 	std::vector<BYTE> DecodeBase64(const std::wstring& base64)
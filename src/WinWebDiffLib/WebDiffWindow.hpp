@@ -5,6 +5,7 @@
 #include "DiffHighlighter.hpp"
 #include <shellapi.h>
 #include <wil/win32_helpers.h>
+#include <future>
 
 class CWebDiffWindow : public IWebDiffWindow
 {
@@ -24,6 +25,7 @@ public:
 
 	bool Destroy()
 	{
+		cancelCompare(true);
 		BOOL bSucceeded = true;
 		if (m_hWnd)
 			bSucceeded = DestroyWindow(m_hWnd);
@@ -95,6 +97,10 @@ public:
 								{
 									m_webWindow[ev.pane].SetZoom(m_zoom);
 								}
+								else if (event == WebDiffEvent::NavigationStarting)
+								{
+									cancelCompare();
+								}
 								else if (event == WebDiffEvent::ZoomFactorChanged)
 								{
 									m_zoom = m_webWindow[ev.pane].GetZoom();
@@ -144,6 +150,7 @@ public:
 
 	void Close() override
 	{
+		cancelCompare(true);
 		for (int i = 0; i < m_nPanes; ++i)
 			m_webWindow[i].Destroy();
 	}
@@ -403,7 +410,7 @@ public:
 		if (visible == m_bShowDifferences)
 			return;
 		m_bShowDifferences = visible;
-		Recompare(nullptr);
+		compareFromSnapshot(nullptr);
 	}
 
 	bool GetShowWordDifferences() const override
@@ -416,7 +423,7 @@ public:
 		if (visible == m_bShowWordDifferences)
 			return;
 		m_bShowWordDifferences = visible;
-		Recompare(nullptr);
+		compareFromSnapshot(nullptr);
 	}
 
 	const DiffOptions& GetDiffOptions() const override
@@ -427,7 +434,33 @@ public:
 	void SetDiffOptions(const DiffOptions& diffOptions) override
 	{
 		m_diffOptions = diffOptions;
-		Recompare(nullptr);
+		compareFromSnapshot(nullptr);
+	}
+
+	int  GetDiffTimeLimit() const override
+	{
+		return m_diffLimits.timeLimit;
+	}
+
+	void SetDiffTimeLimit(int timeLimit) override
+	{
+		if (timeLimit == m_diffLimits.timeLimit)
+			return;
+		m_diffLimits.timeLimit = timeLimit;
+		compareFromSnapshot(nullptr);
+	}
+
+	int  GetDiffCostLimit() const override
+	{
+		return m_diffLimits.costLimit;
+	}
+
+	void SetDiffCostLimit(int costLimit) override
+	{
+		if (costLimit == m_diffLimits.costLimit)
+			return;
+		m_diffLimits.costLimit = costLimit;
+		compareFromSnapshot(nullptr);
 	}
 
 	int  GetDiffCount() const override
@@ -652,40 +685,113 @@ public:
 	}
 
 private:
+	static constexpr UINT WM_COMPARE_COMPLETED = WM_APP + 1;
+	static constexpr size_t PATCH_BATCH_SIZE = 1000;
+
+	struct PendingCompare
+	{
+		std::shared_ptr<CompareTask> task;
+		ComPtr<IWebDiffCallback> callback;
+	};
+
+	// Issues an asynchronous call for every pane at once and invokes callback
+	// once all of them have completed. The first failure is reported.
+	HRESULT forEachPane(const std::function<HRESULT(int pane, IWebDiffCallback* callback)>& func, IWebDiffCallback* callback)
+	{
+		struct Join
+		{
+			int remaining;
+			HRESULT hr;
+			bool canceled;
+			ComPtr<IWebDiffCallback> callback;
+		};
+		auto join = std::make_shared<Join>(Join{ m_nPanes + 1, S_OK, false, callback });
+		auto done = [join](HRESULT hr) -> HRESULT
+			{
+				if (FAILED(hr) && SUCCEEDED(join->hr))
+					join->hr = hr;
+				if (--join->remaining == 0 && !join->canceled && join->callback)
+					return join->callback->Invoke({ join->hr, nullptr });
+				return S_OK;
+			};
+		for (int pane = 0; pane < m_nPanes; ++pane)
+		{
+			HRESULT hr = func(pane,
+				Callback<IWebDiffCallback>([done](const WebDiffCallbackResult& result) -> HRESULT
+					{
+						return done(result.errorCode);
+					}).Get());
+			if (FAILED(hr))
+			{
+				join->canceled = true;
+				return hr;
+			}
+		}
+		done(S_OK);
+		return S_OK;
+	}
 
-	HRESULT getDocumentsLoop(std::shared_ptr<std::vector<std::wstring>> jsons, IWebDiffCallback* callback, int pane = 0)
+	// Starts recording whether the page changes before the document is read, so
+	// that the patching scripts, which locate nodes by their paths in this
+	// document, can tell whether the page is still the one that was read.
+	HRESULT getDocument(int pane, IWebDiffCallback* callback)
 	{
 		static const wchar_t* method = L"DOM.getDocument";
 		static const wchar_t* params = L"{ \"depth\": -1, \"pierce\": true }";
+		static const wchar_t* script =
+LR"(
+(function() {
+  if (!document.wwdObserver) {
+    const isStyle = (node) => node && (node.nodeName === 'STYLE' || (node.parentNode && node.parentNode.nodeName === 'STYLE'));
+    document.wwdObserver = new MutationObserver(function(records) {
+      if (records.some((r) => !isStyle(r.target) && (r.type !== 'childList' || ![...r.addedNodes, ...r.removedNodes].every(isStyle))))
+        document.wwdModified = true;
+    });
+    document.wwdObserver.observe(document, { childList: true, characterData: true, subtree: true });
+  }
+  document.wwdObserver.takeRecords();
+  document.wwdModified = false;
+})();
+)";
 		ComPtr<IWebDiffCallback> callback2(callback);
-		HRESULT hr = m_webWindow[pane].CallDevToolsProtocolMethod(method, params,
-			Callback<IWebDiffCallback>([this, pane, jsons, callback2](const WebDiffCallbackResult& result) -> HRESULT
+		return m_webWindow[pane].ExecuteScriptInAllFrames(script,
+			Callback<IWebDiffCallback>([this, pane, callback2](const WebDiffCallbackResult& result) -> HRESULT
 				{
-					HRESULT hr = result.errorCode;
-					if (SUCCEEDED(hr))
-					{
-						jsons->push_back(result.returnObjectAsJson);
-						if (pane + 1 < m_nPanes)
-							hr = getDocumentsLoop(jsons, callback2.Get(), pane + 1);
-						else if (callback2)
-							return callback2->Invoke({ hr, nullptr });
-					}
+					// A frame without an observer counts as modified, so its failure is not fatal
+					HRESULT hr = m_webWindow[pane].CallDevToolsProtocolMethod(method, params, callback2.Get());
 					if (FAILED(hr) && callback2)
 						return callback2->Invoke({ hr, nullptr });
 					return S_OK;
 				}).Get());
-		return hr;
 	}
 
-	HRESULT addDblClickEventListenerLoop(IWebDiffCallback* callback, int pane = 0)
+	HRESULT getDocumentsLoop(std::shared_ptr<std::vector<std::wstring>> jsons, IWebDiffCallback* callback)
+	{
+		jsons->resize(m_nPanes);
+		return forEachPane([this, jsons](int pane, IWebDiffCallback* callback) -> HRESULT
+			{
+				ComPtr<IWebDiffCallback> callback2(callback);
+				return getDocument(pane,
+					Callback<IWebDiffCallback>([pane, jsons, callback2](const WebDiffCallbackResult& result) -> HRESULT
+						{
+							if (SUCCEEDED(result.errorCode))
+								(*jsons)[pane] = result.returnObjectAsJson;
+							return callback2->Invoke({ result.errorCode, nullptr });
+						}).Get());
+			}, callback);
+	}
+
+	HRESULT addDblClickEventListenerLoop(IWebDiffCallback* callback)
 	{
-		ComPtr<IWebDiffCallback> callback2(callback);
 		const wchar_t* script =
 LR"(
 (function() {
   const elms = document.querySelectorAll('.wwd-diff');
   if (elms) {
     elms.forEach(function(el) {
+      if (el.wwdListening)
+        return;
+      el.wwdListening = true;
       el.addEventListener('dblclick', function() {
         window.chrome.webview.postMessage('wwdid=' + el.dataset['wwdid']);
       });
@@ -693,116 +799,208 @@ LR"(
   }
 })();
 )";
-		HRESULT hr = m_webWindow[pane].ExecuteScriptInAllFrames(script,
-			Callback<IWebDiffCallback>([this, pane, callback2](const WebDiffCallbackResult& result) -> HRESULT
+		return forEachPane([this, script](int pane, IWebDiffCallback* callback) -> HRESULT
+			{
+				ComPtr<IWebDiffCallback> callback2(callback);
+				return m_webWindow[pane].ExecuteScriptInAllFrames(script,
+					Callback<IWebDiffCallback>([callback2](const WebDiffCallbackResult& result) -> HRESULT
+						{
+							return callback2->Invoke({ S_OK /* result.errorCode */, nullptr });
+						}).Get());
+			}, callback);
+	}
+
+	// Also forgets the snapshot, as the page may no longer be the one it was taken from.
+	// With wait, returns only once no worker runs a compare task or posts to the window.
+	void cancelCompare(bool wait = false)
+	{
+		for (auto& pending : m_pendingCompares)
+			pending.task->cancelled = true;
+		forgetSnapshot();
+		if (wait)
+		{
+			for (auto& running : m_runningCompares)
+				running.wait();
+			m_runningCompares.clear();
+		}
+	}
+
+	void forgetSnapshot()
+	{
+		m_snapshot.reset();
+		m_appliedNodes.clear();
+		++m_snapshotGeneration;
+	}
+
+	// Fetches the documents on the UI thread and hands them to a CompareTask on a
+	// worker. WM_COMPARE_COMPLETED brings the result back for completeCompare().
+	HRESULT compare(IWebDiffCallback* callback)
+	{
+		// A newer compare supersedes the ones still fetching documents or running
+		cancelCompare();
+		auto task = std::make_shared<CompareTask>();
+		m_pendingCompares.push_back({ task, callback });
+		std::shared_ptr<std::vector<std::wstring>> jsons(new std::vector<std::wstring>(m_nPanes));
+		HRESULT hr = getDocumentsLoop(jsons,
+			Callback<IWebDiffCallback>([this, jsons, task](const WebDiffCallbackResult& result) -> HRESULT
 				{
-					HRESULT hr = S_OK; // result.errorCode;
-					if (SUCCEEDED(hr))
-					{
-						if (pane + 1 < m_nPanes)
-							hr = addDblClickEventListenerLoop(callback2.Get(), pane + 1);
-						else if (callback2)
-							return callback2->Invoke({ hr, nullptr });
-					}
-					if (FAILED(hr) && callback2)
-						return callback2->Invoke({ hr, nullptr });
+					if (FAILED(result.errorCode) || task->cancelled)
+						return completeCompare(task.get(), FAILED(result.errorCode) ? result.errorCode : E_ABORT);
+					task->jsons = std::move(*jsons);
+					runCompareTask(task);
 					return S_OK;
 				}).Get());
+		if (FAILED(hr))
+		{
+			auto it = findPendingCompare(task.get());
+			if (it != m_pendingCompares.end())
+				m_pendingCompares.erase(it);
+		}
 		return hr;
 	}
 
-	HRESULT compare(IWebDiffCallback* callback)
+	// Compares the documents of the last compare again, if the page has only been
+	// patched since, so that changing an option does not read the documents again.
+	HRESULT compareFromSnapshot(IWebDiffCallback* callback)
+	{
+		if (!m_snapshot)
+			return compare(callback);
+		auto task = std::make_shared<CompareTask>();
+		task->snapshot = std::move(m_snapshot);
+		task->appliedNodes = std::move(m_appliedNodes);
+		cancelCompare();
+		m_pendingCompares.push_back({ task, callback });
+		runCompareTask(task);
+		return S_OK;
+	}
+
+	void runCompareTask(std::shared_ptr<CompareTask> task)
+	{
+		task->diffOptions = m_diffOptions;
+		task->diffLimits = m_diffLimits;
+		task->colorSettings = m_colorSettings;
+		task->showDifferences = m_bShowDifferences;
+		task->showWordDifferences = m_bShowWordDifferences;
+		task->currentDiffIndex = m_currentDiffIndex;
+		task->patchBatchSize = PATCH_BATCH_SIZE;
+		task->cache = m_compareCache;
+		// The worker only touches the task and the window handle. run reports
+		// failures in task->hr, so the completion is always posted. The window keeps
+		// its reference to the task until the message is handled, and the worker
+		// drops its own before it signals that it is done.
+		HWND hWnd = m_hWnd;
+		auto done = std::make_shared<std::promise<void>>();
+		m_runningCompares.remove_if([](const std::future<void>& running)
+			{
+				return running.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+			});
+		m_runningCompares.push_back(done->get_future());
+		ThreadPool::instance().submit([task, hWnd, done]() mutable
+			{
+				task->run(ThreadPool::instance());
+				PostMessage(hWnd, WM_COMPARE_COMPLETED, 0, reinterpret_cast<LPARAM>(task.get()));
+				task.reset();
+				done->set_value();
+			});
+	}
+
+	std::list<PendingCompare>::iterator findPendingCompare(const CompareTask* task)
 	{
-		ComPtr<IWebDiffCallback> callback2(callback);
-		std::shared_ptr<std::vector<std::wstring>> jsons(new std::vector<std::wstring>());
-		HRESULT hr = getDocumentsLoop(jsons,
-			Callback<IWebDiffCallback>([this, jsons, callback2](const WebDiffCallbackResult& result) -> HRESULT
-				{
-					HRESULT hr = result.errorCode;
-					if (SUCCEEDED(hr))
+		return std::find_if(m_pendingCompares.begin(), m_pendingCompares.end(),
+			[task](const PendingCompare& pending) { return pending.task.get() == task; });
+	}
+
+	// Applies the result of a finished compare to the panes, unless a newer
+	// compare has been queued since, in which case it is discarded.
+	HRESULT completeCompare(const CompareTask* completed, HRESULT hr)
+	{
+		auto it = findPendingCompare(completed);
+		if (it == m_pendingCompares.end())
+			return S_OK;
+		std::shared_ptr<CompareTask> task = std::move(it->task);
+		ComPtr<IWebDiffCallback> callback2 = std::move(it->callback);
+		m_pendingCompares.erase(it);
+		if (SUCCEEDED(hr))
+			hr = task->cancelled ? E_ABORT : task->hr;
+		if (hr == E_CHANGED_STATE)
+		{
+			// The page has changed since the snapshot was taken: read it again
+			hr = compare(callback2.Get());
+		}
+		else if (SUCCEEDED(hr))
+		{
+			m_diffInfos = std::move(task->diffInfos);
+			m_currentDiffIndex = task->currentDiffIndex;
+			// Patching invalidates the snapshot until the task's own one is in place
+			forgetSnapshot();
+			const unsigned generation = m_snapshotGeneration;
+			hr = highlightDocuments(task,
+				Callback<IWebDiffCallback>([this, task, generation, callback2](const WebDiffCallbackResult& result) -> HRESULT
 					{
-						std::vector<TextSegments> textSegments(m_nPanes);
-						std::shared_ptr<std::vector<WDocument>> documents(new std::vector<WDocument>(m_nPanes));
-						for (int pane = 0; pane < m_nPanes; ++pane)
+						HRESULT hr = result.errorCode;
+						if (hr == E_CHANGED_STATE)
+							hr = recompareChangedPage(callback2.Get());
+						else if (SUCCEEDED(hr))
 						{
-							(*documents)[pane].Parse((*jsons)[pane].c_str());
-#ifdef _DEBUG
-							WStringBuffer buffer;
-							WPrettyWriter writer(buffer);
-							(*documents)[pane].Accept(writer);
-							WriteToTextFile((L"c:\\tmp\\file" + std::to_wstring(pane) + L".json"),
-								buffer.GetString());
-#endif
-							Highlighter::unhighlightNodes((*documents)[pane][L"root"], (*documents)[pane].GetAllocator());
-							textSegments[pane].Make((*documents)[pane][L"root"]);
-						}
-						m_diffInfos = Comparer::compare(m_diffOptions, textSegments);
-						Comparer::setNodeIdInDiffInfoList(m_diffInfos, textSegments);
-						if (m_currentDiffIndex != -1 && m_currentDiffIndex >= m_diffInfos.size())
-							m_currentDiffIndex = static_cast<int>(m_diffInfos.size() - 1);
-						if (m_bShowDifferences)
-						{
-							Highlighter highlighter(*documents.get(), m_diffInfos, m_colorSettings, m_diffOptions, m_bShowWordDifferences, m_currentDiffIndex);
-							highlighter.highlightNodes();
-#ifdef _DEBUG
-							for (int pane = 0; pane < m_nPanes; ++pane)
-							{
-								WStringBuffer buffer;
-								WPrettyWriter writer(buffer);
-								(*documents)[pane].Accept(writer);
-								WriteToTextFile((L"c:\\tmp\\file" + std::to_wstring(pane) + L"_1.json"),
-									buffer.GetString());
-							}
-#endif
-						}
-						hr = highlightDocuments(documents,
-							Callback<IWebDiffCallback>([this, callback2](const WebDiffCallbackResult& result) -> HRESULT
-								{
-									HRESULT hr = result.errorCode;
-									if (SUCCEEDED(hr))
+							hr = setStyleSheetLoop(Highlighter::getStyleSheetText(m_currentDiffIndex, m_colorSettings).c_str(),
+								Callback<IWebDiffCallback>([this, task, generation, callback2](const WebDiffCallbackResult& result) -> HRESULT
 									{
-										hr = setStyleSheetLoop(Highlighter::getStyleSheetText(m_currentDiffIndex, m_colorSettings).c_str(),
-											Callback<IWebDiffCallback>([this, callback2](const WebDiffCallbackResult& result) -> HRESULT
-												{
-													HRESULT hr = result.errorCode;
-													if (SUCCEEDED(hr))
-														hr = addDblClickEventListenerLoop(callback2.Get());
-													if (FAILED(hr) && callback2)
-														return callback2->Invoke({ hr, nullptr });
-													return S_OK;
-												}).Get());
-									}
-									if (FAILED(hr) && callback2)
-										return callback2->Invoke({ hr, nullptr });
-									return S_OK;
-								}).Get());
-					}
-					if (FAILED(hr) && callback2)
-						return callback2->Invoke({ hr, nullptr });
-					return S_OK;
-				}).Get());
-		return hr;
+										HRESULT hr = result.errorCode;
+										if (SUCCEEDED(hr))
+										{
+											hr = addDblClickEventListenerLoop(
+												Callback<IWebDiffCallback>([this, task, generation, callback2](const WebDiffCallbackResult& result) -> HRESULT
+													{
+														// Unless another compare or a navigation has started meanwhile
+														if (SUCCEEDED(result.errorCode) && generation == m_snapshotGeneration)
+														{
+															m_snapshot = std::move(task->snapshot);
+															m_appliedNodes = std::move(task->appliedNodes);
+														}
+														if (callback2)
+															return callback2->Invoke(result);
+														return S_OK;
+													}).Get());
+										}
+										if (FAILED(hr) && callback2)
+											return callback2->Invoke({ hr, nullptr });
+										return S_OK;
+									}).Get());
+						}
+						if (FAILED(hr) && callback2)
+							return callback2->Invoke({ hr, nullptr });
+						return S_OK;
+					}).Get());
+		}
+		if (FAILED(hr) && callback2)
+			return callback2->Invoke({ hr, nullptr });
+		return S_OK;
 	}
 
-	HRESULT saveFilesLoop(FormatType kind, std::shared_ptr<std::vector<std::wstring>> filenames, IWebDiffCallback* callback, int pane = 0)
+	// Some patches from the snapshot may have been applied before one could not
+	// be, so the highlights are removed before the page is read again. Otherwise
+	// the compare would read a mix of the old highlights and the new ones.
+	HRESULT recompareChangedPage(IWebDiffCallback* callback)
 	{
 		ComPtr<IWebDiffCallback> callback2(callback);
-		HRESULT hr = m_webWindow[pane].SaveFile((*filenames)[pane].c_str(), kind,
-			Callback<IWebDiffCallback>([this, kind, filenames, callback2, pane](const WebDiffCallbackResult& result) -> HRESULT
+		return unhighlightDifferencesLoop(
+			Callback<IWebDiffCallback>([this, callback2](const WebDiffCallbackResult& result) -> HRESULT
 				{
 					HRESULT hr = result.errorCode;
 					if (SUCCEEDED(hr))
-					{
-						if (pane + 1 < m_nPanes)
-							hr = saveFilesLoop(kind, filenames, callback2.Get(), pane + 1);
-						else if (callback2)
-							return callback2->Invoke({ hr, nullptr });
-					}
+						hr = compare(callback2.Get());
 					if (FAILED(hr) && callback2)
 						return callback2->Invoke({ hr, nullptr });
 					return S_OK;
 				}).Get());
-		return hr;
+	}
+
+	HRESULT saveFilesLoop(FormatType kind, std::shared_ptr<std::vector<std::wstring>> filenames, IWebDiffCallback* callback)
+	{
+		return forEachPane([this, kind, filenames](int pane, IWebDiffCallback* callback) -> HRESULT
+			{
+				return m_webWindow[pane].SaveFile((*filenames)[pane].c_str(), kind, callback);
+			}, callback);
 	}
 
 	HRESULT applyHTMLLoop(
@@ -838,43 +1036,52 @@ LR"(
 		return hr;
 	}
 
-	HRESULT applyDOMLoop(std::shared_ptr<std::vector<WDocument>> documents, IWebDiffCallback* callback, int pane = 0)
+	// With fromSnapshot, node ids are those of the snapshot and may be stale, so a
+	// node the script could not locate fails with E_CHANGED_STATE instead, even if
+	// earlier batches have been applied.
+	HRESULT applyPatchLoop(
+		int pane,
+		std::shared_ptr<std::vector<PatchBatch>> batches,
+		std::shared_ptr<std::list<ModifiedNode>> nodes,
+		IWebDiffCallback* callback,
+		size_t index,
+		bool fromSnapshot = false)
 	{
+		if (index == batches->size())
+			return applyHTMLLoop(pane, nodes, callback, nodes->rbegin());
 		ComPtr<IWebDiffCallback> callback2(callback);
-		auto nodes = std::make_shared<std::list<ModifiedNode>>();
-		Highlighter::modifiedNodesToHTMLs((*documents)[pane][L"root"], *nodes);
-		HRESULT hr = applyHTMLLoop(pane, nodes,
-			Callback<IWebDiffCallback>([this, documents, callback2, pane](const WebDiffCallbackResult& result) -> HRESULT
+		HRESULT hr = m_webWindow[pane].ExecuteScript((*batches)[index].script.c_str(),
+			Callback<IWebDiffCallback>([this, pane, batches, nodes, index, fromSnapshot, callback2](const WebDiffCallbackResult& result) -> HRESULT
 				{
-					HRESULT hr = result.errorCode;
-					if (SUCCEEDED(hr))
+					// Nodes the script could not locate or replace are applied with
+					// DOM.setOuterHTML. The script catches the errors of each node, so
+					// without a result it did not get to replace any of them, and it
+					// returns null if the page has changed since the document was read.
+					std::vector<ModifiedNode>& batchNodes = (*batches)[index].nodes;
+					WDocument doc;
+					if (SUCCEEDED(result.errorCode) && result.returnObjectAsJson)
+						doc.Parse(result.returnObjectAsJson);
+					if (fromSnapshot && (doc.HasParseError() || !doc.IsArray() || !doc.Empty()))
 					{
-						if (pane + 1 < m_nPanes)
-							hr = applyDOMLoop(documents, callback2.Get(), pane + 1);
-						else if (callback2)
-							return callback2->Invoke({ hr, nullptr });
+						if (callback2)
+							return callback2->Invoke({ E_CHANGED_STATE, nullptr });
+						return S_OK;
 					}
-					if (FAILED(hr) && callback2)
-						return callback2->Invoke({ hr, nullptr });
-					return hr;
-				}).Get(), nodes->rbegin());
-		return hr;
-	}
-
-	HRESULT setStyleSheetLoop(const std::wstring& styles, IWebDiffCallback* callback, int pane = 0)
-	{
-		ComPtr<IWebDiffCallback> callback2(callback);
-		HRESULT hr = m_webWindow[pane].SetStyleSheetInAllFrames(styles,
-			Callback<IWebDiffCallback>([this, pane, styles, callback2](const WebDiffCallbackResult& result) -> HRESULT
-				{
-					HRESULT hr = result.errorCode;
-					if (SUCCEEDED(hr))
+					if (!doc.HasParseError() && doc.IsArray())
 					{
-						if (pane + 1 < m_nPanes)
-							hr = setStyleSheetLoop(styles, callback2.Get(), pane + 1);
-						else if (callback2)
-							return callback2->Invoke({ hr, nullptr });
+						for (const auto& value : doc.GetArray())
+						{
+							if (value.IsUint() && value.GetUint() < batchNodes.size())
+								nodes->push_back(std::move(batchNodes[value.GetUint()]));
+						}
+					}
+					else
+					{
+						for (auto& node : batchNodes)
+							nodes->push_back(std::move(node));
 					}
+					batchNodes.clear();
+					HRESULT hr = applyPatchLoop(pane, batches, nodes, callback2.Get(), index + 1, fromSnapshot);
 					if (FAILED(hr) && callback2)
 						return callback2->Invoke({ hr, nullptr });
 					return S_OK;
@@ -882,15 +1089,42 @@ LR"(
 		return hr;
 	}
 
-	HRESULT highlightDocuments(std::shared_ptr<std::vector<WDocument>> documents, IWebDiffCallback* callback)
+	HRESULT applyModifiedNodes(int pane, const WValue& tree, const TextSegmentsReader& reader, IWebDiffCallback* callback)
+	{
+		auto nodes = std::make_shared<std::list<ModifiedNode>>();
+		Highlighter::modifiedNodesToHTMLs(tree, *nodes);
+		auto batches = std::make_shared<std::vector<PatchBatch>>(
+			Highlighter::makePatchBatches(*nodes, reader, PATCH_BATCH_SIZE));
+		return applyPatchLoop(pane, batches, nodes, callback, 0);
+	}
+
+	HRESULT applyDOMLoop(std::shared_ptr<CompareTask> task, IWebDiffCallback* callback)
+	{
+		return forEachPane([this, task](int pane, IWebDiffCallback* callback) -> HRESULT
+			{
+				PanePatch& patch = task->panes[pane];
+				return applyPatchLoop(pane, std::shared_ptr<std::vector<PatchBatch>>(task, &patch.batches),
+					std::shared_ptr<std::list<ModifiedNode>>(task, &patch.nodes), callback, 0, task->fromSnapshot);
+			}, callback);
+	}
+
+	HRESULT setStyleSheetLoop(const std::wstring& styles, IWebDiffCallback* callback)
+	{
+		return forEachPane([this, &styles](int pane, IWebDiffCallback* callback) -> HRESULT
+			{
+				return m_webWindow[pane].SetStyleSheetInAllFrames(styles, callback);
+			}, callback);
+	}
+
+	HRESULT highlightDocuments(std::shared_ptr<CompareTask> task, IWebDiffCallback* callback)
 	{
 		ComPtr<IWebDiffCallback> callback2(callback);
-		HRESULT hr = applyDOMLoop(documents,
-			Callback<IWebDiffCallback>([this, documents, callback2](const WebDiffCallbackResult& result) -> HRESULT
+		HRESULT hr = applyDOMLoop(task,
+			Callback<IWebDiffCallback>([this, task, callback2](const WebDiffCallbackResult& result) -> HRESULT
 				{
 					HRESULT hr = result.errorCode;
 					if (SUCCEEDED(hr))
-						hr = makeDiffNodeIdArrayLoop(callback2.Get());
+						hr = makeDiffNodeIdArrayLoop(task, callback2.Get());
 					if (FAILED(hr) && callback2)
 						return callback2->Invoke({ hr, nullptr });
 					return S_OK;
@@ -898,108 +1132,134 @@ LR"(
 		return hr;
 	}
 
-	HRESULT unhighlightDifferencesLoop(IWebDiffCallback* callback, int pane = 0)
+	HRESULT unhighlightDifferencesLoop(IWebDiffCallback* callback)
 	{
-		static const wchar_t* method = L"DOM.getDocument";
-		static const wchar_t* params = L"{ \"depth\": -1, \"pierce\": true }";
-		ComPtr<IWebDiffCallback> callback2(callback);
-		HRESULT hr = m_webWindow[pane].CallDevToolsProtocolMethod(method, params,
-			Callback<IWebDiffCallback>([this, pane, callback2](const WebDiffCallbackResult& result) -> HRESULT
-				{
-					HRESULT hr = result.errorCode;
-					if (SUCCEEDED(hr))
-					{
-						WDocument doc;
-						doc.Parse(result.returnObjectAsJson);
-						Highlighter::unhighlightNodes(doc[L"root"], doc.GetAllocator());
-						auto nodes = std::make_shared<std::list<ModifiedNode>>();
-						Highlighter::modifiedNodesToHTMLs(doc[L"root"], *nodes);
-						hr = applyHTMLLoop(pane, nodes,
-							Callback<IWebDiffCallback>([this, pane, callback2](const WebDiffCallbackResult& result) -> HRESULT
+		forgetSnapshot();
+		return forEachPane([this](int pane, IWebDiffCallback* callback) -> HRESULT
+			{
+				ComPtr<IWebDiffCallback> callback2(callback);
+				return getDocument(pane,
+					Callback<IWebDiffCallback>([this, pane, callback2](const WebDiffCallbackResult& result) -> HRESULT
+						{
+							HRESULT hr = result.errorCode;
+							if (SUCCEEDED(hr))
+							{
+								const std::wstring json = result.returnObjectAsJson;
+								TextSegments textSegments;
+								TextSegmentsReader reader;
+								if (reader.read(json.c_str(), textSegments))
 								{
-									HRESULT hr = result.errorCode;
-									if (SUCCEEDED(hr))
-									{
-										if (pane + 1 < m_nPanes)
-											hr = unhighlightDifferencesLoop(callback2.Get(), pane + 1);
-										else if (callback2)
-											return callback2->Invoke({ hr, nullptr });
-									}
-									if (FAILED(hr) && callback2)
-										return callback2->Invoke({ hr, nullptr });
-									return S_OK;
-								}).Get(), nodes->rbegin());
-					}
-					if (FAILED(hr) && callback2)
-						return callback2->Invoke({ hr, nullptr });
-					return S_OK;
-				}).Get());
-		return hr;
+									WDocument doc;
+									reader.materialize(json, {}, doc);
+									Highlighter::unhighlightNodes(doc[L"root"], doc.GetAllocator());
+									hr = applyModifiedNodes(pane, doc[L"root"], reader, callback2.Get());
+								}
+								else
+								{
+									hr = E_FAIL;
+								}
+							}
+							if (FAILED(hr))
+								return callback2->Invoke({ hr, nullptr });
+							return S_OK;
+						}).Get());
+			}, callback);
+	}
+
+	void setDiffNodeIds(int pane, std::map<int, int>& nodes)
+	{
+		for (unsigned i = 0; i < m_diffInfos.size(); ++i)
+		{
+			if (m_diffInfos[i].nodeIds[pane] != -1)
+				m_diffInfos[i].nodeIds[pane] = nodes[i];
+		}
 	}
 
-	HRESULT makeDiffNodeIdArrayLoop(IWebDiffCallback* callback, int pane = 0)
+	HRESULT makeDiffNodeIdArrayFromDocument(int pane, IWebDiffCallback* callback)
 	{
 		static const wchar_t* method = L"DOM.getDocument";
 		static const wchar_t* params = L"{ \"depth\": -1, \"pierce\": true }";
 		ComPtr<IWebDiffCallback> callback2(callback);
-		HRESULT hr = m_webWindow[pane].CallDevToolsProtocolMethod(method, params,
+		return m_webWindow[pane].CallDevToolsProtocolMethod(method, params,
 			Callback<IWebDiffCallback>([this, pane, callback2](const WebDiffCallbackResult& result) -> HRESULT
 				{
 					HRESULT hr = result.errorCode;
+					domutils::FlatDocument document;
+					if (SUCCEEDED(hr) && !document.parse(result.returnObjectAsJson))
+						hr = E_FAIL;
 					if (SUCCEEDED(hr))
 					{
-						WDocument doc;
-						doc.Parse(result.returnObjectAsJson);
-#ifdef _DEBUG
-						WStringBuffer buffer;
-						WPrettyWriter writer(buffer);
-						doc.Accept(writer);
-						WriteToTextFile((L"c:\\tmp\\file" + std::to_wstring(pane) + L"_2.json"),
-							buffer.GetString());
-#endif
-
 						std::map<int, int> nodes;
-						Highlighter::getDiffNodes(doc[L"root"], nodes);
-						for (unsigned i = 0; i < m_diffInfos.size(); ++i)
-						{
-							if (m_diffInfos[i].nodeIds[pane] != -1)
-								m_diffInfos[i].nodeIds[pane] = nodes[i];
-						}
-						if (pane < m_nPanes - 1)
-							hr = makeDiffNodeIdArrayLoop(callback2.Get(), pane + 1);
-						else if (callback2)
-							return callback2->Invoke({ hr, nullptr });
+						Highlighter::getDiffNodes(document, document.root(), nodes);
+						setDiffNodeIds(pane, nodes);
 					}
-					if (FAILED(hr) && callback2)
-						return callback2->Invoke({ hr, nullptr });
-					return S_OK;
+					return callback2->Invoke({ hr, nullptr });
 				}).Get());
-		return hr;
 	}
 
-	HRESULT scrollIntoViewIfNeededLoop(int diffIndex, IWebDiffCallback* callback, int pane = 0)
+	// Queries the highlighted elements of one document at a time. The page lists
+	// them in the order of diffIndexes unless a modified node could not be applied,
+	// in which case the whole document is read back instead.
+	HRESULT querySelectorAllLoop(
+		int pane,
+		std::shared_ptr<const std::vector<int>> documentNodeIds,
+		std::shared_ptr<const std::vector<std::vector<int>>> diffIndexes,
+		std::shared_ptr<std::map<int, int>> nodes,
+		IWebDiffCallback* callback,
+		size_t index)
 	{
+		while (index < diffIndexes->size() && (*diffIndexes)[index].empty())
+			++index;
+		if (index == diffIndexes->size())
+		{
+			setDiffNodeIds(pane, *nodes);
+			if (callback)
+				callback->Invoke({ S_OK, nullptr });
+			return S_OK;
+		}
 		ComPtr<IWebDiffCallback> callback2(callback);
-		std::wstring args = L"{ \"nodeId\": " + std::to_wstring(m_diffInfos[diffIndex].nodeIds[pane]) + L" }";
-		HRESULT hr = m_webWindow[pane].CallDevToolsProtocolMethod(L"DOM.scrollIntoViewIfNeeded", args.c_str(),
-			Callback<IWebDiffCallback>([this, diffIndex, pane, callback2](const WebDiffCallbackResult& result) -> HRESULT
+		std::wstring params = L"{ \"nodeId\": " + std::to_wstring((*documentNodeIds)[index]) + L", \"selector\": \"[data-wwdid]\" }";
+		HRESULT hr = m_webWindow[pane].CallDevToolsProtocolMethod(L"DOM.querySelectorAll", params.c_str(),
+			Callback<IWebDiffCallback>([this, pane, documentNodeIds, diffIndexes, nodes, index, callback2](const WebDiffCallbackResult& result) -> HRESULT
 				{
-					HRESULT hr = S_OK; // result.errorCode;
-					m_webWindow[pane].ShowToolTip(FAILED(result.errorCode), 5000);
-					if (SUCCEEDED(hr))
-					{
-						if (pane + 1 < m_nPanes)
-							hr = scrollIntoViewIfNeededLoop(diffIndex, callback2.Get(), pane + 1);
-						else if (callback2)
-							return callback2->Invoke({ hr, nullptr });
-					}
+					HRESULT hr;
+					if (Highlighter::getQueriedDiffNodes(result.errorCode, result.returnObjectAsJson, (*diffIndexes)[index], *nodes))
+						hr = querySelectorAllLoop(pane, documentNodeIds, diffIndexes, nodes, callback2.Get(), index + 1);
+					else
+						hr = makeDiffNodeIdArrayFromDocument(pane, callback2.Get());
 					if (FAILED(hr) && callback2)
-						return callback2->Invoke(result);
+						return callback2->Invoke({ hr, nullptr });
 					return S_OK;
-				}).Get());
+				}).Get(), false);
 		return hr;
 	}
 
+	HRESULT makeDiffNodeIdArrayLoop(std::shared_ptr<const CompareTask> task, IWebDiffCallback* callback)
+	{
+		return forEachPane([this, task](int pane, IWebDiffCallback* callback) -> HRESULT
+			{
+				const PanePatch& patch = task->panes[pane];
+				return querySelectorAllLoop(pane, std::shared_ptr<const std::vector<int>>(task, &patch.documentNodeIds),
+					std::shared_ptr<const std::vector<std::vector<int>>>(task, &patch.diffIndexes),
+					std::make_shared<std::map<int, int>>(), callback, 0);
+			}, callback);
+	}
+
+	HRESULT scrollIntoViewIfNeededLoop(int diffIndex, IWebDiffCallback* callback)
+	{
+		return forEachPane([this, diffIndex](int pane, IWebDiffCallback* callback) -> HRESULT
+			{
+				ComPtr<IWebDiffCallback> callback2(callback);
+				std::wstring args = L"{ \"nodeId\": " + std::to_wstring(m_diffInfos[diffIndex].nodeIds[pane]) + L" }";
+				return m_webWindow[pane].CallDevToolsProtocolMethod(L"DOM.scrollIntoViewIfNeeded", args.c_str(),
+					Callback<IWebDiffCallback>([this, pane, callback2](const WebDiffCallbackResult& result) -> HRESULT
+						{
+							m_webWindow[pane].ShowToolTip(FAILED(result.errorCode), 5000);
+							return callback2->Invoke({ S_OK /* result.errorCode */, nullptr });
+						}).Get());
+			}, callback);
+	}
+
 	HRESULT selectDiff(int diffIndex, IWebDiffCallback* callback)
 	{
 		if (diffIndex < 0 || diffIndex >= m_diffInfos.size())
@@ -1069,7 +1329,9 @@ LR"(
 			script = L"document.execCommand(\"" + cmd + L"\")";
 		else
 		{
-			std::wstring text = utils::Quote(getFromClipboard());
+			std::wstring clipboard = getFromClipboard();
+			clipboard.erase(std::remove(clipboard.begin(), clipboard.end(), L'\r'), clipboard.end());
+			std::wstring text = utils::Quote(clipboard);
 			script = L"document.execCommand(\"insertText\", false, " + text + L")";
 		}
 		return SUCCEEDED(m_webWindow[pane].ExecuteScript(script.c_str(), nullptr));
@@ -1261,6 +1523,9 @@ LR"(
 		case WM_MOUSEMOVE:
 			OnMouseMove((UINT)(wParam), (int)(short)LOWORD(lParam), (int)(short)HIWORD(lParam));
 			break;
+		case WM_COMPARE_COMPLETED:
+			completeCompare(reinterpret_cast<const CompareTask*>(lParam), S_OK);
+			break;
 		case WM_SETCURSOR:
 			if ((HWND)wParam == m_hWnd)
 			{
@@ -1325,7 +1590,14 @@ LR"(
 	std::vector<ComPtr<IWebDiffEventHandler>> m_listeners;
 	int m_currentDiffIndex = -1;
 	std::vector<DiffInfo> m_diffInfos;
+	std::list<PendingCompare> m_pendingCompares;
+	std::list<std::future<void>> m_runningCompares;
+	std::shared_ptr<CompareCache> m_compareCache = std::make_shared<CompareCache>();
+	std::shared_ptr<const DocumentSnapshot> m_snapshot;
+	std::vector<std::unordered_map<int, AppliedNode>> m_appliedNodes;
+	unsigned m_snapshotGeneration = 0;
 	DiffOptions m_diffOptions{};
+	DiffLimits m_diffLimits;
 	bool m_bShowDifferences = true;
 	bool m_bShowWordDifferences = true;
 	IWebDiffWindow::ColorSettings m_colorSettings = {
@@ -4,10 +4,12 @@
 #undef min
 #include <string>
 #include <vector>
+#include <map>
 #include <filesystem>
 #include <memory>
 #include <cassert>
 #include <functional>
+#include <algorithm>
 #include <WebView2.h>
 #include <WebView2EnvironmentOptions.h>
 #include <CommCtrl.h>
@@ -116,6 +118,7 @@ class CWebWindow
 						Callback<ICoreWebView2NavigationStartingEventHandler>(
 							[this](ICoreWebView2* sender, ICoreWebView2NavigationStartingEventArgs* args) -> HRESULT {
 								m_navigationCompleted = false;
+								InvalidateStyleSheets();
 								return m_parent->OnNavigationStarting(sender, args);
 							}).Get(), nullptr);
 
@@ -184,6 +187,7 @@ class CWebWindow
 									auto webviewFrame2 = webviewFrame.try_query<ICoreWebView2Frame2>();
 
 									m_frames.emplace_back(webviewFrame);
+									InvalidateStyleSheets();
 
 									if (webviewFrame2)
 									{
@@ -193,6 +197,13 @@ class CWebWindow
 												{
 													return m_parent->OnFrameWebMessageReceived(sender, args);
 												}).Get(), nullptr);
+										webviewFrame2->add_NavigationStarting(
+											Callback<ICoreWebView2FrameNavigationStartingEventHandler>(
+												[this](ICoreWebView2Frame* sender, ICoreWebView2NavigationStartingEventArgs* args) -> HRESULT
+												{
+													InvalidateStyleSheets();
+													return S_OK;
+												}).Get(), nullptr);
 									}
 
 									webviewFrame->add_Destroyed(
@@ -205,6 +216,7 @@ class CWebWindow
 												{
 													m_frames.erase(frame);
 												}
+												InvalidateStyleSheets();
 												return S_OK;
 											}).Get(), nullptr);
 									return S_OK;
@@ -232,10 +244,18 @@ class CWebWindow
 			return SUCCEEDED(hr);
 		}
 
+		void InvalidateStyleSheets()
+		{
+			m_frameIds.clear();
+			m_styleSheetIds.clear();
+		}
+
 	private:
 		wil::com_ptr<ICoreWebView2Controller> m_webviewController;
 		wil::com_ptr<ICoreWebView2> m_webview;
 		std::vector<wil::com_ptr<ICoreWebView2Frame>> m_frames;
+		std::vector<std::wstring> m_frameIds;
+		std::map<std::wstring, std::wstring> m_styleSheetIds; // frameId -> styleSheetId
 		CWebWindow* m_parent;
 		bool m_navigationCompleted = false;
 	};
@@ -607,13 +627,14 @@ public:
 		return hr;
 	}
 
-	HRESULT SaveText(FILE *fp, const WValue& value, size_t& textLength)
+	HRESULT SaveText(FILE *fp, const domutils::FlatDocument& document, uint32_t index, size_t& textLength)
 	{
-		const int nodeType = value[L"nodeType"].GetInt();
+		const domutils::FlatDocument::Node& node = document[index];
+		const int nodeType = node.nodeType;
 
 		if (nodeType == 3 /* TEXT_NODE */)
 		{
-			std::wstring text = value[L"nodeValue"].GetString();
+			std::wstring text = document.nodeValue(index);
 			text =
 				((text.length() > 0 && iswspace(text.front())) ? L" " : L"") + 
 				utils::trim_ws(text) +
@@ -624,13 +645,12 @@ public:
 		}
 		else if (nodeType == 1 /* ELEMENT_NODE */)
 		{
-			const wchar_t* nodeName = value[L"nodeName"].GetString();
-			if (wcscmp(nodeName, L"INPUT") == 0)
+			if (node.tag == htmltags::TAG_INPUT)
 			{
-				const wchar_t* type = domutils::getAttribute(value, L"type");
+				const wchar_t* type = document.getAttribute(index, L"type");
 				if (!type || wcscmp(type, L"hidden") != 0)
 				{
-					const wchar_t *inputValue = domutils::getAttribute(value, L"value");
+					const wchar_t *inputValue = document.getAttribute(index, L"value");
 					if (inputValue)
 					{
 						std::wstring text = inputValue;
@@ -645,31 +665,30 @@ public:
 				}
 			}
 		}
-		if (value.HasMember(L"children") && value[L"children"].IsArray())
+		if (node.hasChildren)
 		{
-			const auto* nodeName = value[L"nodeName"].GetString();
-			const bool fInline = utils::IsInlineElement(nodeName);
-			if (wcscmp(nodeName, L"SCRIPT") != 0 && wcscmp(nodeName, L"STYLE") != 0)
+			if (node.tag != htmltags::TAG_SCRIPT && node.tag != htmltags::TAG_STYLE)
 			{
 				if (nodeType == 1)
 				{
-					if ((!fInline && textLength > 0) || wcscmp(nodeName, L"BR") == 0 || wcscmp(nodeName, L"HR") == 0)
+					const bool fInline = htmltags::hasProperty(node.tag, htmltags::INLINE_ELEMENT);
+					if ((!fInline && textLength > 0) || node.tag == htmltags::TAG_BR || node.tag == htmltags::TAG_HR)
 					{
 						fwprintf(fp, L"\n");
 						textLength = 0;
 					}
 				}
-				for (const auto& child : value[L"children"].GetArray())
+				for (uint32_t child = node.firstChild; child != domutils::FlatDocument::npos; child = document[child].nextSibling)
 				{
-					HRESULT hr = SaveText(fp, child, textLength);
+					HRESULT hr = SaveText(fp, document, child, textLength);
 					if (FAILED(hr))
 						return hr;
 				}
 			}
 		}
-		if (value.HasMember(L"contentDocument"))
+		if (node.contentDocument != domutils::FlatDocument::npos)
 		{
-			HRESULT hr = SaveText(fp, value[L"contentDocument"], textLength);
+			HRESULT hr = SaveText(fp, document, node.contentDocument, textLength);
 			if (FAILED(hr))
 				return hr;
 		}
@@ -686,14 +705,15 @@ public:
 			Callback<IWebDiffCallback>(
 				[this, filename, callback2](const WebDiffCallbackResult& result) -> HRESULT {
 					HRESULT hr = result.errorCode;
+					domutils::FlatDocument document;
+					if (SUCCEEDED(hr) && !document.parse(result.returnObjectAsJson))
+						hr = E_FAIL;
 					if (SUCCEEDED(hr))
 					{
-						WDocument document;
-						document.Parse(result.returnObjectAsJson);
 						wil::unique_file fp;
 						_wfopen_s(&fp, filename.c_str(), L"at,ccs=UTF-8");
 						size_t textLength = 0;
-						hr = SaveText(fp.get(), document[L"root"], textLength);
+						hr = SaveText(fp.get(), document, document.root(), textLength);
 					}
 					if (callback2)
 						return callback2->Invoke({ hr, nullptr });
@@ -992,9 +1012,10 @@ public:
 		HRESULT hr = GetActiveWebView()->CallDevToolsProtocolMethod(methodName, params,
 			Callback<ICoreWebView2CallDevToolsProtocolMethodCompletedHandler>(
 				[this, callback2, msg](HRESULT errorCode, LPCWSTR returnObjectAsJson) -> HRESULT {
-					if (FAILED(errorCode))
+					// msg is null when the caller handles the failure itself
+					if (FAILED(errorCode) && msg)
 					{
-						SetToolTipText(*msg + returnObjectAsJson);
+						SetToolTipText(*msg + (returnObjectAsJson ? returnObjectAsJson : L""));
 						ShowToolTip(true, TOOLTIP_TIMEOUT);
 					}
 					if (callback2)
@@ -1079,7 +1100,7 @@ public:
 		return hr;
 	}
 
-	HRESULT setStyleSheetText(const std::wstring& styleSheetId, const std::wstring& styles, IWebDiffCallback* callback)
+	HRESULT setStyleSheetText(const std::wstring& styleSheetId, const std::wstring& styles, IWebDiffCallback* callback, bool showError = true)
 	{
 		static const wchar_t* method = L"CSS.setStyleSheetText";
 		std::wstring params = L"{ \"styleSheetId\": \"" + styleSheetId + L"\", "
@@ -1092,17 +1113,21 @@ public:
 					if (callback2)
 						return callback2->Invoke({ hr, nullptr });
 					return S_OK;
-				}).Get());
+				}).Get(), showError);
 		return hr;
 	}
 
-	HRESULT setFrameStyleSheet(const std::wstring& frameId, const std::wstring& styles, IWebDiffCallback* callback)
+	HRESULT createFrameStyleSheet(const std::wstring& frameId, const std::wstring& styles, IWebDiffCallback* callback)
 	{
 		static const wchar_t* method = L"CSS.createStyleSheet";
 		std::wstring params = L"{ \"frameId\": \"" + frameId + L"\" }";
+		if (!GetActiveTab())
+			return E_FAIL;
+		// Cached on the tab the call goes to, even if another one is active when it completes
+		CWebTab* tab = GetActiveTab();
 		ComPtr<IWebDiffCallback> callback2(callback);
 		HRESULT hr = CallDevToolsProtocolMethod(method, params.c_str(),
-			Callback<IWebDiffCallback>([this, styles, callback2](const WebDiffCallbackResult& result) -> HRESULT
+			Callback<IWebDiffCallback>([this, tab, frameId, styles, callback2](const WebDiffCallbackResult& result) -> HRESULT
 				{
 					HRESULT hr = result.errorCode;
 					if (SUCCEEDED(hr))
@@ -1110,6 +1135,8 @@ public:
 						WDocument document;
 						document.Parse(result.returnObjectAsJson);
 						std::wstring styleSheetId = document[L"styleSheetId"].GetString();
+						if (IsOpenTab(tab))
+							tab->m_styleSheetIds[frameId] = styleSheetId;
 						hr = setStyleSheetText(styleSheetId, styles, callback2.Get());
 					}
 					if (FAILED(hr) && callback2)
@@ -1119,6 +1146,36 @@ public:
 		return hr;
 	}
 
+	HRESULT setFrameStyleSheet(const std::wstring& frameId, const std::wstring& styles, IWebDiffCallback* callback)
+	{
+		if (!GetActiveTab())
+			return E_FAIL;
+		CWebTab* tab = GetActiveTab();
+		auto it = tab->m_styleSheetIds.find(frameId);
+		if (it == tab->m_styleSheetIds.end())
+			return createFrameStyleSheet(frameId, styles, callback);
+		ComPtr<IWebDiffCallback> callback2(callback);
+		HRESULT hr = setStyleSheetText(it->second, styles,
+			Callback<IWebDiffCallback>([this, tab, frameId, styles, callback2](const WebDiffCallbackResult& result) -> HRESULT
+				{
+					HRESULT hr = result.errorCode;
+					if (FAILED(hr))
+					{
+						// The cached stylesheet went away with the frame's document
+						if (IsOpenTab(tab))
+							tab->m_styleSheetIds.erase(frameId);
+						hr = createFrameStyleSheet(frameId, styles, callback2.Get());
+						if (FAILED(hr) && callback2)
+							return callback2->Invoke({ hr, nullptr });
+						return S_OK;
+					}
+					if (callback2)
+						return callback2->Invoke({ hr, nullptr });
+					return S_OK;
+				}).Get(), false);
+		return hr;
+	}
+
 	HRESULT setFrameStyleSheetLoop(
 		std::shared_ptr<std::vector<std::wstring>> frameIdList,
 		std::shared_ptr<const std::wstring> styles,
@@ -1152,14 +1209,24 @@ public:
 		return hr;
 	}
 
+	// Stylesheets are created once per frame and then only have their text
+	// replaced, until the tab navigates or a frame is created or destroyed.
 	HRESULT SetStyleSheetInAllFrames(const std::wstring& styles, IWebDiffCallback* callback)
 	{
 		static const wchar_t* method = L"Page.getFrameTree";
 		static const wchar_t* params = L"{}";
+		if (!GetActiveTab())
+			return E_FAIL;
 		ComPtr<IWebDiffCallback> callback2(callback);
 		auto styles2 = std::make_shared<std::wstring>(styles);
+		CWebTab* tab = GetActiveTab();
+		if (!tab->m_frameIds.empty())
+		{
+			std::shared_ptr<std::vector<std::wstring>> frameIdList(new std::vector<std::wstring>(tab->m_frameIds));
+			return setFrameStyleSheetLoop(frameIdList, styles2, callback2.Get(), frameIdList->begin());
+		}
 		HRESULT hr = CallDevToolsProtocolMethod(method, params,
-			Callback<IWebDiffCallback>([this, styles2, callback2](const WebDiffCallbackResult& result) -> HRESULT
+			Callback<IWebDiffCallback>([this, tab, styles2, callback2](const WebDiffCallbackResult& result) -> HRESULT
 				{
 					HRESULT hr = result.errorCode;
 					if (SUCCEEDED(hr))
@@ -1168,6 +1235,8 @@ public:
 						document.Parse(result.returnObjectAsJson);
 						std::shared_ptr<std::vector<std::wstring>> frameIdList(new std::vector<std::wstring>());
 						domutils::getFrameIdList(document[L"frameTree"], *frameIdList);
+						if (IsOpenTab(tab))
+							tab->m_frameIds = *frameIdList;
 						hr = setFrameStyleSheetLoop(frameIdList, styles2,
 							callback2.Get(), frameIdList->begin());
 					}
@@ -1299,6 +1368,13 @@ private:
 		return m_tabs[m_activeTab].get();
 	}
 
+	// Whether a tab captured by a completion handler has not been closed since
+	bool IsOpenTab(const CWebTab* tab) const
+	{
+		return std::any_of(m_tabs.begin(), m_tabs.end(),
+			[tab](const std::unique_ptr<CWebTab>& openTab) { return openTab.get() == tab; });
+	}
+
 	HRESULT CloseTab(int tab)
 	{
 		int ntabs = static_cast<int>(m_tabs.size());
@@ -169,6 +169,10 @@ struct IWebDiffWindow
 	virtual bool CanRedo() = 0;
 	virtual const DiffOptions& GetDiffOptions() const = 0;
 	virtual void SetDiffOptions(const DiffOptions& diffOptions) = 0;
+	virtual int  GetDiffTimeLimit() const = 0; /**< Diff time limit in milliseconds, 0 for no limit */
+	virtual void SetDiffTimeLimit(int timeLimit) = 0;
+	virtual int  GetDiffCostLimit() const = 0; /**< Edit cost searched per Myers split, 0 for the default */
+	virtual void SetDiffCostLimit(int costLimit) = 0;
 };
 
 extern "C"
@@ -2,6 +2,12 @@
 #include "CppUnitTest.h"
 #define NOMINMAX
 #include <Windows.h>
+#include <chrono>
+#include <cstdarg>
+#include <set>
+#include <functional>
+#include <future>
+#include <stdexcept>
 #include "../WinWebDiffLib/DiffHighlighter.hpp"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
@@ -239,7 +245,6 @@ const wchar_t* json2 = LR"(
 	TEST_CLASS(WinWebDiffTest)
 	{
 	public:
-		
 		TEST_METHOD(TestMethod1)
 		{
             std::vector<WDocument> documents(2);
@@ -260,9 +265,9 @@ const wchar_t* json2 = LR"(
 		{
 			std::vector<TextSegments> textSegments(2);
             textSegments[0].allText = L"abc";
-            textSegments[0].segments.insert_or_assign(0, TextSegment{0, 0, 0, 3});
+            textSegments[0].segments.push_back(TextSegment{0, 0, 0, 3});
             textSegments[1].allText = L"abc ";
-            textSegments[1].segments.insert_or_assign(0, TextSegment{0, 0, 0, 4});
+            textSegments[1].segments.push_back(TextSegment{0, 0, 0, 4});
 
             IWebDiffWindow::DiffOptions diffOptions1{};
 			std::vector<DiffInfo> diffInfos1 = Comparer::compare(diffOptions1, textSegments);
@@ -313,5 +318,1835 @@ const wchar_t* json2 = LR"(
 			std::vector<DiffInfo> diffInfos3 = Comparer::compare(diffOptions3, textSegments);
             Assert::AreEqual((size_t)0, diffInfos3.size());
 		}
+
+		TEST_METHOD(TestMethod5)
+		{
+			TextSegments textSegments;
+			textSegments.Make(L"ab cd\nef", false);
+			const TextSegmentTable& segments = textSegments.segments;
+			Assert::AreEqual((size_t)5, segments.size());
+			Assert::AreEqual((size_t)0, segments.indexOf(0));
+			Assert::AreEqual((size_t)1, segments.indexOf(2));
+			Assert::AreEqual((size_t)2, segments.indexOf(3));
+			Assert::AreEqual(TextSegmentTable::npos, segments.indexOf(1));
+			Assert::AreEqual(TextSegmentTable::npos, segments.indexOf(100));
+			Assert::AreEqual((size_t)3, segments.offset(2));
+			Assert::AreEqual((size_t)2, segments.length(2));
+		}
+
+		static std::wstring makeDocumentJson(int textNodeCount, const wchar_t* text)
+		{
+			std::wstring json = L"{ \"root\": { \"nodeId\": 1, \"nodeType\": 9, \"nodeName\": \"#document\", \"nodeValue\": \"\", \"children\": [ "
+				L"{ \"nodeId\": 2, \"nodeType\": 1, \"nodeName\": \"BODY\", \"nodeValue\": \"\", \"attributes\": [], \"children\": [ ";
+			for (int i = 0; i < textNodeCount; ++i)
+			{
+				if (i > 0)
+					json += L", ";
+				json += L"{ \"nodeId\": " + std::to_wstring(i + 3) + L", \"nodeType\": 3, \"nodeName\": \"#text\", \"nodeValue\": \"";
+				json += text;
+				json += L"\" }";
+			}
+			json += L" ] } ] } }";
+			return json;
+		}
+
+		static std::wstring makeText(size_t words, unsigned seed)
+		{
+			std::wstring text;
+			unsigned state = 12345;
+			for (size_t i = 0; i < words; ++i)
+			{
+				state = state * 1103515245 + 12345;
+				unsigned word = (state >> 16) % 1000;
+				if ((state >> 8) % 50 == 0)
+					word += seed * 1000;
+				text += L"w" + std::to_wstring(word) + ((i % 12 == 11) ? L".\n" : L" ");
+			}
+			return text;
+		}
+
+		static void assertSameDiffInfos(const std::vector<DiffInfo>& expected, const std::vector<DiffInfo>& actual, int nPanes)
+		{
+			Assert::AreEqual(expected.size(), actual.size());
+			for (size_t i = 0; i < expected.size(); ++i)
+			{
+				for (int pane = 0; pane < nPanes; ++pane)
+				{
+					Assert::AreEqual(expected[i].begin[pane], actual[i].begin[pane]);
+					Assert::AreEqual(expected[i].end[pane], actual[i].end[pane]);
+				}
+				Assert::AreEqual(static_cast<int>(expected[i].op), static_cast<int>(actual[i].op));
+			}
+		}
+
+		TEST_METHOD(TestCompareCache)
+		{
+			for (bool ignoreCase : { false, true })
+			{
+				IWebDiffWindow::DiffOptions diffOptions{};
+				diffOptions.ignoreCase = ignoreCase;
+				std::vector<TextSegments> textSegments(3);
+				for (unsigned pane = 0; pane < 3; ++pane)
+					textSegments[pane].Make(makeText(20000, pane), false);
+				CompareCache cache;
+				assertSameDiffInfos(Comparer::compare(diffOptions, textSegments),
+					Comparer::compare(diffOptions, textSegments, nullptr, nullptr, nullptr, &cache), 3);
+				Assert::AreEqual(static_cast<size_t>(0), cache.hitCount());
+
+				// Nothing changed: every pane and both pairs are reused
+				assertSameDiffInfos(Comparer::compare(diffOptions, textSegments),
+					Comparer::compare(diffOptions, textSegments, &ThreadPool::instance(), nullptr, nullptr, &cache), 3);
+				Assert::AreEqual(static_cast<size_t>(3 + 2), cache.hitCount());
+
+				// Pane 0 reloaded: only diff10 is redone
+				textSegments[0] = TextSegments();
+				textSegments[0].Make(makeText(20000, 7), false);
+				assertSameDiffInfos(Comparer::compare(diffOptions, textSegments),
+					Comparer::compare(diffOptions, textSegments, nullptr, nullptr, nullptr, &cache), 3);
+				Assert::AreEqual(static_cast<size_t>(5 + 3), cache.hitCount());
+
+				// Other options make other keys
+				IWebDiffWindow::DiffOptions diffOptions2 = diffOptions;
+				diffOptions2.diffAlgorithm = IWebDiffWindow::DiffOptions::HISTOGRAM_DIFF;
+				diffOptions2.ignoreNumbers = true;
+				assertSameDiffInfos(Comparer::compare(diffOptions2, textSegments),
+					Comparer::compare(diffOptions2, textSegments, nullptr, nullptr, nullptr, &cache), 3);
+				Assert::AreEqual(static_cast<size_t>(5 + 3), cache.hitCount());
+			}
+		}
+
+		TEST_METHOD(TestParallelWordDiffHighlight)
+		{
+			std::wstring htmls[2];
+			for (int run = 0; run < 2; ++run)
+			{
+				std::vector<WDocument> documents(2);
+				documents[0].Parse(makeDocumentJson(200, L"abc def ghi").c_str());
+				documents[1].Parse(makeDocumentJson(200, L"abc xyz ghi jkl").c_str());
+				std::vector<TextSegments> textSegments(2);
+				textSegments[0].Make(documents[0][L"root"]);
+				textSegments[1].Make(documents[1][L"root"]);
+				IWebDiffWindow::DiffOptions diffOptions{};
+				IWebDiffWindow::ColorSettings colorSettings{};
+				std::vector<DiffInfo> diffInfos = Comparer::compare(diffOptions, textSegments);
+				Comparer::setNodeIdInDiffInfoList(diffInfos, textSegments);
+				Highlighter highlighter(documents, diffInfos, colorSettings, diffOptions, true, 0,
+					run == 0 ? nullptr : &ThreadPool::instance());
+				highlighter.highlightNodes();
+				for (auto& document : documents)
+				{
+					std::list<ModifiedNode> nodes;
+					htmls[run] += Highlighter::modifiedNodesToHTMLs(document[L"root"], nodes);
+				}
+			}
+			Assert::IsTrue(htmls[0].find(L"wwd-wordchanged") != std::wstring::npos);
+			Assert::IsTrue(htmls[0] == htmls[1]);
+		}
+
+		TEST_METHOD(TestTokenTable)
+		{
+			std::vector<TextSegments> textSegments(3);
+			textSegments[0].Make(L"Abc 12", true);
+			textSegments[1].Make(L"abc  34", true);
+			textSegments[2].Make(L"abcd", true);
+			IWebDiffWindow::DiffOptions diffOptions{};
+			diffOptions.ignoreCase = true;
+			diffOptions.ignoreWhitespace = 1;
+			diffOptions.ignoreNumbers = true;
+			TokenTable tokenTable(textSegments, diffOptions);
+			Assert::AreEqual((size_t)4, tokenTable.symbolCount());
+			Assert::AreEqual(tokenTable.ids(0)[0], tokenTable.ids(1)[0]);
+			Assert::AreEqual(tokenTable.ids(0)[1], tokenTable.ids(1)[1]);
+			Assert::AreEqual(tokenTable.ids(0)[2], tokenTable.ids(1)[2]);
+			Assert::AreNotEqual(tokenTable.ids(0)[0], tokenTable.ids(2)[0]);
+			Assert::IsTrue(tokenTable.token(0, 0) == L"abc");
+			Assert::IsTrue(tokenTable.token(1, 1) == L" ");
+			Assert::IsTrue(tokenTable.token(1, 2).empty());
+			Assert::IsTrue(tokenTable.token(2, 0) == L"abcd");
+
+			std::vector<DiffInfo> diffInfos = Comparer::compare(diffOptions, textSegments);
+			Assert::AreEqual((size_t)3, diffInfos.size());
+			for (const auto& diffInfo : diffInfos)
+				Assert::AreEqual(static_cast<int>(OP_3RDONLY), static_cast<int>(diffInfo.op));
+		}
+
+		// Members are sorted by name as in DOM.getDocument results, so children precede nodeName.
+		static std::wstring makeReaderTestJson(const std::wstring& text)
+		{
+			return LR"({"root":{"children":[{"children":[{"children":[{"children":[{"nodeId":5,"nodeName":"#text","nodeType":3,"nodeValue":"Title"}],"nodeId":4,"nodeName":"TITLE","nodeType":1,"nodeValue":""}],"nodeId":3,"nodeName":"HEAD","nodeType":1,"nodeValue":""},)"
+				LR"({"attributes":[],"children":[{"nodeId":7,"nodeName":"#text","nodeType":3,"nodeValue":")" + text + LR"( "},)"
+				LR"({"children":[{"nodeId":9,"nodeName":"#text","nodeType":3,"nodeValue":"var x;"}],"nodeId":8,"nodeName":"SCRIPT","nodeType":1,"nodeValue":""},)"
+				LR"({"attributes":["class","wwd-diff wwd-changed","data-wwdid","0","data-wwdtext","def"],"children":[{"nodeId":11,"nodeName":"#text","nodeType":3,"nodeValue":"def"}],"nodeId":10,"nodeName":"SPAN","nodeType":1,"nodeValue":""},)"
+				LR"({"attributes":["type","text","value","ghi","class","wwd-diff wwd-changed","data-wwdid","1"],"nodeId":12,"nodeName":"INPUT","nodeType":1,"nodeValue":""},)"
+				LR"({"attributes":["type","hidden","value","zzz"],"nodeId":13,"nodeName":"INPUT","nodeType":1,"nodeValue":""},)"
+				LR"({"attributes":[],"children":[],"contentDocument":{"children":[{"nodeId":16,"nodeName":"#text","nodeType":3,"nodeValue":"jkl )" + text + LR"("}],"nodeId":15,"nodeName":"#document","nodeType":9,"nodeValue":""},"nodeId":14,"nodeName":"IFRAME","nodeType":1,"nodeValue":""}],)"
+				LR"("nodeId":6,"nodeName":"BODY","nodeType":1,"nodeValue":""}],"nodeId":2,"nodeName":"HTML","nodeType":1,"nodeValue":""}],"nodeId":1,"nodeName":"#document","nodeType":9,"nodeValue":""}})";
+		}
+
+		TEST_METHOD(TestTextSegmentsReader)
+		{
+			const std::wstring jsons[2] = { makeReaderTestJson(L"abc"), makeReaderTestJson(L"xyz") };
+			std::vector<WDocument> documents(2), sparseDocuments(2);
+			std::vector<TextSegments> expected(2), actual(2);
+			std::vector<TextSegmentsReader> readers(2);
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				documents[pane].Parse(jsons[pane].c_str());
+				Highlighter::unhighlightNodes(documents[pane][L"root"], documents[pane].GetAllocator());
+				expected[pane].Make(documents[pane][L"root"]);
+				Assert::IsTrue(readers[pane].read(jsons[pane].c_str(), actual[pane]));
+				Assert::AreEqual(expected[pane].allText, actual[pane].allText);
+				Assert::AreEqual(expected[pane].segments.size(), actual[pane].segments.size());
+				for (size_t i = 0; i < expected[pane].segments.size(); ++i)
+				{
+					Assert::AreEqual(expected[pane].segments.offset(i), actual[pane].segments.offset(i));
+					Assert::AreEqual(expected[pane].segments.nodeId(i), actual[pane].segments.nodeId(i));
+					Assert::AreEqual(expected[pane].segments.nodeType(i), actual[pane].segments.nodeType(i));
+				}
+			}
+			Assert::AreEqual(std::wstring(L"abc defghijkl abc"), actual[0].allText);
+
+			IWebDiffWindow::DiffOptions diffOptions{};
+			IWebDiffWindow::ColorSettings colorSettings{};
+			std::vector<DiffInfo> diffInfos = Comparer::compare(diffOptions, actual);
+			Comparer::setNodeIdInDiffInfoList(diffInfos, actual);
+			Assert::AreEqual((size_t)2, diffInfos.size());
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				std::unordered_set<int> nodeIds;
+				for (const auto& diffInfo : diffInfos)
+					nodeIds.insert(diffInfo.nodeIds[pane]);
+				readers[pane].materialize(jsons[pane], nodeIds, sparseDocuments[pane]);
+				Highlighter::unhighlightNodes(sparseDocuments[pane][L"root"], sparseDocuments[pane].GetAllocator());
+			}
+			std::vector<DiffInfo> diffInfos2 = diffInfos;
+			Highlighter(documents, diffInfos, colorSettings, diffOptions, true, 0).highlightNodes();
+			Highlighter(sparseDocuments, diffInfos2, colorSettings, diffOptions, true, 0).highlightNodes();
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				std::list<ModifiedNode> nodes, sparseNodes;
+				Highlighter::modifiedNodesToHTMLs(documents[pane][L"root"], nodes);
+				Highlighter::modifiedNodesToHTMLs(sparseDocuments[pane][L"root"], sparseNodes);
+				Assert::AreEqual(nodes.size(), sparseNodes.size());
+				for (auto it = nodes.begin(), it2 = sparseNodes.begin(); it != nodes.end(); ++it, ++it2)
+				{
+					Assert::AreEqual(it->nodeId, it2->nodeId);
+					Assert::AreEqual(it->outerHTML, it2->outerHTML);
+				}
+			}
+		}
+
+		TEST_METHOD(TestCompareTask)
+		{
+			const std::wstring jsons[2] = { makeReaderTestJson(L"abc"), makeReaderTestJson(L"xyz") };
+			IWebDiffWindow::DiffOptions diffOptions{};
+			IWebDiffWindow::ColorSettings colorSettings{};
+
+			// The same steps on the calling thread
+			std::vector<TextSegments> textSegments(2);
+			std::vector<TextSegmentsReader> readers(2);
+			std::vector<WDocument> documents(2);
+			for (int pane = 0; pane < 2; ++pane)
+				Assert::IsTrue(readers[pane].read(jsons[pane].c_str(), textSegments[pane]));
+			std::vector<DiffInfo> diffInfos = Comparer::compare(diffOptions, textSegments);
+			Comparer::setNodeIdInDiffInfoList(diffInfos, textSegments);
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				std::unordered_set<int> nodeIds;
+				for (const auto& diffInfo : diffInfos)
+					nodeIds.insert(diffInfo.nodeIds[pane]);
+				readers[pane].materialize(jsons[pane], nodeIds, documents[pane]);
+				Highlighter::unhighlightNodes(documents[pane][L"root"], documents[pane].GetAllocator());
+			}
+			Highlighter(documents, diffInfos, colorSettings, diffOptions, true, 0).highlightNodes();
+
+			// The task runs on a pool thread and is only waited for here
+			ThreadPool pool(2);
+			auto task = std::make_shared<CompareTask>();
+			task->jsons.assign(std::begin(jsons), std::end(jsons));
+			task->currentDiffIndex = 0;
+			std::promise<void> finished;
+			pool.submit([task, &pool, &finished]
+				{
+					task->run(pool);
+					finished.set_value();
+				});
+			finished.get_future().wait();
+			Assert::AreEqual(S_OK, task->hr);
+			Assert::AreEqual(diffInfos.size(), task->diffInfos.size());
+			for (size_t i = 0; i < diffInfos.size(); ++i)
+			{
+				for (int pane = 0; pane < 2; ++pane)
+					Assert::AreEqual(diffInfos[i].nodeIds[pane], task->diffInfos[i].nodeIds[pane]);
+			}
+			Assert::AreEqual((size_t)2, task->panes.size());
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				std::list<ModifiedNode> nodes;
+				Highlighter::modifiedNodesToHTMLs(documents[pane][L"root"], nodes);
+				const PanePatch& patch = task->panes[pane];
+				size_t patchedNodes = patch.nodes.size();
+				for (const auto& batch : patch.batches)
+				{
+					patchedNodes += batch.nodes.size();
+					for (const auto& node : batch.nodes)
+						Assert::IsTrue(std::find_if(nodes.begin(), nodes.end(),
+							[&node](const ModifiedNode& n) { return n.nodeId == node.nodeId && n.outerHTML == node.outerHTML; }) != nodes.end());
+				}
+				Assert::AreEqual(nodes.size(), patchedNodes);
+				Assert::IsTrue(readers[pane].getDocumentNodeIds() == patch.documentNodeIds);
+				Assert::IsTrue(Highlighter::getDiffIndexesByDocument(documents[pane][L"root"], readers[pane]) == patch.diffIndexes);
+			}
+
+			// A superseded task stops and leaves nothing to apply
+			auto cancelled = std::make_shared<CompareTask>();
+			cancelled->jsons.assign(std::begin(jsons), std::end(jsons));
+			cancelled->cancelled = true;
+			cancelled->run(pool);
+			Assert::AreEqual(E_ABORT, cancelled->hr);
+			Assert::IsTrue(cancelled->diffInfos.empty() && cancelled->panes.empty());
+
+			CompareTask invalid;
+			invalid.jsons = { jsons[0], L"{" };
+			invalid.run(pool);
+			Assert::AreEqual(E_FAIL, invalid.hr);
+
+			// A task that throws does not take its worker down with it
+			std::promise<void> next;
+			pool.submit([] { throw std::runtime_error("failed"); });
+			pool.submit([] { throw std::bad_alloc(); });
+			pool.submit([&next] { next.set_value(); });
+			next.get_future().wait();
+		}
+
+		TEST_METHOD(TestCompareFromSnapshot)
+		{
+			const std::wstring jsons[2] = { makeReaderTestJson(L"abc"), makeReaderTestJson(L"ABC") };
+			ThreadPool pool(0);
+			auto runTask = [&](bool ignoreCase, const CompareTask* previous)
+				{
+					auto task = std::make_shared<CompareTask>();
+					if (previous)
+					{
+						task->snapshot = previous->snapshot;
+						task->appliedNodes = previous->appliedNodes;
+					}
+					else
+						task->jsons.assign(std::begin(jsons), std::end(jsons));
+					task->diffOptions.ignoreCase = ignoreCase;
+					task->run(pool);
+					Assert::AreEqual(S_OK, task->hr);
+					Assert::AreEqual(previous != nullptr, task->fromSnapshot);
+					return task;
+				};
+			auto patchedNodes = [](const CompareTask& task, int pane)
+				{
+					std::map<int, std::wstring> nodes;
+					const PanePatch& patch = task.panes[pane];
+					Assert::IsTrue(patch.nodes.empty());
+					for (const auto& batch : patch.batches)
+					{
+						for (const auto& node : batch.nodes)
+							nodes.emplace(node.nodeId, node.outerHTML);
+					}
+					return nodes;
+				};
+
+			auto full = runTask(false, nullptr);
+			Assert::IsTrue(full->snapshot != nullptr);
+			Assert::IsFalse(full->diffInfos.empty());
+
+			// Nothing has changed, so nothing is patched
+			auto same = runTask(false, full.get());
+			assertSameDiffInfos(full->diffInfos, same->diffInfos, 2);
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				Assert::IsTrue(patchedNodes(*same, pane).empty());
+				// but the page is still checked for modifications
+				Assert::AreEqual((size_t)1, same->panes[pane].batches.size());
+				Assert::IsTrue(same->panes[pane].batches[0].script.find(L"([]);") != std::wstring::npos);
+			}
+
+			// Only the highlighted text nodes are restored; the patches expect the SPANs there
+			auto ignoreCase = runTask(true, same.get());
+			Assert::IsTrue(ignoreCase->snapshot == full->snapshot);
+			assertSameDiffInfos(runTask(true, nullptr)->diffInfos, ignoreCase->diffInfos, 2);
+			Assert::IsTrue(ignoreCase->diffInfos.empty());
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				auto nodes = patchedNodes(*ignoreCase, pane);
+				Assert::AreEqual((size_t)2, nodes.size());
+				Assert::AreEqual(std::wstring(pane == 0 ? L"abc " : L"ABC "), nodes.at(7));
+				Assert::IsTrue(ignoreCase->panes[pane].batches[0].script.find(L"[[0,1,0],\"SPAN\",") != std::wstring::npos);
+			}
+
+			// Back to the first options: the same patches as the first compare
+			auto back = runTask(false, ignoreCase.get());
+			assertSameDiffInfos(full->diffInfos, back->diffInfos, 2);
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				for (const auto& node : patchedNodes(*back, pane))
+					Assert::AreEqual(full->appliedNodes[pane].at(node.first).outerHTML, node.second);
+				Assert::IsTrue(full->panes[pane].diffIndexes == back->panes[pane].diffIndexes);
+			}
+		}
+
+		TEST_METHOD(TestPatchBatches)
+		{
+			const std::wstring json = makeReaderTestJson(L"abc");
+			TextSegments textSegments;
+			TextSegmentsReader reader;
+			Assert::IsTrue(reader.read(json.c_str(), textSegments));
+			std::vector<int> path;
+			std::wstring nodeName;
+			Assert::IsTrue(reader.getNodePath(7, path, nodeName));
+			Assert::IsTrue(path == std::vector<int>{ 0, 1, 0 });
+			Assert::AreEqual(std::wstring(L"#text"), nodeName);
+			Assert::IsTrue(reader.getNodePath(16, path, nodeName));
+			Assert::IsTrue(path == std::vector<int>{ 0, 1, 5, -1, 0 });
+			Assert::IsTrue(reader.getNodePath(10, path, nodeName));
+			Assert::AreEqual(std::wstring(L"SPAN"), nodeName);
+			Assert::IsFalse(reader.getNodePath(9, path, nodeName));
+
+			WDocument document;
+			reader.materialize(json, { 7, 16 }, document);
+			Highlighter::unhighlightNodes(document[L"root"], document.GetAllocator());
+			std::list<ModifiedNode> nodes;
+			Highlighter::modifiedNodesToHTMLs(document[L"root"], nodes);
+			Assert::AreEqual((size_t)2, nodes.size());
+			nodes.push_back({ 9999, L"x" });
+			std::vector<PatchBatch> batches = Highlighter::makePatchBatches(nodes, reader, 1);
+			Assert::AreEqual((size_t)2, batches.size());
+			Assert::AreEqual((size_t)1, nodes.size());
+			Assert::AreEqual(9999, nodes.front().nodeId);
+			// Last to first, so that no script runs on paths an earlier one has moved
+			Assert::AreEqual(12, batches[0].nodes[0].nodeId);
+			Assert::AreEqual(10, batches[1].nodes[0].nodeId);
+			Assert::IsTrue(batches[1].script.find(L"[[0,1,2],\"SPAN\",\"def\"]") != std::wstring::npos);
+		}
+
+		TEST_METHOD(TestPatchBatchesFromSnapshot)
+		{
+			const std::wstring json = makeReaderTestJson(L"abc");
+			TextSegments textSegments;
+			TextSegmentsReader reader;
+			Assert::IsTrue(reader.read(json.c_str(), textSegments));
+
+			// Node 7 was patched into three nodes, so the SPAN after it has moved by two
+			std::unordered_map<int, AppliedNode> appliedNodes{ { 7, { 3, L"SPAN", L"<span></span>abc <span></span>" } } };
+			std::list<ModifiedNode> nodes{ { 7, L"abc " }, { 10, L"def" } };
+			std::vector<PatchBatch> batches = Highlighter::makePatchBatches(nodes, reader, 10, &appliedNodes);
+			Assert::AreEqual((size_t)1, batches.size());
+			Assert::IsTrue(nodes.empty());
+			Assert::IsTrue(batches[0].script.find(L"[[0,1,0],\"SPAN\",\"abc \",3]") != std::wstring::npos);
+			Assert::IsTrue(batches[0].script.find(L"[[0,1,4],\"SPAN\",\"def\"]]);") != std::wstring::npos);
+
+			// A node patched into none is inserted where it was
+			appliedNodes = { { 7, { 0, L"", L"" } } };
+			nodes = { { 7, L"abc " }, { 10, L"def" } };
+			batches = Highlighter::makePatchBatches(nodes, reader, 1, &appliedNodes);
+			Assert::AreEqual((size_t)2, batches.size());
+			Assert::IsTrue(batches[0].script.find(L"[[0,1,1],\"SPAN\",\"def\"]]);") != std::wstring::npos);
+			Assert::IsTrue(batches[1].script.find(L"[[0,1,0],\"\",\"abc \",0]]);") != std::wstring::npos);
+		}
+
+		TEST_METHOD(TestDiffIndexesByDocument)
+		{
+			const std::wstring jsons[2] = { makeReaderTestJson(L"abc"), makeReaderTestJson(L"xyz") };
+			std::vector<WDocument> documents(2);
+			std::vector<TextSegments> textSegments(2);
+			std::vector<TextSegmentsReader> readers(2);
+			for (int pane = 0; pane < 2; ++pane)
+				Assert::IsTrue(readers[pane].read(jsons[pane].c_str(), textSegments[pane]));
+			Assert::IsTrue(readers[0].getDocumentNodeIds() == std::vector<int>{ 1, 15 });
+			size_t documentIndex = 0;
+			Assert::IsTrue(readers[0].getDocumentIndex(16, documentIndex));
+			Assert::AreEqual((size_t)1, documentIndex);
+			Assert::IsTrue(readers[0].getDocumentIndex(7, documentIndex));
+			Assert::AreEqual((size_t)0, documentIndex);
+
+			IWebDiffWindow::DiffOptions diffOptions{};
+			IWebDiffWindow::ColorSettings colorSettings{};
+			std::vector<DiffInfo> diffInfos = Comparer::compare(diffOptions, textSegments);
+			Comparer::setNodeIdInDiffInfoList(diffInfos, textSegments);
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				std::unordered_set<int> nodeIds;
+				for (const auto& diffInfo : diffInfos)
+					nodeIds.insert(diffInfo.nodeIds[pane]);
+				readers[pane].materialize(jsons[pane], nodeIds, documents[pane]);
+				Highlighter::unhighlightNodes(documents[pane][L"root"], documents[pane].GetAllocator());
+			}
+			Highlighter(documents, diffInfos, colorSettings, diffOptions, true, 0).highlightNodes();
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				std::vector<std::vector<int>> diffIndexes = Highlighter::getDiffIndexesByDocument(documents[pane][L"root"], readers[pane]);
+				Assert::AreEqual((size_t)2, diffIndexes.size());
+				Assert::IsTrue(diffIndexes[0] == std::vector<int>{ 0 });
+				Assert::IsTrue(diffIndexes[1] == std::vector<int>{ 1 });
+			}
+		}
+
+		TEST_METHOD(TestQueriedDiffNodes)
+		{
+			const std::vector<int> diffIndexes{ 3, 1, 2 };
+			std::map<int, int> nodes{ { 0, 10 } };
+			const std::map<int, int> before = nodes;
+
+			// A failed DOM.querySelectorAll comes back without a result
+			Assert::IsFalse(Highlighter::getQueriedDiffNodes(E_FAIL, nullptr, diffIndexes, nodes));
+			Assert::IsFalse(Highlighter::getQueriedDiffNodes(S_OK, nullptr, diffIndexes, nodes));
+			Assert::IsFalse(Highlighter::getQueriedDiffNodes(E_FAIL, L"{\"nodeIds\":[30,31,32]}", diffIndexes, nodes));
+			Assert::IsFalse(Highlighter::getQueriedDiffNodes(S_OK, L"{\"nodeIds\":[30,31", diffIndexes, nodes));
+			Assert::IsFalse(Highlighter::getQueriedDiffNodes(S_OK, L"{\"code\":-32000}", diffIndexes, nodes));
+			Assert::IsFalse(Highlighter::getQueriedDiffNodes(S_OK, L"{\"nodeIds\":[30,31]}", diffIndexes, nodes));
+			Assert::IsFalse(Highlighter::getQueriedDiffNodes(S_OK, L"{\"nodeIds\":[30,\"31\",32]}", diffIndexes, nodes));
+			Assert::IsTrue(before == nodes);
+
+			Assert::IsTrue(Highlighter::getQueriedDiffNodes(S_OK, L"{\"nodeIds\":[30,31,32]}", diffIndexes, nodes));
+			Assert::IsTrue(nodes == std::map<int, int>{ { 0, 10 }, { 1, 31 }, { 2, 32 }, { 3, 30 } });
+		}
+
+		// utils::Quote() as it was before it escaped control characters, except
+		// that it keeps \r, so that it also serves as a reference for text without them
+		static std::wstring legacyQuote(const std::wstring& text)
+		{
+			std::wstring ret;
+			ret += L"\"";
+			for (auto c : text)
+			{
+				switch (c)
+				{
+				case '\n': ret += L"\\n"; break;
+				case '\"': ret += L"\\\""; break;
+				case '\\': ret += L"\\\\"; break;
+				default:   ret += c;
+				}
+			}
+			ret += L"\"";
+			return ret;
+		}
+
+		static std::wstring legacyEncodeHTMLEntities(const std::wstring& text)
+		{
+			std::wstring result;
+			for (auto c : text)
+			{
+				switch (c)
+				{
+				case '<':  result += L"&lt;"; break;
+				case '>':  result += L"&gt;"; break;
+				case '"':  result += L"&quot;"; break;
+				default:   result += c; break;
+				}
+			}
+			return result;
+		}
+
+		TEST_METHOD(TestQuote)
+		{
+			Assert::AreEqual(std::wstring(LR"("a\"b\\c\n\r\t\b\f\u0001\u001f )" L"\x00e4\""),
+				utils::Quote(std::wstring(L"a\"b\\c\n\r\t\b\f\x01\x1f \x00e4")));
+			Assert::AreEqual(std::wstring(L"\"\x2028 \xd83d\xde00\xffff\""),
+				utils::Quote(std::wstring(L"\x2028 \xd83d\xde00\xffff")));
+			Assert::AreEqual(std::wstring(L"a&lt;b&gt;&quot;&amp;"),
+				utils::EncodeHTMLEntities(std::wstring(L"a<b>\"&amp;")));
+
+			// Escapes at every position of the SIMD blocks and in the scalar tail
+			const wchar_t specials[] = { L'"', L'\\', L'\n', L'<', L'>', L'\x7f', L'\x8000', L'\xffff', L'a' };
+			unsigned state = 1;
+			for (size_t length = 0; length < 70; ++length)
+			{
+				for (int iteration = 0; iteration < 20; ++iteration)
+				{
+					std::wstring text;
+					for (size_t i = 0; i < length; ++i)
+					{
+						state = state * 1103515245 + 12345;
+						text += specials[(state >> 16) % (sizeof(specials) / sizeof(specials[0]))];
+					}
+					Assert::AreEqual(legacyQuote(text), utils::Quote(text));
+					Assert::AreEqual(legacyEncodeHTMLEntities(text), utils::EncodeHTMLEntities(text));
+				}
+			}
+		}
+
+		// A page shaped like a DOM.getDocument result of a real site: members sorted
+		// by name, head elements, nested blocks with inline markup, lists, form
+		// fields, comments and an iframe every 50 sections.
+		static std::wstring makePageJson(int sectionCount)
+		{
+			int nodeId = 1;
+			std::wstring json;
+			auto element = [&](const wchar_t* name, const std::wstring& attributes, const std::function<void()>& children)
+			{
+				const int id = nodeId++;
+				json += L"{\"attributes\":[" + attributes + L"],\"backendNodeId\":" + std::to_wstring(id) + L",\"children\":[";
+				children();
+				if (json.back() == L',')
+					json.pop_back();
+				json += L"],\"localName\":\"\",\"nodeId\":" + std::to_wstring(id) + L",\"nodeName\":\"" + name + L"\",\"nodeType\":1,\"nodeValue\":\"\"},";
+			};
+			auto leaf = [&](const wchar_t* name, int nodeType, const std::wstring& value)
+			{
+				const int id = nodeId++;
+				json += L"{\"backendNodeId\":" + std::to_wstring(id) + L",\"localName\":\"\",\"nodeId\":" + std::to_wstring(id) +
+					L",\"nodeName\":\"" + name + L"\",\"nodeType\":" + std::to_wstring(nodeType) + L",\"nodeValue\":\"" + value + L"\"},";
+			};
+			auto text = [&](const std::wstring& value) { leaf(L"#text", 3, value); };
+			auto document = [&](const std::function<void()>& body)
+			{
+				const int id = nodeId++;
+				json += L"{\"backendNodeId\":" + std::to_wstring(id) + L",\"children\":[";
+				element(L"HTML", L"\"lang\",\"en\"", [&] {
+					element(L"HEAD", L"", [&] {
+						element(L"TITLE", L"", [&] { text(L"Example page"); });
+						element(L"META", L"\"charset\",\"utf-8\"", [] {});
+						element(L"LINK", L"\"rel\",\"stylesheet\",\"href\",\"site.css\"", [] {});
+						element(L"SCRIPT", L"\"src\",\"app.js\"", [&] { text(L"window.dataLayer = [];"); });
+						element(L"STYLE", L"", [&] { text(L"body { margin: 0 }"); });
+					});
+					element(L"BODY", L"\"class\",\"page\"", body);
+				});
+				json.pop_back();
+				json += L"],\"nodeId\":" + std::to_wstring(id) + L",\"nodeName\":\"#document\",\"nodeType\":9,\"nodeValue\":\"\"},";
+			};
+			json += L"{\"root\":";
+			document([&] {
+				for (int i = 0; i < sectionCount; ++i)
+				{
+					const std::wstring n = std::to_wstring(i);
+					element(L"DIV", L"\"class\",\"section\",\"id\",\"s" + n + L"\"", [&] {
+						element(L"H2", L"", [&] { text(L"Section " + n); });
+						element(L"P", L"", [&] {
+							text(L"The quick brown fox ");
+							element(L"A", L"\"href\",\"/item/" + n + L"\"", [&] { text(L"jumps"); });
+							text(L" over the ");
+							element(L"B", L"", [&] { text(L"lazy"); });
+							text(L" dog. ");
+							element(L"SPAN", L"\"class\",\"note\"", [&] { text(L"Note " + n); });
+						});
+						element(L"UL", L"", [&] {
+							for (int j = 0; j < 4; ++j)
+								element(L"LI", L"", [&] { text(L"Item " + std::to_wstring(j)); });
+						});
+						leaf(L"#comment", 8, L" end of section ");
+						element(L"INPUT", L"\"type\",\"text\",\"value\",\"field " + n + L"\"", [] {});
+						element(L"INPUT", L"\"type\",\"hidden\",\"value\",\"token\"", [] {});
+						element(L"BR", L"", [] {});
+						if (i % 50 == 49)
+						{
+							const int id = nodeId++;
+							json += L"{\"attributes\":[\"src\",\"frame.html\"],\"backendNodeId\":" + std::to_wstring(id) + L",\"children\":[],\"contentDocument\":";
+							document([&] { element(L"P", L"", [&] { text(L"Frame " + n); }); });
+							json.pop_back();
+							json += L",\"localName\":\"iframe\",\"nodeId\":" + std::to_wstring(id) + L",\"nodeName\":\"IFRAME\",\"nodeType\":1,\"nodeValue\":\"\"},";
+						}
+					});
+				}
+			});
+			json.pop_back();
+			json += L"}";
+			return json;
+		}
+
+		TEST_METHOD(TestFlatDocument)
+		{
+			for (const std::wstring& json : { std::wstring(json1), std::wstring(json2), makeReaderTestJson(L"abc"), makePageJson(60) })
+			{
+				domutils::FlatDocument flatDocument;
+				Assert::IsTrue(flatDocument.parse(json.c_str()));
+			}
+
+			domutils::FlatDocument document;
+			Assert::IsTrue(document.parse(makeReaderTestJson(L"abc").c_str()));
+			Assert::AreEqual((size_t)16, document.size());
+			const auto& root = document[document.root()];
+			Assert::AreEqual(1, root.nodeId);
+			Assert::AreEqual(static_cast<int>(NodeType::DOCUMENT_NODE), root.nodeType);
+			const uint32_t html = root.firstChild;
+			Assert::AreEqual(std::wstring(L"HTML"), std::wstring(document.nodeName(html)));
+			Assert::AreEqual(document.root(), document[html].parent);
+			const uint32_t body = document[document[html].firstChild].nextSibling;
+			Assert::AreEqual(6, document[body].nodeId);
+			uint32_t iframe = document[body].firstChild;
+			while (document[iframe].nextSibling != domutils::FlatDocument::npos)
+				iframe = document[iframe].nextSibling;
+			Assert::AreEqual(14, document[iframe].nodeId);
+			const uint32_t contentDocument = document[iframe].contentDocument;
+			Assert::AreEqual(15, document[contentDocument].nodeId);
+			Assert::AreEqual(iframe, document[contentDocument].parent);
+			Assert::AreEqual(std::wstring(L"jkl abc"), std::wstring(document.nodeValue(document[contentDocument].firstChild)));
+			const uint32_t span = document[document[document[body].firstChild].nextSibling].nextSibling;
+			Assert::AreEqual(10, document[span].nodeId);
+			Assert::IsTrue(document.containsClassName(span, L"wwd-diff"));
+			Assert::AreEqual(std::wstring(L"def"), std::wstring(document.getAttribute(span, L"data-wwdtext")));
+			Assert::IsNull(document.getAttribute(span, L"value"));
+			Assert::AreEqual(static_cast<int>(htmltags::TAG_INPUT), static_cast<int>(document[document[span].nextSibling].tag));
+			Assert::AreEqual(domutils::FlatDocument::npos, document.findName(L"TABLE"));
+			Assert::IsFalse(document.parse(L"{\"root\":"));
+		}
+
+		static constexpr const wchar_t* legacyVoidElements[] =
+		{
+			L"AREA", L"BASE", L"BR", L"COL", L"EMBED", L"HR", L"IMG", L"INPUT", L"LINK", L"META",
+			L"SOURCE", L"TRACK", L"WBR",
+		};
+
+		static constexpr const wchar_t* legacyInlineElements[] =
+		{
+			L"A", L"ABBR", L"ACRONYM", L"AUDIO", L"B", L"BDI", L"BDO", L"BIG", L"BR", L"BUTTON",
+			L"CANVAS", L"CITE", L"CODE", L"DATA", L"DATALIST", L"DEL", L"DFN", L"EM", L"EMBED",
+			L"I", L"IFRAME", L"IMG", L"INPUT", L"INS", L"KBD", L"LABEL", L"MAP", L"MARK", L"METER",
+			L"NOSCRIPT", L"OBJECT", L"OUTPUT", L"PICTURE", L"PROGRESS", L"Q", L"RUBY", L"S",
+			L"SAMP", L"SCRIPT", L"SELECT", L"SLOT", L"SMALL", L"SPAN", L"STRONG", L"SUB", L"SUP",
+			L"SVG", L"TEMPLATE", L"TEXTAREA", L"TIME", L"TT", L"U", L"VAR", L"VIDEO", L"WBR",
+		};
+
+		static int legacyCmp(const void* a, const void* b)
+		{
+			return wcscmp(*reinterpret_cast<const wchar_t* const*>(a), *reinterpret_cast<const wchar_t* const*>(b));
+		}
+
+		template <size_t N>
+		static bool legacyContains(const wchar_t* const (&names)[N], const wchar_t* name)
+		{
+			return bsearch(&name, names, N, sizeof(names[0]), legacyCmp) != nullptr;
+		}
+
+		static bool legacyIsSkippedElement(const wchar_t* name)
+		{
+			return wcscmp(name, L"SCRIPT") == 0 || wcscmp(name, L"NOSCRIPT") == 0 ||
+				wcscmp(name, L"NOFRAMES") == 0 || wcscmp(name, L"STYLE") == 0 || wcscmp(name, L"TITLE") == 0;
+		}
+
+		TEST_METHOD(TestHTMLTags)
+		{
+			for (int tag = htmltags::TAG_OTHER + 1; tag < htmltags::TAG_COUNT; ++tag)
+			{
+				const wchar_t* name = htmltags::tagInfos[tag].name;
+				Assert::AreEqual(tag, static_cast<int>(htmltags::lookup(name)));
+				Assert::AreEqual(legacyContains(legacyVoidElements, name), utils::IsVoidElement(name));
+				Assert::AreEqual(legacyContains(legacyInlineElements, name), utils::IsInlineElement(name));
+				Assert::AreEqual(legacyIsSkippedElement(name), htmltags::hasProperty(htmltags::lookup(name), htmltags::SKIP_TEXT));
+			}
+			for (auto name : legacyVoidElements)
+				Assert::IsTrue(utils::IsVoidElement(name));
+			for (auto name : legacyInlineElements)
+				Assert::IsTrue(utils::IsInlineElement(name));
+			for (auto name : { L"", L"div", L"DIVX", L"DI", L"H7", L"CUSTOM-ELEMENT", L"#text", L"#document", L"INPUT " })
+			{
+				Assert::AreEqual(static_cast<int>(htmltags::TAG_OTHER), static_cast<int>(htmltags::lookup(name)));
+				Assert::IsFalse(utils::IsVoidElement(name));
+				Assert::IsFalse(utils::IsInlineElement(name));
+			}
+			Assert::AreEqual(static_cast<int>(htmltags::TAG_SPAN), static_cast<int>(htmltags::lookup(L"SPANX", 4)));
+		}
+
+		// TextSegments::Make(text, ignoreNumbers) before the character class table
+		static std::vector<std::pair<size_t, size_t>> legacyTokenize(const std::wstring& text, bool ignoreNumbers)
+		{
+			auto isWordBreak = [](wchar_t ch)
+			{
+				if ((ch & 0xff00) == 0)
+				{
+					static const wchar_t* BreakChars = L".,:;?[](){}<=>`'!\"#$%&^~\\|@+-*/";
+					return wcschr(BreakChars, ch) != nullptr;
+				}
+				WORD wCharType = 0;
+				GetStringTypeW(CT_CTYPE1, &ch, 1, &wCharType);
+				return (wCharType & (C1_UPPER | C1_LOWER | C1_DIGIT)) == 0;
+			};
+			std::vector<std::pair<size_t, size_t>> tokens;
+			int charTypePrev = -1;
+			size_t begin = 0;
+			for (size_t i = 0; i < text.size(); ++i)
+			{
+				int charType = 0;
+				wchar_t ch = text[i];
+				if (iswspace(ch))
+					charType = 1;
+				else if (isWordBreak(ch))
+					charType = 2;
+				else if (ignoreNumbers && iswdigit(ch))
+					charType = 3;
+				if (charType == 2 || charType != charTypePrev)
+				{
+					if (i > 0)
+					{
+						tokens.emplace_back(begin, i - begin);
+						begin = i;
+					}
+					charTypePrev = charType;
+				}
+			}
+			tokens.emplace_back(begin, text.size() - begin);
+			return tokens;
+		}
+
+		static std::vector<std::pair<size_t, size_t>> tokenize(const std::wstring& text, bool ignoreNumbers)
+		{
+			TextSegments textSegments;
+			textSegments.Make(text, ignoreNumbers);
+			std::vector<std::pair<size_t, size_t>> tokens;
+			for (size_t i = 0; i < textSegments.segments.size(); ++i)
+				tokens.emplace_back(textSegments.segments.offset(i), textSegments.segments.length(i));
+			return tokens;
+		}
+
+		TEST_METHOD(TestCharClass)
+		{
+			Assert::IsTrue(utils::IsSpace(L' ') && utils::IsSpace(L'\t') && utils::IsSpace(L'\x3000') && utils::IsSpace(L'\x2003'));
+			Assert::IsFalse(utils::IsSpace(L'a') || utils::IsSpace(L'\x200b'));
+			Assert::IsTrue(utils::IsDigit(L'7') && utils::IsDigit(L'\x0663') && utils::IsDigit(L'\xff11'));
+			Assert::IsFalse(utils::IsDigit(L'a') || utils::IsDigit(L'\x00b2'));
+			for (auto ch : { L'a', L'Z', L'_', L'\x00e9', L'\x0436', L'\x0416', L'\x03c9', L'\x0663', L'\xff21' })
+				Assert::IsFalse(utils::IsWordBreak(ch));
+			for (auto ch : { L'-', L'.', L'"', L'@', L'\x4e2d', L'\x3042', L'\x3001', L'\x2014', L'\xd83d' })
+				Assert::IsTrue(utils::IsWordBreak(ch));
+
+			std::vector<std::pair<size_t, size_t>> expected{ { 0, 7 }, { 7, 1 }, { 8, 1 }, { 9, 2 }, { 11, 2 }, { 13, 1 }, { 14, 1 }, { 15, 3 }, { 18, 1 }, { 19, 3 } };
+			Assert::IsTrue(expected == tokenize(L"foo_bar, x1  \x4e2d\x6587\x0436\x0443\x043a 123", false));
+			Assert::IsTrue(std::vector<std::pair<size_t, size_t>>{ { 0, 0 } } == tokenize(L"", false));
+			Assert::IsTrue(std::vector<std::pair<size_t, size_t>>{ { 0, 3 }, { 3, 3 }, { 6, 1 } } == tokenize(L"abc123-", true));
+
+			// The vectorized ASCII runs agree with the legacy tokenizer and, around
+			// non-ASCII characters, with a per-character scan
+			const wchar_t ascii[] = L"ab Z_09 \t\n.,;-()[]{}<>\"'`~!@#$%^&*+=/\\|?:\x7f\x01";
+			const wchar_t other[] = { L'\x00e9', L'\x00a0', L'\x0436', L'\x4e2d', L'\x3000', L'\x0663', L'\xd83d' };
+			unsigned state = 1;
+			for (size_t length = 0; length < 80; ++length)
+			{
+				for (int iteration = 0; iteration < 20; ++iteration)
+				{
+					std::wstring asciiText, mixedText;
+					for (size_t i = 0; i < length; ++i)
+					{
+						state = state * 1103515245 + 12345;
+						asciiText += ascii[(state >> 16) % (sizeof(ascii) / sizeof(ascii[0]) - 1)];
+						mixedText += (state >> 8) % 8 == 0 ? other[(state >> 20) % (sizeof(other) / sizeof(other[0]))] : asciiText.back();
+					}
+					for (bool ignoreNumbers : { false, true })
+					{
+						Assert::IsTrue(legacyTokenize(asciiText, ignoreNumbers) == tokenize(asciiText, ignoreNumbers));
+						std::vector<std::pair<size_t, size_t>> scanned;
+						size_t begin = 0;
+						for (size_t i = 1; i < mixedText.size(); ++i)
+						{
+							const int type = utils::GetCharType(mixedText[i], ignoreNumbers);
+							if (type == 2 || type != utils::GetCharType(mixedText[i - 1], ignoreNumbers))
+							{
+								scanned.emplace_back(begin, i - begin);
+								begin = i;
+							}
+						}
+						scanned.emplace_back(begin, mixedText.size() - begin);
+						Assert::IsTrue(scanned == tokenize(mixedText, ignoreNumbers));
+					}
+				}
+			}
+		}
+
+		// Checks that edscript is a valid alignment of the two panes and returns its LCS length
+		static size_t checkEdscript(const std::vector<char>& edscript, const InternedDataForDiff& data1, const InternedDataForDiff& data2)
+		{
+			size_t i1 = 0, i2 = 0, common = 0;
+			for (char op : edscript)
+			{
+				if (op == '=')
+				{
+					Assert::IsTrue(i1 < data1.recordCount() && i2 < data2.recordCount());
+					Assert::AreEqual(data1.ids()[i1], data2.ids()[i2]);
+					++common;
+				}
+				i1 += (op != '+') ? 1 : 0;
+				i2 += (op != '-') ? 1 : 0;
+			}
+			Assert::AreEqual(data1.recordCount(), i1);
+			Assert::AreEqual(data2.recordCount(), i2);
+			return common;
+		}
+
+		TEST_METHOD(TestBitParallelDiff)
+		{
+			// Every punctuation character is a token of its own
+			const wchar_t alphabet[] = L".,;:!?+-*/()[]{}<>=@";
+			IWebDiffWindow::DiffOptions diffOptions{};
+			unsigned state = 1;
+			for (size_t length = 0; length < 150; length += 1 + length / 16)
+			{
+				for (size_t alphabetSize : { 2, 4, 20 })
+				{
+					std::vector<TextSegments> textSegments(2);
+					std::wstring texts[2];
+					for (size_t i = 0; i < length; ++i)
+					{
+						state = state * 1103515245 + 12345;
+						const wchar_t ch = alphabet[(state >> 16) % alphabetSize];
+						texts[0] += ch;
+						if ((state >> 8) % 5 != 0)
+							texts[1] += ch;
+						if ((state >> 12) % 6 == 0)
+							texts[1] += alphabet[(state >> 20) % alphabetSize];
+					}
+					textSegments[0].Make(texts[0], false);
+					textSegments[1].Make(texts[1], false);
+					TokenTable tokenTable(textSegments, diffOptions);
+					InternedDataForDiff data0(tokenTable, 0), data1(tokenTable, 1);
+
+					std::vector<char> expected, actual;
+					Diff<InternedDataForDiff>(data0, data1).diff(Diff<InternedDataForDiff>::MINIMAL, expected);
+					const int D = BitParallelDiff(data0, data1).diff(actual);
+					Assert::AreEqual(actual.size(), static_cast<size_t>(D));
+					Assert::AreEqual(checkEdscript(expected, data0, data1), checkEdscript(actual, data0, data1));
+				}
+			}
+		}
+
+		// Words from a large vocabulary, so that most tokens are unique, with sparse
+		// replaced, inserted and deleted words in the second pane
+		static void makeLargeTexts(size_t words, std::vector<TextSegments>& textSegments)
+		{
+			std::wstring texts[2];
+			unsigned state = 1;
+			for (size_t i = 0; i < words; ++i)
+			{
+				state = state * 1103515245 + 12345;
+				const std::wstring word = L"w" + std::to_wstring((state >> 4) % 1000000) + ((i % 12 == 11) ? L".\n" : L" ");
+				texts[0] += word;
+				switch ((state >> 24) % 200)
+				{
+				case 0: texts[1] += L"changed "; break;
+				case 1: texts[1] += L"inserted " + word; break;
+				case 2: break;
+				default: texts[1] += word; break;
+				}
+			}
+			textSegments.resize(2);
+			for (int pane = 0; pane < 2; ++pane)
+				textSegments[pane].Make(texts[pane], false);
+		}
+
+		TEST_METHOD(TestPartitionedDiff)
+		{
+			std::vector<TextSegments> textSegments;
+			makeLargeTexts(20000, textSegments);
+			IWebDiffWindow::DiffOptions diffOptions{};
+			TokenTable tokenTable(textSegments, diffOptions);
+			InternedDataForDiff data0(tokenTable, 0), data1(tokenTable, 1);
+
+			auto anchors = Comparer::findAnchors(data0, data1, tokenTable.symbolCount());
+			Assert::IsTrue(anchors.size() > 1000);
+			for (size_t k = 1; k < anchors.size(); ++k)
+				Assert::IsTrue(anchors[k - 1].first < anchors[k].first && anchors[k - 1].second < anchors[k].second);
+
+			ThreadPool pool(3);
+			for (auto algorithm : { Diff<InternedDataForDiff>::MYERS, Diff<InternedDataForDiff>::PATIENCE, Diff<InternedDataForDiff>::HISTOGRAM })
+			{
+				std::vector<char> expected, actual;
+				Diff<InternedDataForDiff>(data0, data1).diff(algorithm, expected);
+				const int D = Comparer::partitionedDiff(algorithm, data0, data1, tokenTable.symbolCount(), actual, pool);
+				Assert::AreEqual(actual.size(), static_cast<size_t>(D));
+				Assert::AreEqual(checkEdscript(expected, data0, data1), checkEdscript(actual, data0, data1));
+				Assert::AreEqual(Comparer::edscriptToDiffInfo(expected, textSegments[0], textSegments[1], false).size(),
+					Comparer::edscriptToDiffInfo(actual, textSegments[0], textSegments[1], false).size());
+			}
+
+			// Compares only partition when asked to
+			assertSameDiffInfos(Comparer::compare(diffOptions, textSegments), Comparer::compare(diffOptions, textSegments, &pool), 2);
+			DiffLimits limits;
+			limits.partitionMinTokens = 10000;
+			std::vector<char> partitioned;
+			Comparer::partitionedDiff(static_cast<Diff<InternedDataForDiff>::Algorithm>(diffOptions.diffAlgorithm),
+				data0, data1, tokenTable.symbolCount(), partitioned, pool);
+			Assert::AreEqual(Comparer::edscriptToDiffInfo(partitioned, textSegments[0], textSegments[1], false).size(),
+				Comparer::compare(diffOptions, textSegments, &pool, nullptr, nullptr, nullptr, limits).size());
+
+			// Without common unique tokens there is a single region
+			std::vector<TextSegments> repeated(2);
+			repeated[0].Make(L"a a b a b", false);
+			repeated[1].Make(L"b a a b a", false);
+			TokenTable repeatedTokenTable(repeated, diffOptions);
+			InternedDataForDiff repeated0(repeatedTokenTable, 0), repeated1(repeatedTokenTable, 1);
+			Assert::IsTrue(Comparer::findAnchors(repeated0, repeated1, repeatedTokenTable.symbolCount()).empty());
+			std::vector<char> expected, actual;
+			Diff<InternedDataForDiff>(repeated0, repeated1).diff(Diff<InternedDataForDiff>::MYERS, expected);
+			Comparer::partitionedDiff(Diff<InternedDataForDiff>::MYERS, repeated0, repeated1, repeatedTokenTable.symbolCount(), actual, pool);
+			Assert::AreEqual(checkEdscript(expected, repeated0, repeated1), checkEdscript(actual, repeated0, repeated1));
+		}
+
+		TEST_METHOD(TestDiffBudget)
+		{
+			using InternedDiff = Diff<InternedDataForDiff>;
+			std::vector<TextSegments> textSegments;
+			makeLargeTexts(20000, textSegments);
+			IWebDiffWindow::DiffOptions diffOptions{};
+			TokenTable tokenTable(textSegments, diffOptions);
+			InternedDataForDiff data0(tokenTable, 0), data1(tokenTable, 1);
+
+			const DiffBudget expired(std::chrono::nanoseconds(1), 0);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			const DiffBudget lowCost(DiffBudget::Clock::duration::zero(), 1);
+			std::atomic<bool> cancelledFlag{ true };
+			const DiffBudget cancelled(DiffBudget::Clock::duration::zero(), 0, &cancelledFlag);
+			for (auto algorithm : { InternedDiff::MYERS, InternedDiff::MINIMAL, InternedDiff::PATIENCE, InternedDiff::HISTOGRAM })
+			{
+				std::vector<char> expected, actual;
+				DiffWorkspace workspace;
+				InternedDiff(data0, data1).diff(algorithm, expected, &workspace);
+				const size_t expectedCommon = checkEdscript(expected, data0, data1);
+
+				// Out of time the diff is coarser but still a valid alignment
+				InternedDiff(data0, data1).diff(algorithm, actual, &workspace, &expired);
+				Assert::IsTrue(checkEdscript(actual, data0, data1) < expectedCommon);
+
+				InternedDiff(data0, data1).diff(algorithm, actual, &workspace, &lowCost);
+				Assert::IsTrue(checkEdscript(actual, data0, data1) <= expectedCommon);
+
+				// A cancelled diff gives nothing back and frees its workspace
+				Assert::IsTrue(workspace.capacity() > 0);
+				Assert::AreEqual(-1, InternedDiff(data0, data1).diff(algorithm, actual, &workspace, &cancelled));
+				Assert::IsTrue(actual.empty());
+				Assert::AreEqual(static_cast<size_t>(0), workspace.capacity());
+			}
+
+			ThreadPool pool(3);
+			std::vector<char> edscript;
+			Assert::AreEqual(-1, Comparer::partitionedDiff(InternedDiff::MYERS, data0, data1, tokenTable.symbolCount(), edscript, pool, &cancelled));
+			Assert::IsTrue(Comparer::compare(diffOptions, textSegments, &pool, nullptr, &cancelledFlag).empty());
+			cancelledFlag = false;
+			Assert::IsFalse(Comparer::compare(diffOptions, textSegments, &pool, nullptr, &cancelledFlag).empty());
+		}
+	};
+
+	// Timings written to the test log. They take a while, so they are kept out of
+	// WinWebDiffTest and can be left out of a run, e.g. with
+	// /TestCaseFilter:"FullyQualifiedName!~WinWebDiffBenchmark".
+	TEST_CLASS(WinWebDiffBenchmark)
+	{
+	public:
+		// Returns how long func takes in microseconds
+		template <class Func>
+		static long long measure(Func&& func)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			func();
+			return static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start).count());
+		}
+
+		static void logMessage(const wchar_t* format, ...)
+		{
+			wchar_t buf[512];
+			va_list args;
+			va_start(args, format);
+			vswprintf_s(buf, _countof(buf), format, args);
+			va_end(args);
+			Logger::WriteMessage(buf);
+		}
+
+		static double megabytesPerSecond(size_t bytes, long long microseconds)
+		{
+			return microseconds ? bytes / (1024.0 * 1024.0) / (microseconds / 1000000.0) : 0.0;
+		}
+
+		TEST_METHOD(BenchmarkSetNodeIdInDiffInfoList)
+		{
+			for (size_t tokens : { 10000, 100000, 1000000 })
+			{
+				std::vector<TextSegments> textSegments(2);
+				for (auto& ts : textSegments)
+				{
+					for (size_t i = 0; i < tokens; ++i)
+						ts.segments.push_back(TextSegment{ static_cast<int>(i), 3, i, 1 });
+				}
+				std::vector<DiffInfo> diffInfos;
+				for (int i = 0; i + 1 < static_cast<int>(tokens); i += 4)
+					diffInfos.emplace_back(i, i + 1, i, i - 1);
+
+				const long long elapsed = measure([&] { Comparer::setNodeIdInDiffInfoList(diffInfos, textSegments); });
+
+				const DiffInfo& last = diffInfos.back();
+				Assert::AreEqual(last.begin[0], last.nodeIds[0]);
+				Assert::AreEqual(last.begin[1] - 1, last.nodeIds[1]);
+				Assert::AreEqual(1, last.nodePos[1]);
+				logMessage(L"setNodeIdInDiffInfoList: %zu tokens, %zu diffs: %lld us (%.3f ns/token)\n",
+					tokens, diffInfos.size(), elapsed, elapsed * 1000.0 / tokens);
+			}
+		}
+
+		TEST_METHOD(BenchmarkHighlightNodes)
+		{
+			for (int diffCount : { 1000, 10000, 100000 })
+			{
+				std::vector<WDocument> documents(2);
+				documents[0].Parse(WinWebDiffTest::makeDocumentJson(diffCount, L"abc").c_str());
+				documents[1].Parse(WinWebDiffTest::makeDocumentJson(diffCount, L"xyz").c_str());
+				std::vector<DiffInfo> diffInfos;
+				for (int i = 0; i < diffCount; ++i)
+				{
+					DiffInfo diffInfo(i, i, i, i);
+					for (int pane = 0; pane < 2; ++pane)
+					{
+						diffInfo.nodeIds[pane] = i + 3;
+						diffInfo.nodeTypes[pane] = NodeType::TEXT_NODE;
+					}
+					diffInfos.push_back(diffInfo);
+				}
+				IWebDiffWindow::DiffOptions diffOptions{};
+				IWebDiffWindow::ColorSettings colorSettings{};
+
+				const long long elapsed = measure([&]
+					{
+						Highlighter highlighter(documents, diffInfos, colorSettings, diffOptions, false, 0);
+						highlighter.highlightNodes();
+					});
+
+				const WValue& last = documents[1][L"root"][L"children"].GetArray()[0][L"children"].GetArray()[diffCount - 1];
+				Assert::AreEqual(std::wstring(L"SPAN"), std::wstring(last[L"nodeName"].GetString()));
+				logMessage(L"highlightNodes: %d diffs: %lld us (%.3f us/diff)\n",
+					diffCount, elapsed, static_cast<double>(elapsed) / diffCount);
+			}
+		}
+
+		TEST_METHOD(BenchmarkParallel3WayCompare)
+		{
+			for (size_t words : { 10000, 100000 })
+			{
+				std::vector<TextSegments> textSegments(3);
+				for (unsigned pane = 0; pane < 3; ++pane)
+					textSegments[pane].Make(WinWebDiffTest::makeText(words, pane), false);
+				IWebDiffWindow::DiffOptions diffOptions{};
+
+				std::vector<DiffInfo> diffInfos1, diffInfos2;
+				const long long serial = measure([&] { diffInfos1 = Comparer::compare(diffOptions, textSegments); });
+				const long long parallel = measure([&] { diffInfos2 = Comparer::compare(diffOptions, textSegments, &ThreadPool::instance()); });
+
+				Assert::AreEqual(diffInfos1.size(), diffInfos2.size());
+				for (size_t i = 0; i < diffInfos1.size(); ++i)
+				{
+					for (int pane = 0; pane < 3; ++pane)
+					{
+						Assert::AreEqual(diffInfos1[i].begin[pane], diffInfos2[i].begin[pane]);
+						Assert::AreEqual(diffInfos1[i].end[pane], diffInfos2[i].end[pane]);
+					}
+					Assert::AreEqual(static_cast<int>(diffInfos1[i].op), static_cast<int>(diffInfos2[i].op));
+				}
+				logMessage(L"3-way compare: %zu words, %zu diffs: serial %lld us, parallel %lld us (x%.2f)\n",
+					words, diffInfos1.size(), serial, parallel, parallel ? static_cast<double>(serial) / parallel : 0.0);
+			}
+		}
+
+		TEST_METHOD(BenchmarkIncrementalCompare)
+		{
+			for (size_t words : { 10000, 100000 })
+			{
+				std::vector<TextSegments> textSegments(3);
+				for (unsigned pane = 0; pane < 3; ++pane)
+					textSegments[pane].Make(WinWebDiffTest::makeText(words, pane), false);
+				IWebDiffWindow::DiffOptions diffOptions{};
+				diffOptions.ignoreCase = true;
+				ThreadPool& pool = ThreadPool::instance();
+				CompareCache cache;
+				Comparer::compare(diffOptions, textSegments, &pool, nullptr, nullptr, &cache);
+
+				// One pane reloads with a few words changed
+				textSegments[2] = TextSegments();
+				textSegments[2].Make(WinWebDiffTest::makeText(words, 3), false);
+
+				std::vector<DiffInfo> expected, actual;
+				const long long full = measure([&] { expected = Comparer::compare(diffOptions, textSegments, &pool); });
+				const long long incremental = measure([&] { actual = Comparer::compare(diffOptions, textSegments, &pool, nullptr, nullptr, &cache); });
+
+				WinWebDiffTest::assertSameDiffInfos(expected, actual, 3);
+				logMessage(L"3-way recompare of %zu words after a single-pane reload: full %lld us, incremental %lld us (x%.2f)\n",
+					words, full, incremental, incremental ? static_cast<double>(full) / incremental : 0.0);
+			}
+		}
+
+		TEST_METHOD(BenchmarkDiffWorkspace)
+		{
+			const int iterations = 10000;
+			std::vector<TextSegments> textSegments(2);
+			textSegments[0].Make(L"The quick brown fox jumps over the lazy dog", false);
+			textSegments[1].Make(L"The quick red fox jumped over the lazy cat", false);
+			IWebDiffWindow::DiffOptions diffOptions{};
+			DiffWorkspace workspace;
+			for (DiffWorkspace* pworkspace : { static_cast<DiffWorkspace*>(nullptr), &workspace })
+			{
+				size_t diffCount = 0;
+				const size_t allocations = DiffWorkspace::heapAllocationCount();
+				const long long elapsed = measure([&]
+					{
+						for (int i = 0; i < iterations; ++i)
+							diffCount += Comparer::compare(diffOptions, textSegments, nullptr, pworkspace).size();
+					});
+				const size_t heapAllocations = DiffWorkspace::heapAllocationCount() - allocations;
+
+				Assert::AreEqual(static_cast<size_t>(iterations * 3), diffCount);
+				if (pworkspace)
+					Assert::IsTrue(heapAllocations <= 1);
+				logMessage(L"Diff::diff %ls workspace: %d diffs, %zu heap allocations, %lld us\n",
+					pworkspace ? L"with" : L"without", iterations, heapAllocations, elapsed);
+			}
+		}
+
+		static unsigned long legacyHash(const wchar_t* begin, const wchar_t* end)
+		{
+			unsigned long ha = 5381;
+			for (const wchar_t* ptr = begin; ptr < end; ptr++)
+			{
+				ha += (ha << 5);
+				ha ^= *ptr & 0xFF;
+			}
+			return ha;
+		}
+
+		TEST_METHOD(BenchmarkTokenHash)
+		{
+			std::wstring cjk, latin;
+			unsigned state = 1;
+			for (int i = 0; i < 200000; ++i)
+			{
+				state = state * 1103515245 + 12345;
+				cjk += static_cast<wchar_t>(0x4E00 + (state >> 8) % 0x5200);
+				if (i % 20 == 19)
+					cjk += L'\n';
+			}
+			for (int i = 0; i < 100000; ++i)
+			{
+				state = state * 1103515245 + 12345;
+				for (unsigned len = 3 + (state >> 24) % 6, j = 0; j < len; ++j)
+					latin += static_cast<wchar_t>(L'a' + (state >> (j * 3)) % 26);
+				latin += L' ';
+			}
+			for (const auto* corpus : { &cjk, &latin })
+			{
+				TextSegments textSegments;
+				textSegments.Make(*corpus, false);
+				std::set<std::wstring> tokens;
+				std::set<unsigned long> legacyHashes, hashes;
+				for (size_t i = 0; i < textSegments.segments.size(); ++i)
+				{
+					const wchar_t* begin = textSegments.allText.data() + textSegments.segments.offset(i);
+					const wchar_t* end = begin + textSegments.segments.length(i);
+					tokens.emplace(begin, end);
+					legacyHashes.insert(legacyHash(begin, end));
+					hashes.insert(FastTokenHash::hash(begin, end));
+				}
+
+				unsigned long sum = 0;
+				const long long elapsed = measure([&]
+					{
+						for (size_t i = 0; i < textSegments.segments.size(); ++i)
+						{
+							const wchar_t* begin = textSegments.allText.data() + textSegments.segments.offset(i);
+							sum += FastTokenHash::hash(begin, begin + textSegments.segments.length(i));
+						}
+					});
+
+				// a 32-bit unsigned long may still see a few birthday collisions
+				Assert::IsTrue(tokens.size() - hashes.size() <= tokens.size() / 1000);
+				Assert::IsTrue(sum != 0);
+				logMessage(L"FastTokenHash %ls: %zu distinct tokens, legacy collision rate %.2f%%, new collision rate %.2f%%, %.1f MB/s\n",
+					corpus == &cjk ? L"CJK" : L"Latin", tokens.size(),
+					100.0 * (tokens.size() - legacyHashes.size()) / tokens.size(),
+					100.0 * (tokens.size() - hashes.size()) / tokens.size(),
+					elapsed ? corpus->size() * sizeof(wchar_t) / static_cast<double>(elapsed) : 0.0);
+			}
+		}
+
+		TEST_METHOD(BenchmarkCompareFromSnapshot)
+		{
+			for (int textNodeCount : { 1000, 10000 })
+			{
+				const std::wstring jsons[2] = { WinWebDiffTest::makeDocumentJson(textNodeCount, L"abc def ghi"), WinWebDiffTest::makeDocumentJson(textNodeCount, L"abc xyz ghi") };
+				ThreadPool pool(0);
+				auto full = std::make_shared<CompareTask>();
+				full->jsons.assign(std::begin(jsons), std::end(jsons));
+				full->run(pool);
+				Assert::AreEqual(S_OK, full->hr);
+
+				// Word differences turned off: read the documents again or compare the snapshot
+				auto reread = std::make_shared<CompareTask>();
+				auto fromSnapshot = std::make_shared<CompareTask>();
+				const long long elapsedReread = measure([&]
+					{
+						reread->jsons.assign(std::begin(jsons), std::end(jsons));
+						reread->showWordDifferences = false;
+						reread->run(pool);
+					});
+				const long long elapsedSnapshot = measure([&]
+					{
+						fromSnapshot->snapshot = full->snapshot;
+						fromSnapshot->appliedNodes = full->appliedNodes;
+						fromSnapshot->showWordDifferences = false;
+						fromSnapshot->run(pool);
+					});
+				Assert::AreEqual(S_OK, fromSnapshot->hr);
+				WinWebDiffTest::assertSameDiffInfos(reread->diffInfos, fromSnapshot->diffInfos, 2);
+
+				// Turned on again: the same nodes are patched back
+				auto back = std::make_shared<CompareTask>();
+				back->snapshot = fromSnapshot->snapshot;
+				back->appliedNodes = fromSnapshot->appliedNodes;
+				back->run(pool);
+				auto countPatchedNodes = [](const CompareTask& task)
+					{
+						size_t count = 0;
+						for (const auto& pane : task.panes)
+						{
+							for (const auto& batch : pane.batches)
+								count += batch.nodes.size();
+						}
+						return count;
+					};
+				Assert::AreEqual(countPatchedNodes(*fromSnapshot), countPatchedNodes(*back));
+
+				logMessage(L"options-only recompare of %d text nodes: read again %lld us after DOM.getDocument of %zu bytes, from snapshot %lld us; %zu nodes patched\n",
+					textNodeCount, elapsedReread, (jsons[0].size() + jsons[1].size()) * sizeof(wchar_t),
+					elapsedSnapshot, countPatchedNodes(*fromSnapshot));
+			}
+		}
+
+		TEST_METHOD(BenchmarkTextSegmentsReader)
+		{
+			for (int textNodeCount : { 10000, 100000 })
+			{
+				const std::wstring json = WinWebDiffTest::makeDocumentJson(textNodeCount, L"abc def ghi");
+
+				WDocument document;
+				TextSegments expected;
+				const long long elapsedDOM = measure([&]
+					{
+						document.Parse(json.c_str());
+						expected.Make(document[L"root"]);
+					});
+
+				TextSegments actual;
+				TextSegmentsReader reader;
+				bool read = false;
+				const long long elapsedSAX = measure([&] { read = reader.read(json.c_str(), actual); });
+
+				Assert::IsTrue(read);
+				Assert::AreEqual(expected.allText, actual.allText);
+				Assert::AreEqual(expected.segments.size(), actual.segments.size());
+				logMessage(L"TextSegments from %d text nodes: DOM %lld us, SAX %lld us\n",
+					textNodeCount, elapsedDOM, elapsedSAX);
+			}
+		}
+
+		TEST_METHOD(BenchmarkPatchBatches)
+		{
+			for (int diffCount : { 1000, 10000 })
+			{
+				const std::wstring json = WinWebDiffTest::makeDocumentJson(diffCount, L"abc");
+				TextSegments textSegments;
+				TextSegmentsReader reader;
+				Assert::IsTrue(reader.read(json.c_str(), textSegments));
+				std::unordered_set<int> nodeIds;
+				std::vector<DiffInfo> diffInfos;
+				for (int i = 0; i < diffCount; ++i)
+				{
+					DiffInfo diffInfo(i, i);
+					diffInfo.nodeIds[0] = i + 3;
+					diffInfo.nodeTypes[0] = NodeType::TEXT_NODE;
+					diffInfos.push_back(diffInfo);
+					nodeIds.insert(i + 3);
+				}
+				std::vector<WDocument> documents(1);
+				reader.materialize(json, nodeIds, documents[0]);
+				IWebDiffWindow::DiffOptions diffOptions{};
+				IWebDiffWindow::ColorSettings colorSettings{};
+				Highlighter(documents, diffInfos, colorSettings, diffOptions, false, 0).highlightNodes();
+				std::list<ModifiedNode> nodes;
+				Highlighter::modifiedNodesToHTMLs(documents[0][L"root"], nodes);
+				const size_t nodeCount = nodes.size();
+
+				std::vector<PatchBatch> batches;
+				const long long elapsed = measure([&] { batches = Highlighter::makePatchBatches(nodes, reader, 1000); });
+
+				Assert::IsTrue(nodes.empty());
+				Assert::AreEqual((nodeCount + 999) / 1000, batches.size());
+				logMessage(L"patch %zu modified nodes: %zu round trips instead of %zu, encoded in %lld us\n",
+					nodeCount, batches.size(), nodeCount, elapsed);
+			}
+		}
+
+		TEST_METHOD(BenchmarkDiffNodeIdPayload)
+		{
+			for (int diffCount : { 1000, 10000 })
+			{
+				// What DOM.getDocument returns once every text node has been highlighted
+				std::wstring json = L"{ \"root\": { \"nodeId\": 1, \"nodeType\": 9, \"nodeName\": \"#document\", \"nodeValue\": \"\", \"children\": [ "
+					L"{ \"nodeId\": 2, \"nodeType\": 1, \"nodeName\": \"BODY\", \"nodeValue\": \"\", \"attributes\": [], \"children\": [ ";
+				std::wstring response = L"{\"nodeIds\":[";
+				for (int i = 0; i < diffCount; ++i)
+				{
+					const std::wstring id = std::to_wstring(i);
+					const std::wstring nodeId = std::to_wstring(diffCount + i * 2 + 3);
+					if (i > 0)
+					{
+						json += L", ";
+						response += L',';
+					}
+					json += L"{ \"nodeId\": " + nodeId + L", \"nodeType\": 1, \"nodeName\": \"SPAN\", \"nodeValue\": \"\", "
+						L"\"attributes\": [ \"class\", \"wwd-diff wwd-changed\", \"data-wwdid\", \"" + id + L"\", \"data-wwdtext\", \"abc\" ], "
+						L"\"children\": [ { \"nodeId\": " + std::to_wstring(diffCount + i * 2 + 4) + L", \"nodeType\": 3, \"nodeName\": \"#text\", \"nodeValue\": \"abc\" } ] }";
+					response += nodeId;
+				}
+				json += L" ] } ] } }";
+				response += L"]}";
+				const std::wstring request = L"{ \"nodeId\": 1, \"selector\": \"[data-wwdid]\" }";
+
+				std::map<int, int> expected;
+				const long long elapsedDocument = measure([&]
+					{
+						domutils::FlatDocument document;
+						Assert::IsTrue(document.parse(json.c_str()));
+						Highlighter::getDiffNodes(document, document.root(), expected);
+					});
+
+				const std::wstring pageJson = WinWebDiffTest::makeDocumentJson(diffCount, L"abc");
+				TextSegments textSegments;
+				TextSegmentsReader reader;
+				Assert::IsTrue(reader.read(pageJson.c_str(), textSegments));
+				std::unordered_set<int> nodeIds;
+				std::vector<DiffInfo> diffInfos;
+				for (int i = 0; i < diffCount; ++i)
+				{
+					DiffInfo diffInfo(i, i);
+					diffInfo.nodeIds[0] = i + 3;
+					diffInfo.nodeTypes[0] = NodeType::TEXT_NODE;
+					diffInfos.push_back(diffInfo);
+					nodeIds.insert(i + 3);
+				}
+				std::vector<WDocument> documents(1);
+				reader.materialize(pageJson, nodeIds, documents[0]);
+				IWebDiffWindow::DiffOptions diffOptions{};
+				IWebDiffWindow::ColorSettings colorSettings{};
+				Highlighter(documents, diffInfos, colorSettings, diffOptions, false, 0).highlightNodes();
+
+				std::map<int, int> actual;
+				const long long elapsedQuery = measure([&]
+					{
+						std::vector<std::vector<int>> diffIndexes = Highlighter::getDiffIndexesByDocument(documents[0][L"root"], reader);
+						Assert::IsTrue(Highlighter::getQueriedDiffNodes(S_OK, response.c_str(), diffIndexes[0], actual));
+					});
+
+				Assert::IsTrue(expected == actual);
+				logMessage(L"map %d diffs to node ids: DOM.getDocument %zu bytes, %lld us; DOM.querySelectorAll %zu bytes, %lld us\n",
+					diffCount, json.size(), elapsedDocument, request.size() + response.size(), elapsedQuery);
+			}
+		}
+
+		// modifiedNodesToHTMLs() as it was before it wrote to a single buffer
+		static std::wstring legacyModifiedNodesToHTMLs(const WValue& tree, std::list<ModifiedNode>& nodes)
+		{
+			std::wstring html;
+			auto appendChildren = [&](const wchar_t* name)
+			{
+				if (tree.HasMember(name))
+				{
+					for (const auto& child : tree[name].GetArray())
+						html += legacyModifiedNodesToHTMLs(child, nodes);
+				}
+			};
+			const int nodeType = tree[L"nodeType"].GetInt();
+			if (nodeType == NodeType::DOCUMENT_NODE)
+				appendChildren(L"children");
+			else if (nodeType == NodeType::TEXT_NODE)
+			{
+				appendChildren(L"insertedNodes");
+				std::wstring h = utils::EncodeHTMLEntities(tree[L"nodeValue"].GetString());
+				if (!h.empty() && std::all_of(h.begin(), h.end(), [](wchar_t ch) { return iswspace(ch); }))
+				{
+					h.pop_back();
+					h += L"&nbsp;";
+				}
+				html += h;
+				appendChildren(L"appendedNodes");
+			}
+			else if (nodeType == NodeType::ELEMENT_NODE)
+			{
+				appendChildren(L"insertedNodes");
+				html += L'<';
+				html += tree[L"nodeName"].GetString();
+				const auto& attributes = tree[L"attributes"].GetArray();
+				for (unsigned i = 0; i < attributes.Size(); i += 2)
+				{
+					html += L" ";
+					html += attributes[i].GetString();
+					html += L"=\"";
+					if (i + 1 < attributes.Size())
+						html += utils::EncodeHTMLEntities(attributes[i + 1].GetString());
+					html += L"\"";
+				}
+				html += L'>';
+				appendChildren(L"children");
+				appendChildren(L"appendedNodes");
+				html += L"</";
+				html += tree[L"nodeName"].GetString();
+				html += L'>';
+			}
+			if (tree.HasMember(L"modified"))
+				nodes.push_back({ tree[L"nodeId"].GetInt(), html });
+			return html;
+		}
+
+		// depth levels of nested DIVs with textNodeCount text nodes each, either the
+		// text nodes or the DIVs being modified
+		static std::wstring makeNestedDocumentJson(int depth, int textNodeCount, bool modifiedTextNodes)
+		{
+			int nodeId = 2;
+			std::wstring json = L"{ \"root\": { \"nodeId\": 1, \"nodeType\": 9, \"nodeName\": \"#document\", \"nodeValue\": \"\", \"children\": [ ";
+			for (int level = 0; level < depth; ++level)
+			{
+				json += L"{ \"nodeId\": " + std::to_wstring(nodeId++) + L", \"nodeType\": 1, \"nodeName\": \"DIV\", \"nodeValue\": \"\", ";
+				if (!modifiedTextNodes)
+					json += L"\"modified\": true, ";
+				json += L"\"attributes\": [ \"class\", \"wwd-diff\" ], \"children\": [ ";
+				for (int i = 0; i < textNodeCount; ++i)
+				{
+					json += L"{ \"nodeId\": " + std::to_wstring(nodeId++) + L", \"nodeType\": 3, \"nodeName\": \"#text\", \"nodeValue\": \"a<b\"";
+					json += modifiedTextNodes ? L", \"modified\": true }, " : L" }, ";
+				}
+			}
+			json += L"{ \"nodeId\": 0, \"nodeType\": 3, \"nodeName\": \"#text\", \"nodeValue\": \" \" }";
+			for (int level = 0; level < depth; ++level)
+				json += L" ] }";
+			json += L" ] } }";
+			return json;
+		}
+
+		TEST_METHOD(BenchmarkModifiedNodesToHTMLs)
+		{
+			struct Tree { const wchar_t* name; int depth; int textNodeCount; bool modifiedTextNodes; };
+			for (const Tree& tree : { Tree{ L"wide", 1, 100000, true }, Tree{ L"deep", 100, 1000, false } })
+			{
+				WDocument document;
+				document.Parse(makeNestedDocumentJson(tree.depth, tree.textNodeCount, tree.modifiedTextNodes).c_str());
+
+				std::list<ModifiedNode> expected;
+				std::wstring expectedHTML;
+				const long long elapsedLegacy = measure([&] { expectedHTML = legacyModifiedNodesToHTMLs(document[L"root"], expected); });
+				size_t legacyChars = 0;
+				for (const auto& node : expected)
+					legacyChars += node.outerHTML.size();
+
+				std::list<ModifiedNode> actual;
+				std::wstring actualHTML;
+				const long long elapsed = measure([&] { actualHTML = Highlighter::modifiedNodesToHTMLs(document[L"root"], actual); });
+				size_t chars = 0;
+				for (const auto& node : actual)
+					chars += node.outerHTML.size();
+
+				Assert::IsTrue(expectedHTML == actualHTML);
+				// Only the outermost modified nodes are kept
+				if (tree.modifiedTextNodes)
+				{
+					Assert::AreEqual(expected.size(), actual.size());
+					Assert::IsTrue(std::equal(actual.begin(), actual.end(), expected.begin(),
+						[](const ModifiedNode& a, const ModifiedNode& b) { return a.nodeId == b.nodeId && a.outerHTML == b.outerHTML; }));
+				}
+				else
+				{
+					Assert::AreEqual((size_t)1, actual.size());
+					Assert::AreEqual(expected.back().nodeId, actual.front().nodeId);
+					Assert::IsTrue(expected.back().outerHTML == actual.front().outerHTML);
+				}
+				logMessage(L"modifiedNodesToHTMLs %ls tree: legacy %lld us, %zu chars in %zu nodes; single buffer %lld us, %zu chars in %zu nodes\n",
+					tree.name, elapsedLegacy, legacyChars, expected.size(), elapsed, chars, actual.size());
+			}
+		}
+
+		TEST_METHOD(BenchmarkQuote)
+		{
+			std::wstring text;
+			unsigned state = 1;
+			while (text.size() < 8 * 1024 * 1024)
+			{
+				state = state * 1103515245 + 12345;
+				text += L"<span class=\"wwd-diff\">The quick brown fox jumps over the lazy dog</span>";
+				if ((state >> 16) % 4 == 0)
+					text += L"\n";
+			}
+			auto run = [&](auto&& func)
+			{
+				std::wstring result;
+				const long long elapsed = measure([&] { result = func(text); });
+				return std::make_pair(result, megabytesPerSecond(text.size() * sizeof(wchar_t), elapsed));
+			};
+			auto legacyQuoted = run(WinWebDiffTest::legacyQuote);
+			auto quoted = run([](const std::wstring& text) { return utils::Quote(text); });
+			auto legacyEncoded = run(WinWebDiffTest::legacyEncodeHTMLEntities);
+			auto encoded = run([](const std::wstring& text) { return utils::EncodeHTMLEntities(text); });
+			Assert::IsTrue(legacyQuoted.first == quoted.first);
+			Assert::IsTrue(legacyEncoded.first == encoded.first);
+			logMessage(L"Quote: legacy %.1f MB/s, new %.1f MB/s; EncodeHTMLEntities: legacy %.1f MB/s, new %.1f MB/s\n",
+				legacyQuoted.second, quoted.second, legacyEncoded.second, encoded.second);
+		}
+
+		TEST_METHOD(BenchmarkFlatDocument)
+		{
+			const std::wstring json = WinWebDiffTest::makePageJson(5000);
+
+			WDocument document;
+			const long long parseDOM = measure([&] { document.Parse(json.c_str()); });
+			domutils::FlatDocument flatDocument;
+			bool parsed = false;
+			const long long parseFlat = measure([&] { parsed = flatDocument.parse(json.c_str()); });
+
+			Assert::IsTrue(parsed);
+			logMessage(L"parse %zu nodes: RapidJSON DOM %lld us, flat DOM %lld us\n",
+				flatDocument.size(), parseDOM, parseFlat);
+		}
+
+		TEST_METHOD(BenchmarkHTMLTags)
+		{
+			// Element names in the proportions a DOM.getDocument walk sees them
+			std::vector<std::wstring> names;
+			const wchar_t* pool[] = { L"DIV", L"SPAN", L"P", L"A", L"LI", L"#text", L"#text", L"#text", L"#comment",
+				L"TD", L"TR", L"IMG", L"INPUT", L"SCRIPT", L"STYLE", L"SECTION", L"CUSTOM-ELEMENT", L"BR", L"STRONG" };
+			unsigned state = 1;
+			for (int i = 0; i < 1000000; ++i)
+			{
+				state = state * 1103515245 + 12345;
+				names.emplace_back(pool[(state >> 16) % (sizeof(pool) / sizeof(pool[0]))]);
+			}
+			auto run = [&](auto&& classify)
+			{
+				size_t count = 0;
+				const long long elapsed = measure([&]
+					{
+						for (const auto& name : names)
+							count += classify(name.c_str());
+					});
+				return std::make_pair(count, elapsed);
+			};
+			auto legacy = run([](const wchar_t* name)
+				{
+					return (WinWebDiffTest::legacyContains(WinWebDiffTest::legacyVoidElements, name) ? 1 : 0) + (WinWebDiffTest::legacyContains(WinWebDiffTest::legacyInlineElements, name) ? 2 : 0) +
+						(WinWebDiffTest::legacyIsSkippedElement(name) ? 4 : 0);
+				});
+			auto interned = run([](const wchar_t* name)
+				{
+					const htmltags::Tag tag = htmltags::lookup(name);
+					return (htmltags::hasProperty(tag, htmltags::VOID_ELEMENT) ? 1 : 0) + (htmltags::hasProperty(tag, htmltags::INLINE_ELEMENT) ? 2 : 0) +
+						(htmltags::hasProperty(tag, htmltags::SKIP_TEXT) ? 4 : 0);
+				});
+			Assert::AreEqual(legacy.first, interned.first);
+			logMessage(L"Classify %zu element names: bsearch and wcscmp %lld us, perfect hash %lld us\n",
+				names.size(), legacy.second, interned.second);
+		}
+
+		TEST_METHOD(BenchmarkTokenizer)
+		{
+			std::wstring latin, cyrillic, cjk;
+			unsigned state = 1;
+			while (latin.size() < 4 * 1024 * 1024)
+			{
+				state = state * 1103515245 + 12345;
+				for (unsigned len = 2 + (state >> 24) % 8, j = 0; j < len; ++j)
+				{
+					latin += static_cast<wchar_t>(L'a' + (state >> (j * 3)) % 26);
+					cyrillic += static_cast<wchar_t>(0x0430 + (state >> (j * 3)) % 32);
+				}
+				cjk += static_cast<wchar_t>(0x4E00 + (state >> 8) % 0x5200);
+				latin += (state >> 16) % 8 == 0 ? L", " : L" ";
+				cyrillic += (state >> 16) % 8 == 0 ? L", " : L" ";
+				if ((state >> 16) % 16 == 0)
+					cjk += L'\x3002';
+			}
+			for (const auto* corpus : { &latin, &cyrillic, &cjk })
+			{
+				const size_t bytes = corpus->size() * sizeof(wchar_t);
+				std::vector<std::pair<size_t, size_t>> expected;
+				const long long legacyElapsed = measure([&] { expected = WinWebDiffTest::legacyTokenize(*corpus, true); });
+				TextSegments textSegments;
+				const long long elapsed = measure([&] { textSegments.Make(*corpus, true); });
+				auto actual = WinWebDiffTest::tokenize(*corpus, true);
+				Assert::IsTrue(expected == actual);
+				logMessage(L"Tokenize %ls: %zu tokens, legacy %.1f MB/s, table %.1f MB/s\n",
+					corpus == &latin ? L"Latin" : (corpus == &cyrillic ? L"Cyrillic" : L"CJK"),
+					textSegments.segments.size(), megabytesPerSecond(bytes, legacyElapsed), megabytesPerSecond(bytes, elapsed));
+			}
+		}
+
+		TEST_METHOD(BenchmarkNormalizedTokens)
+		{
+			std::vector<TextSegments> textSegments(2);
+			std::wstring texts[2];
+			unsigned state = 1;
+			for (int i = 0; i < 100000; ++i)
+			{
+				state = state * 1103515245 + 12345;
+				std::wstring word, lowerWord;
+				for (unsigned len = 2 + (state >> 24) % 6, j = 0; j < len; ++j)
+				{
+					const wchar_t ch = static_cast<wchar_t>(L'a' + (state >> (j * 4)) % 26);
+					word += (state >> (j * 3)) % 2 ? static_cast<wchar_t>(ch - L'a' + L'A') : ch;
+					lowerWord += ch;
+				}
+				const wchar_t* separator = (state >> 16) % 8 == 0 ? L"  " : L" ";
+				for (int pane = 0; pane < 2; ++pane)
+				{
+					if (pane == 1 && (state >> 12) % 50 == 0)
+						continue;
+					texts[pane] += (pane == 1 && (state >> 20) % 3 == 0) ? lowerWord : word;
+					if ((state >> 10) % 10 == 0)
+						texts[pane] += std::to_wstring(pane * 1000 + i);
+					texts[pane] += separator;
+				}
+			}
+			for (int pane = 0; pane < 2; ++pane)
+				textSegments[pane].Make(texts[pane], true);
+			IWebDiffWindow::DiffOptions exactOptions{};
+			exactOptions.diffAlgorithm = Diff<InternedDataForDiff>::HISTOGRAM;
+			IWebDiffWindow::DiffOptions diffOptions = exactOptions;
+			diffOptions.ignoreCase = true;
+			diffOptions.ignoreWhitespace = 1;
+			diffOptions.ignoreNumbers = true;
+
+			// Interning the tokens as they are
+			std::vector<DiffInfo> exact;
+			const long long exactElapsed = measure([&] { exact = Comparer::compare(exactOptions, textSegments); });
+
+			// Normalizing once into the canonical buffers
+			std::vector<DiffInfo> actual;
+			const long long elapsed = measure([&] { actual = Comparer::compare(diffOptions, textSegments); });
+
+			Assert::IsTrue(actual.size() < exact.size());
+			logMessage(L"Compare %zu tokens: exact %zu diffs in %lld us, ignoring case, whitespace and numbers %zu diffs in %lld us\n",
+				textSegments[0].segments.size(), exact.size(), exactElapsed, actual.size(), elapsed);
+		}
+
+		TEST_METHOD(BenchmarkBitParallelDiff)
+		{
+			const wchar_t* words[] = { L"the", L"quick", L"brown", L"fox", L"jumps", L"over", L"lazy", L"dog", L"a", L"of",
+				L"and", L"to", L"in", L"is", L"it", L"that", L"was", L"for", L"on", L"are" };
+			IWebDiffWindow::DiffOptions diffOptions{};
+			DiffWorkspace workspace;
+			unsigned state = 1;
+			for (size_t tokenCount = 8; tokenCount <= 2048; tokenCount *= 2)
+			{
+				std::vector<TextSegments> textSegments(2);
+				std::wstring texts[2];
+				while (textSegments[0].segments.size() < tokenCount)
+				{
+					for (size_t i = 0; i < tokenCount / 2; ++i)
+					{
+						state = state * 1103515245 + 12345;
+						const wchar_t* word = words[(state >> 16) % (sizeof(words) / sizeof(words[0]))];
+						texts[0] += word;
+						texts[0] += L' ';
+						if ((state >> 8) % 10 != 0)
+							texts[1] += (state >> 12) % 10 == 0 ? L"changed" : word, texts[1] += L' ';
+					}
+					textSegments[0] = TextSegments();
+					textSegments[0].Make(texts[0], false);
+				}
+				textSegments[1].Make(texts[1], false);
+				TokenTable tokenTable(textSegments, diffOptions);
+				InternedDataForDiff data0(tokenTable, 0), data1(tokenTable, 1);
+
+				const int iterations = static_cast<int>(4000000 / tokenCount / 4 + 1);
+				std::vector<char> expected, actual;
+				const double myers = measure([&]
+					{
+						for (int i = 0; i < iterations; ++i)
+							Diff<InternedDataForDiff>(data0, data1).diff(Diff<InternedDataForDiff>::MYERS, expected, &workspace);
+					}) / static_cast<double>(iterations);
+				const double bitParallel = measure([&]
+					{
+						for (int i = 0; i < iterations; ++i)
+							BitParallelDiff(data0, data1).diff(actual, &workspace);
+					}) / static_cast<double>(iterations);
+
+				Assert::IsTrue(WinWebDiffTest::checkEdscript(actual, data0, data1) >= WinWebDiffTest::checkEdscript(expected, data0, data1));
+				logMessage(L"word diff of %zu tokens: xdiff Myers %.2f us, bit-parallel LCS %.2f us\n",
+					data0.recordCount(), myers, bitParallel);
+			}
+		}
+
+		TEST_METHOD(BenchmarkPartitionedDiff)
+		{
+			std::vector<TextSegments> textSegments;
+			WinWebDiffTest::makeLargeTexts(500000, textSegments);
+			IWebDiffWindow::DiffOptions diffOptions{};
+			TokenTable tokenTable(textSegments, diffOptions);
+			InternedDataForDiff data0(tokenTable, 0), data1(tokenTable, 1);
+
+			std::vector<char> expected;
+			const long long serial = measure([&] { Diff<InternedDataForDiff>(data0, data1).diff(Diff<InternedDataForDiff>::MYERS, expected); });
+			const size_t expectedCommon = WinWebDiffTest::checkEdscript(expected, data0, data1);
+			logMessage(L"partitioned diff of %zu tokens: serial %lld us\n", data0.recordCount(), serial);
+
+			const unsigned maxThreads = (std::max)(std::thread::hardware_concurrency(), 2u);
+			for (unsigned threads = 1; threads <= maxThreads; threads *= 2)
+			{
+				ThreadPool pool(threads - 1);
+				std::vector<char> actual;
+				const long long elapsed = measure([&]
+					{
+						Comparer::partitionedDiff(Diff<InternedDataForDiff>::MYERS, data0, data1, tokenTable.symbolCount(), actual, pool);
+					});
+				Assert::AreEqual(expectedCommon, WinWebDiffTest::checkEdscript(actual, data0, data1));
+				logMessage(L"  %2u threads: %lld us (x%.2f)\n", threads, elapsed, elapsed ? static_cast<double>(serial) / elapsed : 0.0);
+			}
+		}
+
+		TEST_METHOD(BenchmarkDiffBudget)
+		{
+			using InternedDiff = Diff<InternedDataForDiff>;
+			// Random words from a small vocabulary have no good alignment, the worst case for Myers
+			const wchar_t* words[] = { L"the", L"quick", L"brown", L"fox", L"jumps", L"over", L"lazy", L"dog", L"a", L"of",
+				L"and", L"to", L"in", L"is", L"it", L"that", L"was", L"for", L"on", L"are" };
+			std::vector<TextSegments> textSegments(2);
+			unsigned state = 1;
+			for (int pane = 0; pane < 2; ++pane)
+			{
+				std::wstring text;
+				for (size_t i = 0; i < 20000; ++i)
+				{
+					state = state * 1103515245 + 12345;
+					text += words[(state >> 16) % (sizeof(words) / sizeof(words[0]))];
+					text += L' ';
+				}
+				textSegments[pane].Make(text, false);
+			}
+			IWebDiffWindow::DiffOptions diffOptions{};
+			TokenTable tokenTable(textSegments, diffOptions);
+			InternedDataForDiff data0(tokenTable, 0), data1(tokenTable, 1);
+
+			for (auto timeLimit : { 0, 200, 50, 10 })
+			{
+				const DiffBudget budget(std::chrono::milliseconds(timeLimit), 0);
+				std::vector<char> edscript;
+				const long long elapsed = measure([&] { InternedDiff(data0, data1).diff(InternedDiff::MINIMAL, edscript, nullptr, &budget); });
+				logMessage(L"minimal diff of %zu tokens, time limit %d ms: %lld ms, %zu common tokens\n",
+					data0.recordCount(), timeLimit, elapsed / 1000, WinWebDiffTest::checkEdscript(edscript, data0, data1));
+			}
+
+			// Time from setting the cancellation flag until the diff returns
+			std::atomic<bool> cancelled{ false };
+			const DiffBudget budget(DiffBudget::Clock::duration::zero(), 0, &cancelled);
+			std::chrono::steady_clock::time_point cancelTime;
+			std::thread canceller([&]
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(20));
+					cancelTime = std::chrono::steady_clock::now();
+					cancelled = true;
+				});
+			std::vector<char> edscript;
+			const int result = InternedDiff(data0, data1).diff(InternedDiff::MINIMAL, edscript, nullptr, &budget);
+			auto end = std::chrono::steady_clock::now();
+			canceller.join();
+			if (result < 0)
+				logMessage(L"cancelled after %lld us\n",
+					static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(end - cancelTime).count()));
+			else
+				WinWebDiffTest::checkEdscript(edscript, data0, data1);
+		}
 	};
 }